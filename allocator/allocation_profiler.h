@@ -0,0 +1,236 @@
+#ifndef ALLOCATOR_ALLOCATION_PROFILER_H
+#define ALLOCATOR_ALLOCATION_PROFILER_H
+
+#include "allocator/containers.h"
+#include "allocator/object_header.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <string>
+
+namespace k3s {
+
+/**
+ * Sampling allocation profiler.
+ *
+ * An allocation is sampled once the mutator has allocated the current sampling interval of bytes. Intervals are
+ * drawn from the exponential distribution with the mean `GetMeanInterval()`, so allocation patterns periodic
+ * in bytes don't bias samples. A sample of an object of size `s` stands for `s / (1 - exp(-s / mean))` bytes
+ * (the expected amount allocated per sampled object of this size). Samples are aggregated by the allocating pc
+ * and the object type. Optionally each sampled object is checked by the next collection of its generation.
+ */
+class AllocationProfiler
+{
+public:
+    static constexpr size_t DEFAULT_SAMPLING_INTERVAL = 256U * 1024;
+
+    struct SiteProfile
+    {
+        size_t pc {0};
+        // Entry pc of the function which contains `pc`:
+        size_t function_pc {0};
+        ObjectHeader::Type type {};
+        size_t n_samples {0};
+        // Sum of weights of the samples:
+        double estimated_bytes {0};
+        // Samples which are checked by a collection and how many of them survived it:
+        size_t n_checked {0};
+        size_t n_survived {0};
+    };
+
+    /// Sampling is disabled if \p mean_interval is zero.
+    void Enable(size_t mean_interval, bool track_survival)
+    {
+        mean_interval_ = mean_interval;
+        is_tracking_survival_ = track_survival;
+        bytes_until_sample_ = IsEnabled() ? NextInterval() : ~size_t(0);
+    }
+
+    bool IsEnabled() const
+    {
+        return mean_interval_ != 0;
+    }
+
+    size_t GetMeanInterval() const
+    {
+        return mean_interval_;
+    }
+
+    // Allocations are seen by the slow path once this many bytes are allocated:
+    size_t GetBytesUntilSample() const
+    {
+        return bytes_until_sample_;
+    }
+
+    // Should be called by the allocation slow path, the next tracked object is sampled if the interval is exhausted:
+    void OnAllocation(size_t n_bytes)
+    {
+        if (!IsEnabled()) {
+            return;
+        }
+        if (n_bytes < bytes_until_sample_) {
+            bytes_until_sample_ -= n_bytes;
+            return;
+        }
+        is_sample_pending_ = true;
+        bytes_until_sample_ = NextInterval();
+    }
+
+    bool IsSamplePending() const
+    {
+        return is_sample_pending_;
+    }
+
+    void TakeSample(size_t pc, size_t function_pc, ObjectHeader *obj, bool is_young)
+    {
+        ASSERT(is_sample_pending_);
+        is_sample_pending_ = false;
+        size_t profile_idx = GetProfileIdx(pc, obj->GetType());
+        auto &profile = profiles_[profile_idx];
+        profile.function_pc = function_pc;
+        profile.n_samples++;
+        double size = obj->GetAllocatedSize();
+        profile.estimated_bytes += size / -std::expm1(-size / mean_interval_);
+        n_samples_++;
+        if (is_tracking_survival_) {
+            (is_young ? pending_young_ : pending_old_).push_back({obj, profile_idx});
+        }
+    }
+
+    /// Resolves young samples after marking of young collection (`is_alive` is called for each sampled object).
+    template <typename IsAliveFn>
+    void CheckYoungSamples(IsAliveFn is_alive)
+    {
+        CheckSamples(&pending_young_, is_alive);
+    }
+
+    /// Resolves samples in the old generation after tenured marking.
+    template <typename IsAliveFn>
+    void CheckOldSamples(IsAliveFn is_alive)
+    {
+        CheckSamples(&pending_old_, is_alive);
+    }
+
+    // A table of profiles sorted by estimated bytes:
+    void WriteReport(std::ostream &os) const
+    {
+        ConstVector<const SiteProfile *> sorted;
+        double total_bytes = 0;
+        for (const auto &profile : profiles_) {
+            sorted.push_back(&profile);
+            total_bytes += profile.estimated_bytes;
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const SiteProfile *lhs, const SiteProfile *rhs) {
+            return lhs->estimated_bytes > rhs->estimated_bytes;
+        });
+
+        os << "Allocation profile: " << n_samples_ << " samples, mean interval " << mean_interval_ << " bytes, ~"
+           << static_cast<uint64_t>(total_bytes) << " bytes allocated\n";
+        os << std::setw(14) << "bytes" << std::setw(8) << "%" << std::setw(10) << "samples" << std::setw(10)
+           << (is_tracking_survival_ ? "survived" : "") << std::setw(10) << "type" << std::setw(10) << "pc"
+           << std::setw(10) << "function" << "\n";
+        for (const auto *profile : sorted) {
+            os << std::setw(14) << static_cast<uint64_t>(profile->estimated_bytes) << std::setw(7) << std::fixed
+               << std::setprecision(1) << profile->estimated_bytes * 100 / total_bytes << "%" << std::setw(10)
+               << profile->n_samples << std::setw(10) << GetSurvivedColumn(*profile) << std::setw(10)
+               << GetTypeName(profile->type) << std::setw(10) << profile->pc << std::setw(10) << profile->function_pc << "\n";
+        }
+        if (is_tracking_survival_) {
+            os << "Survived: share of checked samples (the rest are not collected yet) which survived the next "
+               << "collection of their generation\n";
+        }
+    }
+
+    static const char *GetTypeName(ObjectHeader::Type type)
+    {
+        switch (type) {
+        case ObjectHeader::Type::STRING:
+            return "String";
+        case ObjectHeader::Type::FUNCTION:
+            return "Function";
+        case ObjectHeader::Type::ARRAY:
+            return "Array";
+        case ObjectHeader::Type::OBJECT:
+            return "Object";
+        default:
+            LOG_FATAL(GC, "Unexpected object type");
+        }
+    }
+
+private:
+    std::string GetSurvivedColumn(const SiteProfile &profile) const
+    {
+        if (!is_tracking_survival_) {
+            return "";
+        }
+        if (profile.n_checked == 0) {
+            return "-";
+        }
+        return std::to_string(profile.n_survived * 100 / profile.n_checked) + "%";
+    }
+
+    struct PendingSample
+    {
+        ObjectHeader *obj;
+        size_t profile_idx;
+    };
+
+    template <typename IsAliveFn>
+    void CheckSamples(ConstVector<PendingSample> *samples, IsAliveFn is_alive)
+    {
+        for (const auto &sample : *samples) {
+            auto &profile = profiles_[sample.profile_idx];
+            profile.n_checked++;
+            if (is_alive(sample.obj)) {
+                profile.n_survived++;
+            }
+        }
+        samples->clear();
+    }
+
+    size_t GetProfileIdx(size_t pc, ObjectHeader::Type type)
+    {
+        uint64_t key = (uint64_t(pc) << 8U) | static_cast<uint64_t>(type);
+        auto it = profile_ids_.find(key);
+        if (it != profile_ids_.end()) {
+            return it->second;
+        }
+        auto &profile = profiles_.emplace_back();
+        profile.pc = pc;
+        profile.type = type;
+        profile_ids_.emplace(key, profiles_.size() - 1);
+        return profiles_.size() - 1;
+    }
+
+    // Exponentially distributed interval, xorshift64 is enough here:
+    size_t NextInterval()
+    {
+        rng_state_ ^= rng_state_ << 13U;
+        rng_state_ ^= rng_state_ >> 7U;
+        rng_state_ ^= rng_state_ << 17U;
+        // Uniform in (0, 1]:
+        double uniform = static_cast<double>((rng_state_ >> 11U) + 1) / static_cast<double>(uint64_t(1) << 53U);
+        return std::max<size_t>(static_cast<size_t>(-std::log(uniform) * mean_interval_), 1);
+    }
+
+private:
+    size_t mean_interval_ {0};
+    bool is_tracking_survival_ {false};
+    size_t bytes_until_sample_ {~size_t(0)};
+    bool is_sample_pending_ {false};
+    uint64_t rng_state_ {0x9E3779B97F4A7C15ULL};
+    size_t n_samples_ {0};
+
+    ConstVector<SiteProfile> profiles_;
+    ConstUnorderedMap<uint64_t, size_t> profile_ids_;
+    ConstVector<PendingSample> pending_young_;
+    ConstVector<PendingSample> pending_old_;
+};
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_ALLOCATION_PROFILER_H
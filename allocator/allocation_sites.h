@@ -0,0 +1,106 @@
+#ifndef ALLOCATOR_ALLOCATION_SITES_H
+#define ALLOCATOR_ALLOCATION_SITES_H
+
+#include "allocator/containers.h"
+#include "allocator/object_header.h"
+#include <cstdint>
+
+namespace k3s {
+
+/**
+ * Feedback of a bytecode instruction which allocates objects.
+ * Counters are reset each time a decision about the site is made.
+ */
+struct AllocationSite
+{
+    size_t pc {0};
+    bool is_pretenured {false};
+    // Allocations in the nursery and how many of them survived their first young collection:
+    size_t allocated {0};
+    size_t survived {0};
+    // Allocations in the tenured space:
+    size_t pretenured_allocated {0};
+    // Allocations while the site is pretenured, used for sampling:
+    size_t n_requests {0};
+};
+
+class AllocationSites
+{
+public:
+    // Site is considered only after this number of allocations since the last decision:
+    static constexpr size_t MIN_SAMPLES = 100;
+    // Site is pretenured if this fraction of its objects survives the first young collection:
+    static constexpr size_t PRETENURE_SURVIVAL_PERCENT = 90;
+    // Each `SAMPLING_INTERVAL`-th allocation of a pretenured site is still done in the nursery to validate the decision.
+    // Pretenuring is reverted if less than `REVERT_SURVIVAL_PERCENT` of such objects survive:
+    static constexpr size_t SAMPLING_INTERVAL = 16;
+    static constexpr size_t REVERT_SURVIVAL_PERCENT = 50;
+
+    AllocationSites()
+    {
+        // Zero id means that the object isn't tracked:
+        sites_.emplace_back();
+    }
+
+    // Returns zero if there are no free ids:
+    ObjectHeader::SiteIdT GetSiteId(size_t pc)
+    {
+        if (pc >= site_ids_.size()) {
+            site_ids_.resize(pc + 1, 0);
+        }
+        if ((site_ids_[pc] == 0) && (sites_.size() <= ObjectHeader::MAX_SITE_ID)) {
+            site_ids_[pc] = sites_.size();
+            sites_.emplace_back().pc = pc;
+        }
+        return site_ids_[pc];
+    }
+
+    AllocationSite *GetSite(ObjectHeader::SiteIdT site_id)
+    {
+        ASSERT(site_id != 0 && site_id < sites_.size());
+        return &sites_[site_id];
+    }
+
+    // Calls `visitor(site_id, site)` for each tracked site:
+    template <typename VisitorFn>
+    void VisitSites(VisitorFn visitor) const
+    {
+        for (size_t site_id = 1; site_id < sites_.size(); site_id++) {
+            visitor(site_id, sites_[site_id]);
+        }
+    }
+
+    bool ShouldPretenure(ObjectHeader::SiteIdT site_id)
+    {
+        auto *site = GetSite(site_id);
+        return site->is_pretenured && ((++site->n_requests % SAMPLING_INTERVAL) != 0);
+    }
+
+    // Should be called after each young collection:
+    void UpdateAfterYoungCollection()
+    {
+        for (auto &site : sites_) {
+            if (site.allocated < MIN_SAMPLES) {
+                continue;
+            }
+            if (!site.is_pretenured && (site.survived * 100 >= site.allocated * PRETENURE_SURVIVAL_PERCENT)) {
+                LOG_INFO(GC, "Pretenuring allocation site at pc = " << site.pc);
+                site.is_pretenured = true;
+            } else if (site.is_pretenured && (site.survived * 100 < site.allocated * REVERT_SURVIVAL_PERCENT)) {
+                LOG_INFO(GC, "Pretenuring of allocation site at pc = " << site.pc << " is reverted");
+                site.is_pretenured = false;
+            }
+            site.allocated = 0;
+            site.survived = 0;
+        }
+    }
+
+private:
+    ConstVector<AllocationSite> sites_;
+    // Site id by pc (zero if the instruction hasn't allocated yet):
+    ConstVector<ObjectHeader::SiteIdT> site_ids_;
+};
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_ALLOCATION_SITES_H
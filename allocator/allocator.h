@@ -3,6 +3,8 @@
 
 #include "allocator/region.h"
 #include "allocator/gc_region.h"
+#include "allocator/heap_options.h"
+#include "allocator/virtual_memory.h"
 #include <sys/mman.h>
 #include <cstdint>
 #include <new>
@@ -11,29 +13,52 @@ namespace k3s {
 
 class Allocator
 {
-    static constexpr uintptr_t ALLOC_START_ADDR = 0xE000000;
-    static constexpr size_t ALLOC_SIZE = 1024 * 1024 * 32;
-    static constexpr size_t GC_INTERNALS_SIZE = ALLOC_SIZE / 8;
-    static constexpr size_t STACK_SIZE = ALLOC_SIZE / 8;
 public:
-    using ConstRegionT = Region<ALLOC_START_ADDR, ALLOC_SIZE / 2 - GC_INTERNALS_SIZE - STACK_SIZE>;
-    using GCInternalsRegionT = Region<ALLOC_START_ADDR + ALLOC_SIZE / 2 - GC_INTERNALS_SIZE - STACK_SIZE, GC_INTERNALS_SIZE>;
-    using StackRegionT = Region<ALLOC_START_ADDR + ALLOC_SIZE / 2 - STACK_SIZE, STACK_SIZE>;
-    using RuntimeRegionT = GCRegion<ALLOC_START_ADDR + ALLOC_SIZE / 2, ALLOC_SIZE / 2>;
+    static constexpr uintptr_t ALLOC_START_ADDR = 0xE000000;
+    // Metadata regions are mapped at once, their pages are committed by the OS on first access:
+    static constexpr size_t CONST_SIZE = 256U * 1024 * 1024;
+    static constexpr size_t GC_INTERNALS_SIZE = 256U * 1024 * 1024;
+    // Far registers of interpreter frames are reserved apart from the frames, so they don't limit the call depth:
+    static constexpr size_t FAR_REGS_STACK_SIZE = 8U * 1024 * 1024;
+    static constexpr size_t STACK_SIZE = 32U * 1024 * 1024 + FAR_REGS_STACK_SIZE;
+    static constexpr size_t METADATA_SIZE = CONST_SIZE + GC_INTERNALS_SIZE + STACK_SIZE;
+    // The heap is only reserved, `RuntimeRegionT` commits memory according to `HeapOptions`:
+    static constexpr uintptr_t HEAP_START_ADDR = ALLOC_START_ADDR + METADATA_SIZE;
+    static constexpr size_t HEAP_RESERVED_SIZE = 64UL * 1024 * 1024 * 1024;
+    // The class file is mapped at a fixed address too, so a runtime image may keep pointers into it:
+    static constexpr uintptr_t CLASS_FILE_ADDR = HEAP_START_ADDR + HEAP_RESERVED_SIZE;
+    static constexpr size_t CLASS_FILE_RESERVED_SIZE = 4UL * 1024 * 1024 * 1024;
+    static constexpr uintptr_t ALLOC_END_ADDR = CLASS_FILE_ADDR + CLASS_FILE_RESERVED_SIZE;
+
+    using ConstRegionT = Region<ALLOC_START_ADDR, CONST_SIZE>;
+    using GCInternalsRegionT = Region<ALLOC_START_ADDR + CONST_SIZE, GC_INTERNALS_SIZE>;
+    using StackRegionT = Region<ALLOC_START_ADDR + CONST_SIZE + GC_INTERNALS_SIZE, STACK_SIZE>;
+    using RuntimeRegionT = GCRegion<HEAP_START_ADDR, HEAP_RESERVED_SIZE>;
 
-    static void Init()
+    static void Init(const HeapOptions &heap_options)
     {
-        void *buf = mmap(reinterpret_cast<void *>(ALLOC_START_ADDR), ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-        ASSERT(buf == reinterpret_cast<void *>(ALLOC_START_ADDR));
+        Map();
         ConstRegionT::Reset();
         GCInternalsRegionT::Reset();
         StackRegionT::Reset();
-        RuntimeRegionT::Reset();
+        RuntimeRegionT::Init(heap_options);
+    }
+
+    // Maps address ranges of the regions without initializing them (a runtime image fills them in place):
+    static void Map()
+    {
+        void *buf = mmap(reinterpret_cast<void *>(ALLOC_START_ADDR), METADATA_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (buf != reinterpret_cast<void *>(ALLOC_START_ADDR)) {
+            LOG_FATAL(ALLOCATOR, "Can't map metadata regions");
+        }
+        ReserveMemory(HEAP_START_ADDR, HEAP_RESERVED_SIZE);
+        ReserveMemory(CLASS_FILE_ADDR, CLASS_FILE_RESERVED_SIZE);
     }
 
     static void Destroy()
     {
-        munmap(reinterpret_cast<void *>(ALLOC_START_ADDR), ALLOC_SIZE);
+        munmap(reinterpret_cast<void *>(ALLOC_START_ADDR), ALLOC_END_ADDR - ALLOC_START_ADDR);
     }
 
     auto &ConstRegion()
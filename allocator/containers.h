@@ -11,8 +11,6 @@ namespace k3s {
 
 template <typename T>
 using ConstVector = std::vector<T, decltype(Allocator().ConstRegion().Adapter<T>())>;
-template <typename T>
-using ArenaVector = std::vector<T, decltype(Allocator().ObjectsRegion().Adapter<T>())>;
 
 template <typename T>
 using StackVector = std::vector<T, decltype(Allocator().StackRegion().Adapter<T>())>;
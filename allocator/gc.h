@@ -1,9 +1,16 @@
 #ifndef ALLOCATOR_GC_H
 #define ALLOCATOR_GC_H
 
+#include "allocator/allocation_profiler.h"
+#include "allocator/allocation_sites.h"
 #include "allocator/containers.h"
+#include "allocator/gc_telemetry.h"
 #include "allocator/object_header.h"
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <csignal>
+#include <ostream>
 
 
 namespace k3s {
@@ -11,9 +18,39 @@ namespace k3s {
 class GC
 {
 public:
+    static constexpr size_t DEFAULT_PAUSE_BUDGET_US = 1000;
+    // Tenured marking starts when occupancy of the tenured space exceeds this threshold:
+    static constexpr size_t TENURED_MARKING_THRESHOLD_PERCENT = 50;
+    // Tenured space is doubled if its occupancy after sweeping still exceeds this threshold:
+    static constexpr size_t TENURED_GROWTH_THRESHOLD_PERCENT = 70;
+    // An incremental step of tenured collection is performed each time the mutator allocates this amount:
+    static constexpr size_t TENURED_STEP_ALLOCATION_BYTES = 64 * 1024;
+    static constexpr size_t TENURED_WORKLISTS_RESERVE = 16 * 1024;
+    // Nursery size is adapted once per this number of nursery collections:
+    static constexpr size_t NURSERY_ADAPT_INTERVAL = 8;
+    // If survival rate exceeds this threshold, the nursery shrinks to promote long-lived objects earlier:
+    static constexpr size_t NURSERY_HIGH_SURVIVAL_PERCENT = 50;
+    // Changes of GC cost per allocated MB within this threshold are considered noise:
+    static constexpr size_t NURSERY_COST_TOLERANCE_PERCENT = 5;
+    static constexpr size_t NURSERY_RESIZE_PERCENT = 150;
+    // Value of the tenuring threshold option which means that the threshold is adapted at runtime:
+    static constexpr size_t ADAPTIVE_TENURING_THRESHOLD = ~size_t(0);
+    static constexpr size_t MAX_TENURING_THRESHOLD = ObjectHeader::MAX_AGE;
+    // Adaptive threshold is chosen so that survivors fill this fraction of the desired survivor space size:
+    static constexpr size_t TARGET_SURVIVOR_PERCENT = 50;
+
+    enum class TenuredPhase {
+        IDLE,
+        MARKING,
+        SWEEPING,
+    };
+
     GC()
     {
         timestamp_ = std::chrono::steady_clock::now();
+        grey_objects_.reserve(TENURED_WORKLISTS_RESERVE);
+        remembered_set_.reserve(TENURED_WORKLISTS_RESERVE);
+        promoted_objects_.reserve(TENURED_WORKLISTS_RESERVE);
     }
     struct DanglingReference
     {
@@ -59,17 +96,14 @@ public:
                 return;
             }
             
-            // For both cases below `new_ref` should be valid
-            auto new_ref = (*GetDanglingRef())->GetRelocatedPtr();
+            // case 1: `ref_holder` was relocated (`dangling_ref_holder` was in region being cleaned). The reference
+            // is read from the new copy, as the forwarding pointer may overlay it in the old one.
+            // case 2: `ref_holder` wasn't relocated (`dangling_ref_holder` wasn't in region being cleaned):
+            auto *ref_holder = GetRefHolder()->WasRelocated() ? GetRefHolder()->GetRelocatedPtr() : GetRefHolder();
+            auto **dangling_ref = GetDanglingRefFrom(ref_holder);
+            auto new_ref = (*dangling_ref)->GetRelocatedPtr();
             ASSERT(new_ref != nullptr);
-            if (GetRefHolder()->WasRelocated()) {
-                // case 1: `ref_holder` was relocated (`dangling_ref_holder` was in region being cleaned):
-                ASSERT((*GetDanglingRefFrom(GetRefHolder()->GetRelocatedPtr()))->GetRelocatedPtr() == new_ref);
-                *GetDanglingRefFrom(GetRefHolder()->GetRelocatedPtr()) = new_ref;
-            } else {
-                // case 2: `ref_holder` wasn't relocated (`dangling_ref_holder` wasn't in region being cleaned):
-                *GetDanglingRef() = new_ref;
-            }
+            *dangling_ref = new_ref;
         }
 
         ObjectHeader *GetRefHolder() const
@@ -92,11 +126,28 @@ public:
         ptrdiff_t offset_to_dangling_ref;
     };
     
+    // Statistics of nursery collections since the last resizing of the nursery:
+    struct NurseryStats
+    {
+        size_t n_collections {0};
+        size_t allocated_bytes {0};
+        size_t survived_bytes {0};
+        size_t gc_time_us {0};
+    };
+
+    // Bytes copied to the survivor space by age (after copying) and bytes promoted:
+    struct AgeStats
+    {
+        std::array<size_t, ObjectHeader::MAX_AGE + 1> survived_bytes {};
+        size_t promoted_bytes {0};
+    };
+
     struct GCStageState
     {
     public:
-        GCVector<ObjectHeader *> target_objects;
+        GCVector<Register> target_objects;
         size_t estimating_realloc_size;
+        std::array<size_t, ObjectHeader::MAX_AGE + 1> estimating_size_by_age;
         GCVector<DanglingReference> references_to_targets;
     };
 
@@ -114,10 +165,12 @@ public:
 
     void FinalizeStage();
 
-    void AppendAliveObject(ObjectHeader *obj)
+    void AppendAliveObject(const Register &obj)
     {
-        ASSERT(obj != nullptr);
-        stages_stack_.back().estimating_realloc_size += obj->GetAllocatedSize();
+        ASSERT(!obj.IsPrimitive());
+        auto *obj_header = obj.GetAsObjectHeader();
+        stages_stack_.back().estimating_realloc_size += obj_header->GetAllocatedSize();
+        stages_stack_.back().estimating_size_by_age[obj_header->GetAge()] += obj_header->GetAllocatedSize();
         stages_stack_.back().target_objects.push_back(obj);
     }
 
@@ -136,15 +189,26 @@ public:
         return stages_stack_.back().estimating_realloc_size;
     }
 
-    ObjectHeader *PopAliveObject()
+    // Size of alive objects which have survived at least `min_age` collections:
+    size_t GetEstimatedSpaceOfAges(size_t min_age)
+    {
+        size_t size = 0;
+        for (size_t age = min_age; age <= ObjectHeader::MAX_AGE; age++) {
+            size += stages_stack_.back().estimating_size_by_age[age];
+        }
+        return size;
+    }
+
+    // Returns primitive register if there are no more objects:
+    Register PopAliveObject()
     {
         if (stages_stack_.back().target_objects.size() == 0) {
-            return nullptr;
+            return {};
         }
-        auto *obj = stages_stack_.back().target_objects.back();
+        auto obj = stages_stack_.back().target_objects.back();
         stages_stack_.back().target_objects.pop_back();
-        ASSERT(obj != nullptr);
-        ASSERT(!obj->WasRelocated());
+        ASSERT(!obj.IsPrimitive());
+        ASSERT(!obj.GetAsObjectHeader()->WasRelocated());
         return obj;
     }
     DanglingReference PopRefToMovedObject()
@@ -169,9 +233,10 @@ public:
         }
     }
 
+    // Live young objects are marked either by the previous collection or never, so a few epochs are enough:
     void InitMark()
     {
-        mark_ += 1; 
+        mark_ = (mark_ % ObjectHeader::MAX_MARK) + 1;
     }
 
     auto GetMark()
@@ -191,11 +256,343 @@ public:
         return is_trigger_forbidden_;
     }
 
+    // Should be called after marking, objects of age 0 are the ones allocated in the nursery:
+    void RecordNurseryCollection(size_t allocated_bytes)
+    {
+        telemetry_.RecordNurseryCollection(allocated_bytes);
+        auto mark = mark_;
+        profiler_.CheckYoungSamples([mark](const ObjectHeader *obj) {
+            return obj->IsMarked(mark);
+        });
+        nursery_stats_.n_collections++;
+        nursery_stats_.allocated_bytes += allocated_bytes;
+        nursery_stats_.survived_bytes += stages_stack_.back().estimating_size_by_age[0];
+        last_age_stats_ = {};
+    }
+
+    void RecordSurvivor(size_t age, size_t size)
+    {
+        last_age_stats_.survived_bytes[age] += size;
+        total_age_stats_.survived_bytes[age] += size;
+    }
+
+    // Objects which have survived `GetTenuringThreshold()` collections are promoted:
+    size_t GetTenuringThreshold() const
+    {
+        return tenuring_threshold_;
+    }
+
+    void SetTenuringThreshold(size_t threshold)
+    {
+        is_tenuring_adaptive_ = (threshold == ADAPTIVE_TENURING_THRESHOLD);
+        if (is_tenuring_adaptive_) {
+            threshold = MAX_TENURING_THRESHOLD;
+        } else if (threshold > MAX_TENURING_THRESHOLD) {
+            LOG_FATAL(GC, "Tenuring threshold should be in [0, " << MAX_TENURING_THRESHOLD << "]");
+        }
+        tenuring_threshold_ = threshold;
+    }
+
+    // Statistics of the last young collection and totals since startup:
+    const AgeStats &GetLastAgeStats() const
+    {
+        return last_age_stats_;
+    }
+
+    const AgeStats &GetTotalAgeStats() const
+    {
+        return total_age_stats_;
+    }
+
+    /**
+     * Allocations of the mutator are attributed to the instruction at `pc`: `BeginSiteAllocation` should be called
+     * before allocating and `EndSiteAllocation` right after the allocated object is initialized.
+     */
+    void BeginSiteAllocation(size_t pc)
+    {
+        current_site_id_ = allocation_sites_.GetSiteId(pc);
+        pretenure_decision_ = PretenureDecision::UNDECIDED;
+        // Objects of pretenured sites are allocated by the slow path:
+        if (IsPretenuringSite()) {
+            Allocator::RuntimeRegionT::UpdateAllocationLimit();
+        }
+    }
+
+    void EndSiteAllocation(const Register &obj)
+    {
+        // Common case: a tracked site which isn't pretenured has allocated in the nursery and no sample is due:
+        auto *obj_header = obj.GetAsObjectHeader();
+        if (LIKELY((current_site_id_ != 0) && Allocator::RuntimeRegionT::GetNursery()->Contains(obj_header) &&
+                   !profiler_.IsSamplePending())) {
+            auto *site = allocation_sites_.GetSite(current_site_id_);
+            if (LIKELY(!site->is_pretenured)) {
+                obj_header->SetSiteId(current_site_id_);
+                site->allocated++;
+                current_site_id_ = 0;
+                return;
+            }
+        }
+        EndSiteAllocationSlow(obj);
+    }
+
+    /**
+     * The decision is made once per site allocation: an object and its methods are allocated in one generation,
+     * as neither the initializing stores nor the shading of pretenured objects cover mixed ones.
+     */
+    bool ShouldPretenure()
+    {
+        if (current_site_id_ == 0) {
+            return false;
+        }
+        if (pretenure_decision_ == PretenureDecision::UNDECIDED) {
+            bool should_pretenure = allocation_sites_.ShouldPretenure(current_site_id_);
+            pretenure_decision_ = should_pretenure ? PretenureDecision::TENURED : PretenureDecision::NURSERY;
+        }
+        return pretenure_decision_ == PretenureDecision::TENURED;
+    }
+
+    // May be called only before the first object of the site allocation is placed in the tenured space:
+    void CancelPretenuring()
+    {
+        pretenure_decision_ = PretenureDecision::NURSERY;
+    }
+
+    bool IsPretenuringSite()
+    {
+        return (current_site_id_ != 0) && allocation_sites_.GetSite(current_site_id_)->is_pretenured;
+    }
+
+    // Number of bytes which may be allocated in the nursery before the allocation slow path should be taken:
+    size_t GetFastAllocationBudget()
+    {
+        if (IsPretenuringSite()) {
+            return 0;
+        }
+        size_t budget = profiler_.GetBytesUntilSample();
+        if (tenured_phase_ == TenuredPhase::IDLE) {
+            return budget;
+        }
+        return std::min(budget, TENURED_STEP_ALLOCATION_BYTES - std::min(allocated_since_step_, TENURED_STEP_ALLOCATION_BYTES));
+    }
+
+    // Should be called for each object which survives its first young collection:
+    void RecordSiteSurvivor(const ObjectHeader *obj)
+    {
+        if (obj->GetSiteId() != 0) {
+            allocation_sites_.GetSite(obj->GetSiteId())->survived++;
+        }
+    }
+
+    auto *GetAllocationSites()
+    {
+        return &allocation_sites_;
+    }
+
+    // Large objects belong to the old generation too, they are treated as tenured:
+    static bool IsTenured(const void *ptr)
+    {
+        return Allocator::RuntimeRegionT::GetTenured()->Contains(ptr) || Allocator::RuntimeRegionT::GetLargeSpace()->Contains(ptr);
+    }
+
+    /**
+     * Should be called on each store of `new_value` to a field of heap object `holder` (before the store).
+     * 
+     * During tenured marking this is a snapshot-at-the-beginning barrier: overwritten references are shaded,
+     * so everything reachable at the start of marking is marked. Besides, tenured objects which receive
+     * references to young objects are added to the remembered set, so young collections don't trace tenured space.
+     */
+    void WriteBarrier(const Register &holder, const Register &old_value, const Register &new_value)
+    {
+        if (tenured_phase_ == TenuredPhase::MARKING) {
+            ShadeObject(old_value, &grey_objects_);
+        }
+        if (!new_value.IsPrimitive() && IsTenured(holder.GetAsObjectHeader()) && !IsTenured(new_value.GetAsObjectHeader())) {
+            Remember(holder);
+        }
+    }
+
+    // Allocation slow path: incremental steps of tenured collection are interleaved with the mutator here.
+    // Bytes allocated by the fast path since the last call are included in \p n_bytes.
+    void OnAllocation(size_t n_bytes)
+    {
+        if (UNLIKELY(IsHeapSnapshotDue()) && !IsTriggerForbidden()) {
+            TakeHeapSnapshot();
+        }
+        profiler_.OnAllocation(n_bytes);
+        if (tenured_phase_ == TenuredPhase::IDLE) {
+            return;
+        }
+        allocated_since_step_ += n_bytes;
+        if ((allocated_since_step_ >= TENURED_STEP_ALLOCATION_BYTES) && !IsTriggerForbidden()) {
+            allocated_since_step_ = 0;
+            TenuredCollectionStep();
+        }
+    }
+
+    void AppendPromotedObject(const Register &obj)
+    {
+        last_age_stats_.promoted_bytes += obj.GetAsObjectHeader()->GetAllocatedSize();
+        total_age_stats_.promoted_bytes += obj.GetAsObjectHeader()->GetAllocatedSize();
+        promoted_objects_.push_back(obj);
+    }
+
+    auto *GetRememberedSet()
+    {
+        return &remembered_set_;
+    }
+
+    TenuredPhase GetTenuredPhase() const
+    {
+        return tenured_phase_;
+    }
+
+    void SetPauseBudget(size_t pause_budget_us)
+    {
+        pause_budget_us_ = pause_budget_us;
+    }
+
+    GCTelemetry *GetTelemetry()
+    {
+        return &telemetry_;
+    }
+
+    AllocationProfiler *GetAllocationProfiler()
+    {
+        return &profiler_;
+    }
+
+    /**
+     * Snapshots are written to `<path>.<N>` by the allocation slow path (at the latest when the nursery is full),
+     * once requested or once `allocated_bytes` (if it isn't zero) are allocated since startup.
+     */
+    void EnableHeapSnapshots(const char *path, size_t allocated_bytes)
+    {
+        heap_snapshot_path_ = path;
+        heap_snapshot_allocated_bytes_ = allocated_bytes;
+    }
+
+    // May be called from a signal handler:
+    void RequestHeapSnapshot()
+    {
+        is_heap_snapshot_requested_ = 1;
+    }
+
+    // Should be called if the runtime is mapped from the code cache, which is written before the program starts:
+    void ResetClock()
+    {
+        timestamp_ = std::chrono::steady_clock::now();
+        telemetry_.ResetClock();
+    }
+
+    // Collects the whole heap and drops garbage left in the young regions, so a runtime image keeps only live data:
+    void PrepareRuntimeImage();
+
+    // Each pause of the mutator should be enclosed by these calls, nested pauses are merged into the outer one:
+    void BeginPause(GCTelemetry::PauseKind kind, GCTelemetry::Cause cause);
+    void EndPause();
+    // Writes telemetry and age statistics since startup as a JSON object:
+    void WriteTelemetryJson(std::ostream &os);
+
+    // Calls `visitor(value, slot)` for the callee and live registers of each frame (`slot` is nullptr for primitives).
+    // Registers which are dead according to stack maps are cleared, so they never keep stale references:
+    template <typename VisitorFn>
+    static void VisitStackRoots(VisitorFn visitor);
+    // Called before young collection. Traces young objects of the tenured worklist, so it refers only to tenured objects:
+    void TraceYoungGreyObjects();
+    // Performs a bounded (by the pause budget) step of the current tenured collection cycle:
+    void TenuredCollectionStep();
+    // Completes tenured collection synchronously. Called when the tenured space is exhausted during young collection
+    // or when the large object space is exhausted. A fresh cycle is started if `has_enough_space()` returns false then:
+    template <typename HasEnoughSpaceFn>
+    void CollectTenured(GCTelemetry::Cause cause, HasEnoughSpaceFn has_enough_space);
+
+private:
+    template <typename WorkListT>
+    void ShadeObject(const Register &obj, WorkListT *worklist)
+    {
+        if (obj.IsPrimitive()) {
+            return;
+        }
+        auto *obj_header = obj.GetAsObjectHeader();
+        if (!obj_header->IsTenuredMarked(tenured_mark_)) {
+            obj_header->MarkTenured(tenured_mark_);
+            worklist->push_back(obj);
+        }
+    }
+
+    void Remember(const Register &holder)
+    {
+        auto *obj_header = holder.GetAsObjectHeader();
+        if (!obj_header->IsRemembered()) {
+            obj_header->SetRemembered(true);
+            remembered_set_.push_back(holder);
+        }
+    }
+
+    bool IsHeapSnapshotDue()
+    {
+        if (heap_snapshot_path_ == nullptr) {
+            return false;
+        }
+        return (is_heap_snapshot_requested_ != 0) || ((heap_snapshot_allocated_bytes_ != 0) &&
+               (telemetry_.GetAllocatedBytes(Allocator::RuntimeRegionT::GetNursery()->GetUsedSpace()) >= heap_snapshot_allocated_bytes_));
+    }
+
+    // Collects the whole heap and writes every object which is left:
+    void TakeHeapSnapshot();
+    void EndSiteAllocationSlow(const Register &obj);
+    void AfterYoungCollection();
+    bool ShouldStartTenuredMarking();
+    void AdaptNurserySize();
+    void AdaptTenuringThreshold();
+    void StartTenuredMarking();
+    void MarkAndSweepTenured();
+    void FinishTenuredMarking();
+    template <typename WorkListT>
+    void ShadeRoots(WorkListT *worklist);
+    template <typename WorkListT, typename ShouldYieldFn>
+    bool DrainWorklist(WorkListT *worklist, ShouldYieldFn should_yield);
+    template <typename ShouldYieldFn>
+    bool SweepTenured(ShouldYieldFn should_yield);
+    static bool HasYoungReferences(const Register &obj);
+    static GCTelemetry::HeapOccupancy GetHeapOccupancy();
+
 private:
     std::chrono::steady_clock::time_point timestamp_;
     bool is_trigger_forbidden_ {false};
     ObjectHeader::MarkT mark_ {0};
     GCVector<GCStageState> stages_stack_;
+
+    NurseryStats nursery_stats_ {};
+    // GC time per allocated MB of the previous nursery size (zero if unknown):
+    double prev_nursery_cost_ {0};
+    bool is_nursery_growing_ {true};
+
+    size_t tenuring_threshold_ {MAX_TENURING_THRESHOLD};
+    bool is_tenuring_adaptive_ {true};
+    AgeStats last_age_stats_ {};
+    AgeStats total_age_stats_ {};
+
+    AllocationSites allocation_sites_;
+    ObjectHeader::SiteIdT current_site_id_ {0};
+    enum class PretenureDecision { UNDECIDED, TENURED, NURSERY } pretenure_decision_ {PretenureDecision::UNDECIDED};
+
+    // Tenured collection state (survives young collections, so it is kept outside of `GcInternalsRegion`):
+    TenuredPhase tenured_phase_ {TenuredPhase::IDLE};
+    ObjectHeader::TenuredMarkT tenured_mark_ {0};
+    size_t pause_budget_us_ {DEFAULT_PAUSE_BUDGET_US};
+    size_t allocated_since_step_ {0};
+    ConstVector<Register> grey_objects_;
+    ConstVector<Register> remembered_set_;
+    ConstVector<Register> promoted_objects_;
+
+    GCTelemetry telemetry_;
+    AllocationProfiler profiler_;
+
+    const char *heap_snapshot_path_ {nullptr};
+    size_t heap_snapshot_allocated_bytes_ {0};
+    size_t n_heap_snapshots_ {0};
+    volatile std::sig_atomic_t is_heap_snapshot_requested_ {0};
 };
 
 }  // namespace k3s
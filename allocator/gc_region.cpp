@@ -1,66 +1,156 @@
 #include "runtime/runtime.h"
+#include "allocator/heap_snapshot.h"
+#include <algorithm>
+#include <fstream>
+#include <string>
 
 namespace k3s {
-#define REGIONS_POOL_ARGS() template <uintptr_t START_PTR, size_t REGION_SIZE, size_t N_REGIONS, size_t REMAINING_SIZE>
-#define REGIONS_POOL() RegionsPool<START_PTR, REGION_SIZE, N_REGIONS, REMAINING_SIZE>
-
 #define GC_REGION_ARGS() template <uintptr_t START_PTR, size_t SIZE>
 #define GC_REGION() GCRegion<START_PTR, SIZE>
 
-    REGIONS_POOL_ARGS()
-    void REGIONS_POOL()::CleanupThis()
+    GC_REGION_ARGS()
+    void GC_REGION()::Init(const HeapOptions &options)
+    {
+        size_t nursery_size = AlignUp(options.nursery_size, PAGE_SIZE);
+        size_t min_nursery_size = AlignUp(options.min_nursery_size, PAGE_SIZE);
+        size_t max_nursery_size = AlignUp(options.max_nursery_size, (options.huge_pages != 0) ? HUGE_PAGE_SIZE : PAGE_SIZE);
+        size_t tenured_size = AlignUp(options.tenured_size, PAGE_SIZE);
+        if ((min_nursery_size == 0) || (nursery_size < min_nursery_size) || (nursery_size > max_nursery_size)) {
+            LOG_FATAL(ALLOCATOR, "Nursery size should be in [min nursery size, max nursery size]");
+        }
+        // The nursery and both survivor spaces may grow up to `max_nursery_size`:
+        size_t young_size = max_nursery_size * 3;
+        if (young_size + tenured_size > options.max_heap_size) {
+            LOG_FATAL(ALLOCATOR, "Young regions (at max nursery size) and initial tenured space exceed max heap size");
+        }
+        // Both the tenured space and the large object space reserve the whole old generation:
+        size_t max_old_size = options.max_heap_size - young_size;
+        max_old_size -= max_old_size % PAGE_SIZE;
+        size_t reserved_size = SIZE - YOUNG_OFFSET;
+        if (young_size > reserved_size) {
+            LOG_FATAL(ALLOCATOR, "Young regions (at max nursery size) exceed reserved space (" << reserved_size << " bytes)");
+        }
+        if (young_size + 2 * max_old_size > reserved_size) {
+            // The largest heap whose old generation fits twice into the rest of the reserved space:
+            LOG_FATAL(ALLOCATOR, "Max heap size exceeds reserved space (at most "
+                      << young_size + (reserved_size - young_size) / 2 << " bytes)");
+        }
+
+        CommitMemory(reinterpret_cast<void *>(START_PTR), CONTROL_SIZE);
+        auto *control = new (reinterpret_cast<void *>(START_PTR)) Control();
+        control->min_nursery_size = min_nursery_size;
+        control->max_nursery_size = max_nursery_size;
+        auto *young_start = reinterpret_cast<char *>(START_PTR) + YOUNG_OFFSET;
+        // The advice is given before anything is committed, so that pages are huge from the first fault:
+        if (options.huge_pages != 0) {
+            AdviseHugePages(young_start, young_size + max_old_size);
+        }
+        bool prefault = (options.prefault != 0);
+        control->nursery.Init(young_start, nursery_size, max_nursery_size, prefault);
+        // The first allocation takes the slow path, which sets the actual limit:
+        control->allocation_limit = control->nursery.GetTop();
+        control->allocation_start = control->nursery.GetTop();
+        size_t survivor_size = AlignUp(nursery_size / SURVIVOR_RATIO, PAGE_SIZE);
+        for (size_t i = 0; i < 2; i++) {
+            control->survivors[i].Init(young_start + (i + 1) * max_nursery_size, survivor_size, max_nursery_size, prefault);
+        }
+        control->from_idx = 0;
+        control->release_evacuated = (options.release_evacuated != 0);
+        control->max_old_size = max_old_size;
+        control->tenured.Init(young_start + young_size, tenured_size, max_old_size, prefault);
+        control->large_space.Init(young_start + young_size + max_old_size, max_old_size);
+    }
+
+    GC_REGION_ARGS()
+    void GC_REGION()::CollectYoung()
     {
         if (Runtime::GetGC()->IsTriggerForbidden()) {
             LOG_FATAL(GC, "GC Trigger was forbidden");
         }
-        LOG_DEBUG(GC, "Cleanup region " << N_REGIONS << " (start_ptr = " << START_PTR << ")");
+        LOG_DEBUG(GC, "Young collection");
+        Runtime::GetGC()->BeginPause(GCTelemetry::PauseKind::YOUNG, GCTelemetry::Cause::NURSERY_FULL);
         Runtime::GetGC()->PrepareNewStage();
         MarkAndFetchTargetObjects();
+        Runtime::GetGC()->RecordNurseryCollection(GetNursery()->GetUsedSpace());
         MoveObjects();
         RebindLinks();
-        decltype(this_)::Reset();
+        if (GetControl()->release_evacuated) {
+            GetNursery()->ReleaseUsedPages();
+            GetFromSpace()->ReleaseUsedPages();
+        }
+        GetNursery()->Reset();
+        GetFromSpace()->Reset();
+        GetControl()->from_idx = 1 - GetControl()->from_idx;
         Runtime::GetGC()->FinalizeStage();
+        GetControl()->allocation_start = GetNursery()->GetTop();
+        UpdateAllocationLimit();
+        Runtime::GetGC()->EndPause();
+    }
+
+    // The nursery may be smaller than an object, then it is grown (up to the max nursery size):
+    GC_REGION_ARGS()
+    void GC_REGION()::EnsureNurseryFits(size_t n_bytes)
+    {
+        auto *nursery = GetNursery();
+        if (nursery->GetRemainingSpace() >= n_bytes) {
+            return;
+        }
+        CollectYoung();
+        if (nursery->GetCapacity() < n_bytes) {
+            if (n_bytes > nursery->GetMaxCapacity()) {
+                LOG_FATAL(ALLOCATOR, "Object of " << n_bytes << " bytes doesn't fit in the nursery");
+            }
+            nursery->Resize(AlignUp(n_bytes, PAGE_SIZE));
+        }
     }
    
-    REGIONS_POOL_ARGS()
-    void REGIONS_POOL()::MarkAndFetchTargetObjects()
+    GC_REGION_ARGS()
+    void GC_REGION()::MarkAndFetchTargetObjects()
     {
-        auto &state_stack = *Runtime::GetInterpreter()->GetStateStack();
         Runtime::GetGC()->InitMark();
+        // Young objects pending for tenured marking aren't roots, otherwise everything shaded by the barrier
+        // would survive until the end of marking. Instead they are traced now, so only tenured objects are left:
+        Runtime::GetGC()->TraceYoungGreyObjects();
         
-        for (auto &state : state_stack) {
-            if (MarkAndFetchRecursively(Register(state.callee_))) {
-                Runtime::GetGC()->AppendRefToAliveObject(reinterpret_cast<ObjectHeader **>(&state.callee_));
-            }
-            if (MarkAndFetchRecursively(state.acc_)) {
-                Runtime::GetGC()->AppendRefToAliveObject(state.acc_.GetObjectHeaderPtr());
-            }
-            for (auto &vreg : state.regs_) {
-                if (MarkAndFetchRecursively(vreg)) {
-                    Runtime::GetGC()->AppendRefToAliveObject(vreg.GetObjectHeaderPtr());
-                }
+        GC::VisitStackRoots([](const Register &value, ObjectHeader **slot) {
+            if (MarkAndFetchRecursively(value)) {
+                Runtime::GetGC()->AppendRefToAliveObject(slot);
             }
+        });
+        // Tenured objects aren't traced, references from them to young objects are found via the remembered set:
+        for (const auto &holder : *Runtime::GetGC()->GetRememberedSet()) {
+            MarkChildren(holder);
         }
     }
 
-    REGIONS_POOL_ARGS()
-    bool REGIONS_POOL()::MarkAndFetchRecursively(Register vreg)
+    GC_REGION_ARGS()
+    bool GC_REGION()::MarkAndFetchRecursively(Register vreg)
     {
         if (vreg.IsPrimitive()) {
             return false;
         }
         auto *obj_header = vreg.GetAsObjectHeader(); 
-        bool should_be_realocated = GetThis().Contains(obj_header);
+        if (GC::IsTenured(obj_header)) {
+            return false;
+        }
+        bool should_be_realocated = IsCollected(obj_header);
         if (vreg.GetAsObjectHeader()->IsMarked(Runtime::GetGC()->GetMark())) {
             return should_be_realocated;
         }
         obj_header->Mark(Runtime::GetGC()->GetMark());
 
         if (should_be_realocated) {
-            Runtime::GetGC()->AppendAliveObject(obj_header);
+            Runtime::GetGC()->AppendAliveObject(vreg);
         }
-    
-        switch (vreg.GetType())
+        MarkChildren(vreg);
+        return should_be_realocated;
+    }
+
+    GC_REGION_ARGS()
+    void GC_REGION()::MarkChildren(const Register &obj)
+    {
+        auto *obj_header = obj.GetAsObjectHeader(); 
+        switch (obj.GetType())
         {
         case Register::Type::ARR:
             MarkArray(obj_header);
@@ -76,11 +166,10 @@ namespace k3s {
         default:
             LOG_FATAL(GC, "Unexpected object type");
         }
-        return should_be_realocated;
     }
 
-    REGIONS_POOL_ARGS()
-    void REGIONS_POOL()::MarkArray(ObjectHeader *obj)
+    GC_REGION_ARGS()
+    void GC_REGION()::MarkArray(ObjectHeader *obj)
     {
         auto *array = static_cast<coretypes::Array *>(obj);
         for (size_t i = 0; i < array->GetSize(); i++) {
@@ -91,8 +180,8 @@ namespace k3s {
         }
     }
 
-    REGIONS_POOL_ARGS()
-    void REGIONS_POOL()::MarkObject(ObjectHeader *obj)
+    GC_REGION_ARGS()
+    void GC_REGION()::MarkObject(ObjectHeader *obj)
     {
         auto *object = static_cast<coretypes::Object *>(obj);
         for (size_t i = 0; i < object->GetSize(); i++) {
@@ -103,8 +192,8 @@ namespace k3s {
         }
     }
 
-    REGIONS_POOL_ARGS()
-    void REGIONS_POOL()::MarkFunction(ObjectHeader *obj)
+    GC_REGION_ARGS()
+    void GC_REGION()::MarkFunction(ObjectHeader *obj)
     {
         auto *func = static_cast<coretypes::Function *>(obj);
 
@@ -126,26 +215,60 @@ namespace k3s {
         }
     }
     
-    REGIONS_POOL_ARGS()
-    void REGIONS_POOL()::MoveObjects()
-    {
-        if (GetOthers().GetThis().GetRemainingSpace() < Runtime::GetGC()->GetEstimatedSpace()) {
-            GetOthers().CleanupThis();
-            ASSERT(GetOthers().GetThis().GetRemainingSpace() >= Runtime::GetGC()->GetEstimatedSpace());
-            Runtime::GetGC()->FixInvalidDanglingReferences();
-        }
-        auto *obj = Runtime::GetGC()->PopAliveObject();
-        while (obj != nullptr) {
-            size_t obj_size = obj->GetAllocatedSize();
-            void *new_ptr = GetOthers().GetThis().AllocBytes(obj_size);
-            std::memcpy(new_ptr, obj, obj_size);
-            obj->SetRelocatedPtr(new_ptr);
+    GC_REGION_ARGS()
+    void GC_REGION()::MoveObjects()
+    {
+        auto *to_space = GetToSpace();
+        ASSERT(to_space->GetUsedSpace() == 0);
+        size_t tenuring_threshold = Runtime::GetGC()->GetTenuringThreshold();
+        size_t promoted_space = Runtime::GetGC()->GetEstimatedSpaceOfAges(tenuring_threshold);
+        size_t survived_space = Runtime::GetGC()->GetEstimatedSpace() - promoted_space;
+        if (to_space->GetCapacity() < survived_space) {
+            to_space->Resize(std::min(AlignUp(survived_space, PAGE_SIZE), to_space->GetMaxCapacity()));
+        }
+        // Survivors which don't fit in the "to" space are promoted prematurely:
+        if (survived_space > to_space->GetCapacity()) {
+            promoted_space += survived_space - to_space->GetCapacity();
+        }
+        if (GetTenured()->GetRemainingSpace() < promoted_space) {
+            LOG_DEBUG(GC, "Tenured space is exhausted");
+            Runtime::GetGC()->CollectTenured(GCTelemetry::Cause::TENURED_EXHAUSTED, [promoted_space]() {
+                return GetTenured()->GetRemainingSpace() >= promoted_space;
+            });
+            size_t remaining_space = GetTenured()->GetRemainingSpace();
+            if ((remaining_space < promoted_space) && !GetTenured()->Grow(promoted_space - remaining_space)) {
+                LOG_FATAL(GC, "OOM: max heap size is reached");
+            }
+            LOG_INFO(GC, "Tenured space capacity = " << GetTenured()->GetCapacity() << "[bytes]");
+        }
+
+        auto obj = Runtime::GetGC()->PopAliveObject();
+        while (!obj.IsPrimitive()) {
+            auto *obj_header = obj.GetAsObjectHeader();
+            size_t obj_size = obj_header->GetAllocatedSize();
+            bool is_promotion = (obj_header->GetAge() >= tenuring_threshold) || (to_space->GetRemainingSpace() < obj_size);
+            void *new_ptr = is_promotion ? GetTenured()->AllocBytes(obj_size) : to_space->AllocBytes(obj_size);
+            std::memcpy(new_ptr, obj_header, obj_size);
+            obj_header->SetRelocatedPtr(new_ptr);
+            auto *new_header = reinterpret_cast<ObjectHeader *>(new_ptr);
+            // Marks of young objects aren't reset by sweeping, so they are dropped here to never match a later epoch.
+            // Promoted objects are shaded again if tenured marking is in progress:
+            new_header->MarkTenured(0);
+            if (new_header->GetAge() == 0) {
+                Runtime::GetGC()->RecordSiteSurvivor(new_header);
+            }
+            new_header->IncrementAge();
+            if (is_promotion) {
+                Runtime::GetGC()->AppendPromotedObject(Register(obj.GetType(), reinterpret_cast<uint64_t>(new_ptr)));
+            } else {
+                Runtime::GetGC()->RecordSurvivor(new_header->GetAge(), obj_size);
+            }
             obj = Runtime::GetGC()->PopAliveObject();
         }
     }
 
-    REGIONS_POOL_ARGS()
-    void REGIONS_POOL()::RebindLinks()
+    GC_REGION_ARGS()
+    void GC_REGION()::RebindLinks()
     {
         auto dangling_ref = Runtime::GetGC()->PopRefToMovedObject();
         while (!dangling_ref.IsEmpty()) {
@@ -153,13 +276,93 @@ namespace k3s {
             dangling_ref = Runtime::GetGC()->PopRefToMovedObject();
         }
     }
-    
+
+    GC_REGION_ARGS()
+    void GC_REGION()::UpdateAllocationLimit()
+    {
+        auto *nursery = GetNursery();
+        size_t budget = std::min(nursery->GetRemainingSpace(), Runtime::GetGC()->GetFastAllocationBudget());
+        GetControl()->allocation_limit = nursery->GetTop() + budget;
+    }
+
+    GC_REGION_ARGS()
+    void *GC_REGION()::AllocBytesSlow(size_t n_bytes)
+    {
+        size_t fast_allocated = GetNursery()->GetTop() - GetControl()->allocation_start;
+        Runtime::GetGC()->OnAllocation(fast_allocated + n_bytes);
+        void *allocated = nullptr;
+        // Tenured space isn't grown here: the nursery is used instead, so young collection would collect
+        // the tenured space (or grow it) if needed:
+        if (Runtime::GetGC()->ShouldPretenure()) {
+            allocated = GetTenured()->TryAllocBytes(n_bytes);
+            if (allocated == nullptr && Runtime::GetGC()->IsTriggerForbidden()) {
+                // Other objects of the sequence may be tenured already (see `PrepareForSequentAllocations`),
+                // so the space is grown to keep the whole sequence in one generation:
+                allocated = GetTenured()->AllocBytes(n_bytes);
+            }
+            if (allocated != nullptr) {
+                Runtime::GetGC()->GetTelemetry()->RecordDirectAllocation(n_bytes);
+            } else {
+                Runtime::GetGC()->CancelPretenuring();
+            }
+        }
+        if (allocated == nullptr) {
+            EnsureNurseryFits(n_bytes);
+            allocated = GetNursery()->AllocBytes(n_bytes);
+        }
+        GetControl()->allocation_start = GetNursery()->GetTop();
+        UpdateAllocationLimit();
+        return allocated;
+    }
+
+    GC_REGION_ARGS()
+    void GC_REGION()::CollectAll()
+    {
+        CollectYoung();
+        // An interrupted tenured cycle keeps objects allocated during it, so a fresh cycle is needed then.
+        // Nested pauses are merged into the outer one, which records the actual cause:
+        Runtime::GetGC()->CollectTenured(GCTelemetry::Cause::HEAP_SNAPSHOT, []() { return false; });
+    }
+
+    GC_REGION_ARGS()
+    bool GC_REGION()::LargeSpaceFits(size_t n_bytes)
+    {
+        // Splitting a free run may commit one more page:
+        size_t required = LargeObjectSpace::GetRunSize(n_bytes) + PAGE_SIZE;
+        return GetLargeSpace()->GetCommittedSize() + GetTenured()->GetCapacity() + required <= GetControl()->max_old_size;
+    }
+
+    GC_REGION_ARGS()
+    void *GC_REGION()::AllocLargeBytes(size_t n_bytes)
+    {
+        Runtime::GetGC()->OnAllocation(n_bytes);
+        if (!LargeSpaceFits(n_bytes)) {
+            LOG_DEBUG(GC, "Large object space is exhausted");
+            Runtime::GetGC()->CollectTenured(GCTelemetry::Cause::LARGE_SPACE_EXHAUSTED, [n_bytes]() { return LargeSpaceFits(n_bytes); });
+            if (!LargeSpaceFits(n_bytes)) {
+                LOG_FATAL(GC, "OOM: max heap size is reached");
+            }
+        }
+        void *allocated = GetLargeSpace()->AllocBytes(n_bytes);
+        if (allocated == nullptr) {
+            LOG_FATAL(ALLOCATOR, "OOM (large object space)");
+        }
+        UpdateTenuredLimit();
+        Runtime::GetGC()->GetTelemetry()->RecordDirectAllocation(n_bytes);
+        return allocated;
+    }
+
     GC_REGION_ARGS()
     void GC_REGION()::PrepareForSequentAllocations(size_t n_bytes)
     {
-        if (survivors_.GetThis().GetRemainingSpace() <= n_bytes) {
-            survivors_.CleanupThis();
-            ASSERT(survivors_.GetThis().GetRemainingSpace() > n_bytes);
+        if (GetNursery()->GetRemainingSpace() < n_bytes) {
+            EnsureNurseryFits(n_bytes);
+            UpdateAllocationLimit();
+        }
+        // The sequence is allocated in one generation, the tenured one only if it most likely fits there
+        // (young collection above may have promoted objects to it):
+        if (Runtime::GetGC()->ShouldPretenure() && (GetTenured()->GetRemainingSpace() < n_bytes)) {
+            Runtime::GetGC()->CancelPretenuring();
         }
         Runtime::GetGC()->ForbidTrigger();
     }
@@ -175,21 +378,596 @@ namespace k3s {
         stages_stack_.pop_back();
 
         if (stages_stack_.size() == 0) {
+            // The buffer of the stack is released before the region is reset, as the reset drops its free lists:
+            decltype(stages_stack_)().swap(stages_stack_);
+            ASSERT(stages_stack_.capacity() == 0);
             Runtime::GetAllocator()->GcInternalsRegion().Reset();
-            decltype(stages_stack_) tmp;
-            ASSERT(tmp.capacity() == 0);
-            ASSERT(tmp.data() == nullptr);
-            stages_stack_.swap(tmp);
             
+            size_t copied_bytes = 0;
+            for (auto bytes : last_age_stats_.survived_bytes) {
+                copied_bytes += bytes;
+            }
+            telemetry_.RecordEvacuation(copied_bytes, last_age_stats_.promoted_bytes);
+            AfterYoungCollection();
+
             auto newstamp = std::chrono::steady_clock::now();
             auto diff = std::chrono::duration_cast<std::chrono::microseconds>(newstamp - timestamp_).count();
             LOG_INFO(GC, "Spent in GC = " << diff << "[us]");
             timestamp_ = newstamp;
+            nursery_stats_.gc_time_us += diff;
+            allocation_sites_.UpdateAfterYoungCollection();
+            AdaptTenuringThreshold();
+            AdaptNurserySize();
+        }
+    }
+
+    /**
+     * Searches for the nursery size with the lowest GC time per allocated MB: the nursery keeps growing (or shrinking)
+     * while the cost decreases and the direction is reversed when it increases. A larger nursery gives short-lived
+     * objects more time to die, but if most of the nursery survives anyway, it is shrunk so that
+     * long-lived objects are promoted earlier and pauses stay short.
+     */
+    void GC::AdaptNurserySize()
+    {
+        using RuntimeRegionT = Allocator::RuntimeRegionT;
+        if ((nursery_stats_.n_collections < NURSERY_ADAPT_INTERVAL) ||
+            (RuntimeRegionT::GetMinNurserySize() == RuntimeRegionT::GetMaxNurserySize())) {
+            return;
+        }
+        auto stats = nursery_stats_;
+        nursery_stats_ = {};
+        if (stats.allocated_bytes == 0) {
+            return;
+        }
+
+        constexpr double MB = 1024.0 * 1024;
+        double cost = stats.gc_time_us * MB / stats.allocated_bytes;
+        bool is_high_survival = stats.survived_bytes * 100 >= stats.allocated_bytes * NURSERY_HIGH_SURVIVAL_PERCENT;
+        if (is_high_survival) {
+            is_nursery_growing_ = false;
+        } else if (prev_nursery_cost_ != 0) {
+            if (cost * 100 > prev_nursery_cost_ * (100 + NURSERY_COST_TOLERANCE_PERCENT)) {
+                is_nursery_growing_ = !is_nursery_growing_;
+            } else if (cost * 100 >= prev_nursery_cost_ * (100 - NURSERY_COST_TOLERANCE_PERCENT)) {
+                // The cost hasn't changed, so the current size is good enough:
+                prev_nursery_cost_ = cost;
+                return;
+            }
+        }
+        prev_nursery_cost_ = cost;
+
+        size_t size = RuntimeRegionT::GetNursery()->GetCapacity();
+        size_t new_size = is_nursery_growing_ ? size * NURSERY_RESIZE_PERCENT / 100 : size * 100 / NURSERY_RESIZE_PERCENT;
+        new_size = std::clamp(AlignUp(new_size, PAGE_SIZE), RuntimeRegionT::GetMinNurserySize(), RuntimeRegionT::GetMaxNurserySize());
+        if (new_size != size) {
+            LOG_INFO(GC, "Nursery resized to " << new_size << "[bytes] (survived " << stats.survived_bytes * 100 / stats.allocated_bytes
+                         << "%, cost = " << cost << "[us/MB])");
+            RuntimeRegionT::ResizeNursery(new_size);
+        }
+    }
+
+    /**
+     * Chooses the lowest age such that survivors of this age and younger exceed the target fraction of the desired
+     * survivor space, so the survivor space holds mostly the youngest objects and older ones are promoted.
+     */
+    void GC::AdaptTenuringThreshold()
+    {
+#ifndef NDEBUG
+        for (size_t age = 1; age <= ObjectHeader::MAX_AGE; age++) {
+            if (last_age_stats_.survived_bytes[age] != 0) {
+                LOG_INFO(GC, "  age " << age << ": " << last_age_stats_.survived_bytes[age] << "[bytes]");
+            }
+        }
+        LOG_INFO(GC, "  promoted: " << last_age_stats_.promoted_bytes << "[bytes]");
+#endif  // NDEBUG
+        if (!is_tenuring_adaptive_) {
+            return;
+        }
+        using RuntimeRegionT = Allocator::RuntimeRegionT;
+        size_t desired_survivor_size = RuntimeRegionT::GetNursery()->GetCapacity() / RuntimeRegionT::SURVIVOR_RATIO;
+        size_t target_size = desired_survivor_size * TARGET_SURVIVOR_PERCENT / 100;
+        size_t threshold = MAX_TENURING_THRESHOLD;
+        size_t total = 0;
+        for (size_t age = 1; age <= MAX_TENURING_THRESHOLD; age++) {
+            total += last_age_stats_.survived_bytes[age];
+            if (total > target_size) {
+                threshold = age;
+                break;
+            }
+        }
+        if (threshold != tenuring_threshold_) {
+            LOG_INFO(GC, "Tenuring threshold = " << threshold);
+            tenuring_threshold_ = threshold;
+        }
+    }
+
+    // Calls `visitor` for each register of `obj` which may hold a reference:
+    template <typename VisitorFn>
+    static void VisitReferences(const Register &obj, VisitorFn visitor)
+    {
+        switch (obj.GetType()) {
+        case Register::Type::ARR: {
+            auto *array = obj.GetAsArray();
+            for (size_t i = 0; i < array->GetSize(); i++) {
+                visitor(array->GetElem(i));
+            }
+            break;
+        } case Register::Type::OBJ: {
+            auto *object = obj.GetAsObject();
+            for (size_t i = 0; i < object->GetSize(); i++) {
+                visitor(object->GetElem(i));
+            }
+            break;
+        } case Register::Type::FUNC: {
+            auto *func = obj.GetAsFunction();
+            visitor(func->GetThis());
+            for (size_t i = 0; i < coretypes::Function::INPUTS_COUNT; i++) {
+                visitor(func->GetArg(i));
+            }
+            for (size_t i = 0; i < coretypes::Function::OUTPUTS_COUNT; i++) {
+                visitor(func->GetRet(i));
+            }
+            break;
+        } case Register::Type::STR:
+            break;
+        default:
+            LOG_FATAL(GC, "Unexpected object type");
+        }
+    }
+
+    // Checks the clock only once in a while:
+    class PauseBudget
+    {
+    public:
+        static constexpr size_t CHECK_INTERVAL = 64;
+
+        explicit PauseBudget(size_t budget_us)
+            : deadline_(std::chrono::steady_clock::now() + std::chrono::microseconds(budget_us)) {}
+
+        bool operator()()
+        {
+            return ((++n_checks_ % CHECK_INTERVAL) == 0) && (std::chrono::steady_clock::now() >= deadline_);
         }
+    private:
+        std::chrono::steady_clock::time_point deadline_;
+        size_t n_checks_ {0};
+    };
+
+    static bool NeverYield()
+    {
+        return false;
+    }
+
+    bool GC::HasYoungReferences(const Register &obj)
+    {
+        bool has_young_refs = false;
+        VisitReferences(obj, [&has_young_refs](Register *ref) {
+            has_young_refs |= !ref->IsPrimitive() && !IsTenured(ref->GetAsObjectHeader());
+        });
+        return has_young_refs;
+    }
+
+    template <typename VisitorFn>
+    void GC::VisitStackRoots(VisitorFn visitor)
+    {
+        auto *interpreter = Runtime::GetInterpreter();
+        auto &state_stack = *interpreter->GetStateStack();
+        for (size_t frame_idx = 0; frame_idx < state_stack.size(); frame_idx++) {
+            auto &state = state_stack[frame_idx];
+            visitor(Register(state.callee_), reinterpret_cast<ObjectHeader **>(&state.callee_));
+            visitor(Register(state.ret_obj_), reinterpret_cast<ObjectHeader **>(&state.ret_obj_));
+            auto live_mask = Runtime::GetModules()->GetLiveMask(interpreter->GetFramePc(frame_idx));
+            auto visit_reg = [&visitor, live_mask](Register &vreg, size_t bit) {
+                if ((live_mask & (1U << bit)) == 0) {
+                    vreg.Reset();
+                    return;
+                }
+                visitor(vreg, vreg.IsPrimitive() ? nullptr : vreg.GetObjectHeaderPtr());
+            };
+            visit_reg(state.acc_, InstDataflow::ACC_BIT);
+            for (size_t reg_id = 0; reg_id < InstDataflow::N_REGS; reg_id++) {
+                visit_reg(state.regs_[reg_id], reg_id);
+            }
+            // Far registers aren't covered by stack maps:
+            if (auto *far_regs = interpreter->GetFarRegs(frame_idx); far_regs != nullptr) {
+                for (size_t i = 0; i < Interpreter::N_FAR_REGS; i++) {
+                    visitor(far_regs[i], far_regs[i].IsPrimitive() ? nullptr : far_regs[i].GetObjectHeaderPtr());
+                }
+            }
+        }
+    }
+
+    template <typename WorkListT>
+    void GC::ShadeRoots(WorkListT *worklist)
+    {
+        VisitStackRoots([this, worklist](const Register &value, [[maybe_unused]] ObjectHeader **slot) {
+            ShadeObject(value, worklist);
+        });
+    }
+
+    template <typename WorkListT, typename ShouldYieldFn>
+    bool GC::DrainWorklist(WorkListT *worklist, ShouldYieldFn should_yield)
+    {
+        while (!worklist->empty()) {
+            if (should_yield()) {
+                return false;
+            }
+            auto obj = worklist->back();
+            worklist->pop_back();
+            VisitReferences(obj, [this, worklist](Register *ref) {
+                ShadeObject(*ref, worklist);
+            });
+        }
+        return true;
+    }
+
+    void GC::TraceYoungGreyObjects()
+    {
+        if (tenured_phase_ != TenuredPhase::MARKING) {
+            return;
+        }
+        size_t i = 0;
+        while (i < grey_objects_.size()) {
+            auto obj = grey_objects_[i];
+            if (IsTenured(obj.GetAsObjectHeader())) {
+                i++;
+                continue;
+            }
+            grey_objects_[i] = grey_objects_.back();
+            grey_objects_.pop_back();
+            VisitReferences(obj, [this](Register *ref) {
+                ShadeObject(*ref, &grey_objects_);
+            });
+        }
+    }
+
+    template <typename ShouldYieldFn>
+    bool GC::SweepTenured(ShouldYieldFn should_yield)
+    {
+        auto tenured_mark = tenured_mark_;
+        bool is_done = Allocator::RuntimeRegionT::GetTenured()->SweepStep([tenured_mark](ObjectHeader *obj) {
+            return obj->IsTenuredMarked(tenured_mark);
+        }, should_yield);
+        if (is_done) {
+            auto *tenured = Allocator::RuntimeRegionT::GetTenured();
+            LOG_INFO(GC, "Tenured sweeping finished, used = " << tenured->GetUsedSpace() << "[bytes]");
+            tenured_phase_ = TenuredPhase::IDLE;
+            // Otherwise the next cycle would start almost immediately:
+            size_t headroom = tenured->GetMaxCapacity() - tenured->GetCapacity();
+            if ((tenured->GetUsedSpace() * 100 >= tenured->GetCapacity() * TENURED_GROWTH_THRESHOLD_PERCENT) && (headroom != 0)) {
+                tenured->Grow(std::min(tenured->GetCapacity(), headroom));
+                LOG_INFO(GC, "Tenured space capacity = " << tenured->GetCapacity() << "[bytes]");
+            }
+        }
+        return is_done;
+    }
+
+    void GC::StartTenuredMarking()
+    {
+        ASSERT(tenured_phase_ == TenuredPhase::IDLE);
+        BeginPause(GCTelemetry::PauseKind::TENURED_START, GCTelemetry::Cause::OLD_OCCUPANCY);
+        LOG_INFO(GC, "Tenured marking started, used = " << Allocator::RuntimeRegionT::GetTenured()->GetUsedSpace() << "[bytes]");
+        // Zero is the mark of never marked objects:
+        tenured_mark_ = (tenured_mark_ % ObjectHeader::MAX_TENURED_MARK) + 1;
+        tenured_phase_ = TenuredPhase::MARKING;
+        allocated_since_step_ = 0;
+        // The slow path performs incremental steps:
+        Allocator::RuntimeRegionT::UpdateAllocationLimit();
+        ShadeRoots(&grey_objects_);
+        EndPause();
+    }
+
+    void GC::FinishTenuredMarking()
+    {
+        ASSERT(tenured_phase_ == TenuredPhase::MARKING);
+        // Unmarked remembered objects are going to be swept:
+        auto tenured_mark = tenured_mark_;
+        auto dead_begin = std::remove_if(remembered_set_.begin(), remembered_set_.end(), [tenured_mark](const Register &holder) {
+            return !holder.GetAsObjectHeader()->IsTenuredMarked(tenured_mark);
+        });
+        remembered_set_.erase(dead_begin, remembered_set_.end());
+
+        // Large objects are few, so they are swept at once:
+        profiler_.CheckOldSamples([tenured_mark](const ObjectHeader *obj) {
+            return obj->IsTenuredMarked(tenured_mark);
+        });
+        auto *large_space = Allocator::RuntimeRegionT::GetLargeSpace();
+        large_space->Sweep([tenured_mark](ObjectHeader *obj) {
+            return obj->IsTenuredMarked(tenured_mark);
+        });
+        Allocator::RuntimeRegionT::UpdateTenuredLimit();
+        LOG_INFO(GC, "Large object space swept, live = " << large_space->GetLiveSize() << "[bytes]");
+
+        Allocator::RuntimeRegionT::GetTenured()->StartSweep();
+        tenured_phase_ = TenuredPhase::SWEEPING;
+    }
+
+    void GC::EndSiteAllocationSlow(const Register &obj)
+    {
+        auto site_id = current_site_id_;
+        bool was_pretenuring = IsPretenuringSite();
+        current_site_id_ = 0;
+        if (was_pretenuring) {
+            Allocator::RuntimeRegionT::UpdateAllocationLimit();
+        }
+        auto *obj_header = obj.GetAsObjectHeader();
+        bool is_tenured = IsTenured(obj_header);
+        if (profiler_.IsSamplePending()) {
+            auto *interpreter = Runtime::GetInterpreter();
+            profiler_.TakeSample(interpreter->GetPc(), interpreter->GetCallee()->GetTargetPc(), obj_header, !is_tenured);
+        }
+        if (site_id != 0) {
+            auto *site = allocation_sites_.GetSite(site_id);
+            obj_header->SetSiteId(site_id);
+            if (is_tenured) {
+                site->pretenured_allocated++;
+            } else {
+                site->allocated++;
+            }
+        }
+        if (!is_tenured) {
+            return;
+        }
+        // Large objects are allocated in the old generation regardless of the site:
+        if (tenured_phase_ == TenuredPhase::MARKING) {
+            // The object is allocated after the start of marking, so it shouldn't be swept:
+            ShadeObject(obj, &grey_objects_);
+        } else if ((tenured_phase_ == TenuredPhase::IDLE) && ShouldStartTenuredMarking()) {
+            // Young collections may be rare if most allocations are pretenured:
+            StartTenuredMarking();
+        }
+    }
+
+    void GC::TenuredCollectionStep()
+    {
+        BeginPause(GCTelemetry::PauseKind::TENURED_STEP, GCTelemetry::Cause::ALLOCATION_STEP);
+        PauseBudget should_yield(pause_budget_us_);
+        bool is_marked = true;
+        if (tenured_phase_ == TenuredPhase::MARKING) {
+            is_marked = DrainWorklist(&grey_objects_, should_yield);
+            if (is_marked) {
+                FinishTenuredMarking();
+            }
+        }
+        if (is_marked && (tenured_phase_ == TenuredPhase::SWEEPING)) {
+            SweepTenured(should_yield);
+        }
+        EndPause();
+    }
+
+    template <typename HasEnoughSpaceFn>
+    void GC::CollectTenured(GCTelemetry::Cause cause, HasEnoughSpaceFn has_enough_space)
+    {
+        BeginPause(GCTelemetry::PauseKind::TENURED_FULL, cause);
+        LOG_INFO(GC, "Collecting tenured space synchronously");
+        if (tenured_phase_ == TenuredPhase::SWEEPING) {
+            SweepTenured(NeverYield);
+        }
+        bool is_continued = (tenured_phase_ == TenuredPhase::MARKING);
+        MarkAndSweepTenured();
+        // Objects allocated during the interrupted cycle were kept alive, a new cycle may reclaim them:
+        if (is_continued && !has_enough_space()) {
+            MarkAndSweepTenured();
+        }
+        EndPause();
+    }
+
+    void GC::MarkAndSweepTenured()
+    {
+        if (tenured_phase_ == TenuredPhase::IDLE) {
+            StartTenuredMarking();
+        }
+        // Pending relocations of a young collection may point into remembered objects, so they should survive:
+        if (!stages_stack_.empty()) {
+            for (const auto &holder : remembered_set_) {
+                ShadeObject(holder, &grey_objects_);
+            }
+        }
+        DrainWorklist(&grey_objects_, NeverYield);
+        FinishTenuredMarking();
+        SweepTenured(NeverYield);
+    }
+
+    void GC::AfterYoungCollection()
+    {
+        for (const auto &obj : promoted_objects_) {
+            if (tenured_phase_ == TenuredPhase::MARKING) {
+                // Promoted objects may be allocated after the start of marking, so they shouldn't be swept:
+                ShadeObject(obj, &grey_objects_);
+            }
+            if (HasYoungReferences(obj)) {
+                Remember(obj);
+            }
+        }
+        promoted_objects_.clear();
+
+        auto dropped_begin = std::remove_if(remembered_set_.begin(), remembered_set_.end(), [](const Register &holder) {
+            if (HasYoungReferences(holder)) {
+                return false;
+            }
+            holder.GetAsObjectHeader()->SetRemembered(false);
+            return true;
+        });
+        remembered_set_.erase(dropped_begin, remembered_set_.end());
+
+        if (tenured_phase_ != TenuredPhase::MARKING) {
+            grey_objects_.clear();
+        }
+
+        if (tenured_phase_ == TenuredPhase::IDLE) {
+            if (ShouldStartTenuredMarking()) {
+                StartTenuredMarking();
+            }
+        } else {
+            TenuredCollectionStep();
+        }
+    }
+
+    static Register GetObjectRegister(ObjectHeader *obj)
+    {
+        switch (obj->GetType()) {
+        case ObjectHeader::Type::STRING:
+            return Register(Register::Type::STR, reinterpret_cast<uint64_t>(obj));
+        case ObjectHeader::Type::FUNCTION:
+            return Register(Register::Type::FUNC, reinterpret_cast<uint64_t>(obj));
+        case ObjectHeader::Type::ARRAY:
+            return Register(Register::Type::ARR, reinterpret_cast<uint64_t>(obj));
+        case ObjectHeader::Type::OBJECT:
+            return Register(Register::Type::OBJ, reinterpret_cast<uint64_t>(obj));
+        default:
+            LOG_FATAL(GC, "Unexpected object type");
+        }
+    }
+
+    /**
+     * Young objects referenced only by dead tenured objects of the remembered set survive the young collection,
+     * so the snapshot may contain a few objects which aren't reachable from roots.
+     */
+    void GC::TakeHeapSnapshot()
+    {
+        is_heap_snapshot_requested_ = 0;
+        heap_snapshot_allocated_bytes_ = 0;
+        auto path = std::string(heap_snapshot_path_) + "." + std::to_string(n_heap_snapshots_++);
+        std::ofstream os(path, std::ios::binary);
+        if (!os) {
+            LOG_FATAL(GC, "Can't open file: '" << path << "'");
+        }
+        BeginPause(GCTelemetry::PauseKind::TENURED_FULL, GCTelemetry::Cause::HEAP_SNAPSHOT);
+        Allocator::RuntimeRegionT::CollectAll();
+
+        heap_snapshot::Writer writer(os);
+        allocation_sites_.VisitSites([&writer](size_t site_id, const AllocationSite &site) {
+            writer.WriteSite(site_id, site.pc);
+        });
+        VisitStackRoots([&writer](const Register &value, [[maybe_unused]] ObjectHeader **slot) {
+            if (!value.IsPrimitive()) {
+                writer.WriteRoot(value.GetValue());
+            }
+        });
+        Allocator::RuntimeRegionT::VisitObjects([&writer](ObjectHeader *obj) {
+            auto obj_reg = GetObjectRegister(obj);
+            size_t n_refs = 0;
+            VisitReferences(obj_reg, [&n_refs](Register *ref) {
+                n_refs += ref->IsPrimitive() ? 0 : 1;
+            });
+            writer.BeginObject(reinterpret_cast<uintptr_t>(obj), static_cast<uint8_t>(obj->GetType()), obj->GetSiteId(),
+                               obj->GetAllocatedSize(), n_refs);
+            VisitReferences(obj_reg, [&writer](Register *ref) {
+                if (!ref->IsPrimitive()) {
+                    writer.WriteReference(ref->GetValue());
+                }
+            });
+        });
+        writer.Finish();
+        if (!os) {
+            LOG_FATAL(GC, "Can't write heap snapshot: '" << path << "'");
+        }
+        EndPause();
+        LOG_INFO(GC, "Heap snapshot is written to '" << path << "'");
+    }
+
+    void GC::PrepareRuntimeImage()
+    {
+        BeginPause(GCTelemetry::PauseKind::TENURED_FULL, GCTelemetry::Cause::RUNTIME_IMAGE);
+        Allocator::RuntimeRegionT::CollectAll();
+        Allocator::RuntimeRegionT::ReleaseFreeYoungPages();
+        EndPause();
+    }
+
+    bool GC::ShouldStartTenuredMarking()
+    {
+        auto *tenured = Allocator::RuntimeRegionT::GetTenured();
+        return (tenured->GetUsedSpace() * 100 >= tenured->GetCapacity() * TENURED_MARKING_THRESHOLD_PERCENT) ||
+               Allocator::RuntimeRegionT::GetLargeSpace()->ShouldCollect();
+    }
+
+    GCTelemetry::HeapOccupancy GC::GetHeapOccupancy()
+    {
+        using RuntimeRegionT = Allocator::RuntimeRegionT;
+        GCTelemetry::HeapOccupancy occupancy;
+        occupancy.nursery = RuntimeRegionT::GetNursery()->GetUsedSpace();
+        occupancy.survivors = RuntimeRegionT::GetFromSpace()->GetUsedSpace();
+        occupancy.tenured = RuntimeRegionT::GetTenured()->GetUsedSpace();
+        occupancy.large = RuntimeRegionT::GetLargeSpace()->GetLiveSize();
+        return occupancy;
+    }
+
+    void GC::BeginPause(GCTelemetry::PauseKind kind, GCTelemetry::Cause cause)
+    {
+        auto occupancy = GetHeapOccupancy();
+        telemetry_.BeginPause(kind, cause, occupancy, telemetry_.GetAllocatedBytes(occupancy.nursery));
+    }
+
+    void GC::EndPause()
+    {
+        telemetry_.EndPause(GetHeapOccupancy());
+    }
+
+    void GC::WriteTelemetryJson(std::ostream &os)
+    {
+        auto write_occupancy = [&os](const GCTelemetry::HeapOccupancy &occupancy) {
+            os << "{\"nursery\": " << occupancy.nursery << ", \"survivors\": " << occupancy.survivors
+               << ", \"tenured\": " << occupancy.tenured << ", \"large\": " << occupancy.large << "}";
+        };
+        auto occupancy = GetHeapOccupancy();
+        os << "{\n";
+        os << "  \"uptime_us\": " << telemetry_.GetUptimeUs() << ",\n";
+        os << "  \"allocated_bytes\": " << telemetry_.GetAllocatedBytes(occupancy.nursery) << ",\n";
+        os << "  \"occupancy\": ";
+        write_occupancy(occupancy);
+        os << ",\n";
+
+        os << "  \"histogram_bounds_us\": [";
+        for (size_t i = 0; i + 1 < GCTelemetry::N_HISTOGRAM_BUCKETS; i++) {
+            os << ((i != 0) ? ", " : "") << GCTelemetry::GetBucketBound(i);
+        }
+        os << "],\n";
+        os << "  \"pauses\": {\n";
+        for (size_t kind = 0; kind < static_cast<size_t>(GCTelemetry::PauseKind::COUNT); kind++) {
+            const auto &totals = telemetry_.GetTotals(static_cast<GCTelemetry::PauseKind>(kind));
+            os << "    \"" << GCTelemetry::GetKindName(static_cast<GCTelemetry::PauseKind>(kind)) << "\": {\"count\": "
+               << totals.n_pauses << ", \"total_us\": " << totals.total_pause_us << ", \"max_us\": " << totals.max_pause_us
+               << ", \"histogram\": [";
+            for (size_t i = 0; i < totals.histogram.size(); i++) {
+                os << ((i != 0) ? ", " : "") << totals.histogram[i];
+            }
+            os << "]}" << ((kind + 1 < static_cast<size_t>(GCTelemetry::PauseKind::COUNT)) ? "," : "") << "\n";
+        }
+        os << "  },\n";
+
+        os << "  \"tenuring_threshold\": " << tenuring_threshold_ << ",\n";
+        os << "  \"survived_bytes_by_age\": [";
+        for (size_t age = 0; age < total_age_stats_.survived_bytes.size(); age++) {
+            os << ((age != 0) ? ", " : "") << total_age_stats_.survived_bytes[age];
+        }
+        os << "],\n";
+        os << "  \"promoted_bytes\": " << total_age_stats_.promoted_bytes << ",\n";
+
+        os << "  \"recent_pauses\": [";
+        bool is_first = true;
+        telemetry_.VisitRecentPauses([&](const GCTelemetry::PauseRecord &record) {
+            os << (is_first ? "\n" : ",\n") << "    {\"kind\": \"" << GCTelemetry::GetKindName(record.kind) << "\", \"kinds\": [";
+            bool is_first_kind = true;
+            for (size_t kind = 0; kind < static_cast<size_t>(GCTelemetry::PauseKind::COUNT); kind++) {
+                if (((record.kinds_mask >> kind) & 1U) != 0) {
+                    os << (is_first_kind ? "\"" : ", \"") << GCTelemetry::GetKindName(static_cast<GCTelemetry::PauseKind>(kind)) << "\"";
+                    is_first_kind = false;
+                }
+            }
+            os << "], \"cause\": \"" << GCTelemetry::GetCauseName(record.cause) << "\", \"start_us\": " << record.start_us
+               << ", \"pause_us\": " << record.pause_us << ", \"allocated_bytes\": " << record.allocated_bytes
+               << ", \"copied_bytes\": " << record.copied_bytes << ", \"promoted_bytes\": " << record.promoted_bytes
+               << ", \"survival_percent\": " << GCTelemetry::GetSurvivalPercent(record) << ", \"before\": ";
+            write_occupancy(record.before);
+            os << ", \"after\": ";
+            write_occupancy(record.after);
+            os << "}";
+            is_first = false;
+        });
+        os << (is_first ? "]\n" : "\n  ]\n");
+        os << "}\n";
     }
 
-template class GCRegion<251658240ul, 16777216ul>;
-// For some reasons, in release builds `GCRegion` instantiation may not be enough:
-//template class RegionsPool<251658240ul, 1, 4, 16777216ul>;
+template class GCRegion<Allocator::HEAP_START_ADDR, Allocator::HEAP_RESERVED_SIZE>;
 
 }  // namespace k3s
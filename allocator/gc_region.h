@@ -1,154 +1,310 @@
 #ifndef ALLOCATOR_GC_REGION_H
 #define ALLOCATOR_GC_REGION_H
 
-#include "allocator/region.h"
+#include "allocator/heap_options.h"
+#include "allocator/large_object_space.h"
+#include "allocator/tenured_space.h"
+#include "allocator/virtual_memory.h"
 #include "interpreter/register.h"
 
 namespace k3s {
 
-template <uintptr_t START_PTR, size_t REGION_SIZE, size_t N_REGIONS, size_t REMAINING_SIZE>
-class RegionsPool
+// Bump-pointer region of the young generation. Its bounds are chosen at runtime, so it isn't a `Region`.
+class YoungRegion
 {
 public:
-    static constexpr size_t MAX_ALLOC_SIZE = REGION_SIZE;
-    static_assert(REGION_SIZE != 0);
-    static_assert(REMAINING_SIZE >= N_REGIONS * REGION_SIZE);
-
-    static void Reset()
+    void Init(char *start, size_t capacity, size_t max_capacity, bool prefault)
     {
-        decltype(this_)::Reset();
-        decltype(others_)::Reset();
+        ASSERT(capacity <= max_capacity);
+        start_ = start;
+        capacity_ = 0;
+        max_capacity_ = max_capacity;
+        prefault_ = prefault;
+        Reset();
+        Resize(capacity);
     }
-    static auto GetThis() 
+
+    bool Contains(const void *ptr) const
     {
-        return decltype(this_)();
+        auto *char_ptr = reinterpret_cast<const char *>(ptr);
+        return (char_ptr >= start_) && (char_ptr < start_ + capacity_);
     }
-    static auto GetOthers() 
+
+    void Reset()
     {
-        return decltype(others_)();
+        top_ = start_;
     }
 
-    static void *AllocBytes(size_t n_bytes)
+    // Commits or decommits memory at the end of the region, so it may be called only when the region is empty:
+    void Resize(size_t new_capacity)
     {
-        if (decltype(this_)::GetRemainingSpace() >= n_bytes) {
-            return decltype(this_)::AllocBytes(n_bytes);
-        } else {
-            CleanupThis();
-            ASSERT(decltype(this_)::GetRemainingSpace() == decltype(this_)::MAX_ALLOC_SIZE);
-            return decltype(this_)::AllocBytes(n_bytes);
+        ASSERT(top_ == start_);
+        ASSERT(new_capacity % PAGE_SIZE == 0);
+        ASSERT(new_capacity <= max_capacity_);
+        if (new_capacity > capacity_) {
+            CommitMemory(start_ + capacity_, new_capacity - capacity_);
+            if (prefault_) {
+                PrefaultMemory(start_ + capacity_, new_capacity - capacity_);
+            }
+        } else if (new_capacity < capacity_) {
+            DecommitMemory(start_ + new_capacity, capacity_ - new_capacity);
         }
+        capacity_ = new_capacity;
     }
 
-    static void CleanupThis();
+    // Gives pages of evacuated objects back to the OS, so it should be called right before `Reset`:
+    void ReleaseUsedPages()
+    {
+        ReleaseMemory(start_, GetUsedSpace());
+    }
 
-    static void MarkAndFetchTargetObjects();
-    static bool MarkAndFetchRecursively(Register vreg);
-    static void MarkArray(ObjectHeader *obj);
-    static void MarkObject(ObjectHeader *obj);
-    static void MarkFunction(ObjectHeader *obj);
+    // Gives committed pages above the top back to the OS:
+    void ReleaseFreePages()
+    {
+        size_t used_size = AlignUp(GetUsedSpace(), PAGE_SIZE);
+        if (used_size < capacity_) {
+            ReleaseMemory(start_ + used_size, capacity_ - used_size);
+        }
+    }
 
-    static void MoveObjects();
-    static void RebindLinks();
-    
-    constexpr auto GetLastRegion()
+    void *AllocBytes(size_t n_bytes)
     {
-        return others_.GetLastRegion();
+        ASSERT(GetRemainingSpace() >= n_bytes);
+        auto allocated = top_;
+        top_ += n_bytes;
+        return allocated;
     }
-    
-    constexpr auto GetNextRegion()
+
+    // Allocation fast path, \p limit should be within the region:
+    void *TryAllocBytes(size_t n_bytes, const char *limit)
     {
-        return others_.GetThis();
+        auto allocated = top_;
+        if (UNLIKELY(n_bytes > static_cast<size_t>(limit - allocated))) {
+            return nullptr;
+        }
+        top_ = allocated + n_bytes;
+        return allocated;
     }
 
-private:
-    Region<START_PTR, REGION_SIZE> this_;
-    RegionsPool<START_PTR + REGION_SIZE, REGION_SIZE, N_REGIONS - 1, REMAINING_SIZE - REGION_SIZE> others_;
-};
+    char *GetTop() const
+    {
+        return top_;
+    }
 
-// Last element (tenured space):
-template <uintptr_t START_PTR, size_t REGION_SIZE, size_t REMAINING_SIZE>
-class RegionsPool<START_PTR, REGION_SIZE, 0, REMAINING_SIZE> {
-public:
-    static auto GetThis() 
+    // Objects are placed one after another, so the region may be walked when none of them is being initialized:
+    template <typename VisitorFn>
+    void VisitObjects(VisitorFn visitor) const
     {
-        return decltype(this_)();
+        char *ptr = start_;
+        while (ptr < top_) {
+            auto *obj = reinterpret_cast<ObjectHeader *>(ptr);
+            ptr += obj->GetAllocatedSize();
+            visitor(obj);
+        }
     }
-    static void CleanupThis() {};
 
-    static void Reset()
+    size_t GetRemainingSpace() const
     {
-        decltype(this_)::Reset();
+        return capacity_ - GetUsedSpace();
     }
 
-    static void *AllocBytes(size_t n_bytes)
+    size_t GetUsedSpace() const
+    {
+        return top_ - start_;
+    }
+
+    size_t GetCapacity() const
     {
-        return decltype(this_)::AllocBytes(n_bytes);
+        return capacity_;
     }
 
-    constexpr auto GetLastRegion()
+    size_t GetMaxCapacity() const
     {
-        return this_;
+        return max_capacity_;
     }
 
 private:
-    Region<START_PTR, REMAINING_SIZE> this_;
+    char *start_ {};
+    size_t capacity_ {};
+    size_t max_capacity_ {};
+    char *top_ {};
+    bool prefault_ {};
 };
 
-
+/**
+ * Generational heap placed in the reserved range [START_PTR, START_PTR + SIZE).
+ *
+ * Objects are allocated in the nursery. Young collection evacuates live objects of the nursery and of
+ * the "from" survivor space either to the "to" survivor space or, if they are old enough, to the tenured space.
+ * Then survivor spaces are flipped. Sizes of the regions are taken from `HeapOptions` at startup,
+ * so the state of the heap is kept in the `Control` block at START_PTR. Each young region reserves
+ * `max_nursery_size` bytes, so it may be resized while it is empty.
+ *
+ * Large strings and arrays are allocated in the large object space and are never copied. It is collected
+ * together with the tenured space, and both of them share `max_old_size` bytes left by the young regions.
+ *
+ * With `huge_pages` each young region reserves a multiple of the huge page size, so all regions are aligned.
+ *
+ * Allocations in the nursery below `allocation_limit` only bump the top of the nursery. The limit is lowered
+ * whenever the slow path has to see an allocation: to perform incremental steps of tenured collection,
+ * to pretenure objects of the current allocation site or to sample allocations for the profiler.
+ */
 template <uintptr_t START_PTR, size_t SIZE>
 class GCRegion
 {
 public:
-    template <typename T>
-    class AllocatorRequirements
-    {
-    public:
-        using value_type = T;
-        AllocatorRequirements() = default;
-        template <typename U>
-        AllocatorRequirements(const AllocatorRequirements<U> &a2) {}
-        [[nodiscard]] T* allocate(size_t n)
-        {
-            return GCRegion::Alloc<T>(n);
-        }
-        void deallocate(T *ptr, size_t n)
-        {
-            return;
-        }
-    };
-    template <typename T>
-    auto Adapter()
+    // Initial size of survivor spaces relative to the nursery, they grow when survivors don't fit:
+    static constexpr size_t SURVIVOR_RATIO = 8;
+
+    struct Control
     {
-        return AllocatorRequirements<T>();
-    }
+        size_t min_nursery_size;
+        size_t max_nursery_size;
+        YoungRegion nursery;
+        const char *allocation_limit;
+        // Top of the nursery when the limit was set, so the slow path accounts allocations of the fast path:
+        const char *allocation_start;
+        YoungRegion survivors[2];
+        size_t from_idx;
+        bool release_evacuated;
+        size_t max_old_size;
+        TenuredSpace tenured;
+        LargeObjectSpace large_space;
+    };
+    static constexpr size_t CONTROL_SIZE = AlignUp(sizeof(Control), PAGE_SIZE);
+    // Young regions start at a huge page boundary, so they may be backed with huge pages:
+    static constexpr size_t YOUNG_OFFSET = AlignUp(CONTROL_SIZE, HUGE_PAGE_SIZE);
+    static_assert(START_PTR % HUGE_PAGE_SIZE == 0);
+
+    static void Init(const HeapOptions &options);
+
     template <typename T>
     static T *Alloc(size_t n_elems)
     {
         return reinterpret_cast<T *>(AllocBytes(n_elems * sizeof(T)));
     }
 
-    static void Reset()
+    static void *AllocBytes(size_t n_bytes)
     {
-        decltype(survivors_)::Reset();
+        void *allocated = GetNursery()->TryAllocBytes(n_bytes, GetControl()->allocation_limit);
+        if (LIKELY(allocated != nullptr)) {
+            return allocated;
+        }
+        return AllocBytesSlow(n_bytes);
     }
 
-    static void *AllocBytes(size_t n_bytes)
+    // For objects which hold no references when allocated (strings and fresh arrays), so they may be large:
+    static void *AllocBytesOrLarge(size_t n_bytes)
     {
-        return decltype(survivors_)::AllocBytes(n_bytes);
+        if (LIKELY(n_bytes < LargeObjectSpace::MIN_OBJECT_SIZE)) {
+            return AllocBytes(n_bytes);
+        }
+        return AllocLargeBytes(n_bytes);
     }
+
     void PrepareForSequentAllocations(size_t n_bytes);
     void EndSequentAllocations();
 
-    static constexpr size_t TENURED_SIZE = SIZE / 4;
-    static constexpr size_t SURVIVORS_N = 2;
-    static constexpr size_t SURVIVORS_SIZE = (SIZE - TENURED_SIZE) / SURVIVORS_N;
-    static constexpr size_t SURVIVORS_START_PTR = START_PTR;
-    using RegionsPoolT = RegionsPool<SURVIVORS_START_PTR, SURVIVORS_SIZE, SURVIVORS_N, SIZE>;
+    static YoungRegion *GetNursery()
+    {
+        return &GetControl()->nursery;
+    }
+
+    static YoungRegion *GetFromSpace()
+    {
+        return &GetControl()->survivors[GetControl()->from_idx];
+    }
+
+    static YoungRegion *GetToSpace()
+    {
+        return &GetControl()->survivors[1 - GetControl()->from_idx];
+    }
+
+    static size_t GetMinNurserySize()
+    {
+        return GetControl()->min_nursery_size;
+    }
+
+    static size_t GetMaxNurserySize()
+    {
+        return GetControl()->max_nursery_size;
+    }
+
+    // Collects the young generation, then the old one synchronously. Should be called within a pause of the caller:
+    static void CollectAll();
+
+    // Drops contents of unused pages of the young regions:
+    static void ReleaseFreeYoungPages()
+    {
+        GetNursery()->ReleaseFreePages();
+        GetFromSpace()->ReleaseFreePages();
+        GetToSpace()->ReleaseFreePages();
+    }
+
+    // Should be called whenever the slow path should see allocations again or may stop seeing them:
+    static void UpdateAllocationLimit();
+
+    // Called only right after young collection:
+    static void ResizeNursery(size_t new_size)
+    {
+        GetNursery()->Resize(new_size);
+    }
+
+    static TenuredSpace *GetTenured()
+    {
+        return &GetControl()->tenured;
+    }
+
+    static LargeObjectSpace *GetLargeSpace()
+    {
+        return &GetControl()->large_space;
+    }
+
+    /// Calls `visitor(obj)` for each object of the heap. Young regions contain dead objects unless they are
+    /// just collected, old spaces - unless they are just swept.
+    template <typename VisitorFn>
+    static void VisitObjects(VisitorFn visitor)
+    {
+        GetNursery()->VisitObjects(visitor);
+        GetFromSpace()->VisitObjects(visitor);
+        GetTenured()->VisitObjects(visitor);
+        GetLargeSpace()->VisitObjects(visitor);
+    }
+
+    // Should be called whenever memory committed by the large object space changes:
+    static void UpdateTenuredLimit()
+    {
+        GetTenured()->SetMaxCapacity(GetControl()->max_old_size - GetLargeSpace()->GetCommittedSize());
+    }
 
 private:
-    RegionsPoolT survivors_;
+    static Control *GetControl()
+    {
+        return reinterpret_cast<Control *>(START_PTR);
+    }
+
+    static bool IsCollected(const void *ptr)
+    {
+        return GetNursery()->Contains(ptr) || GetFromSpace()->Contains(ptr);
+    }
+
+    static void *AllocBytesSlow(size_t n_bytes);
+    static void *AllocLargeBytes(size_t n_bytes);
+    static void CollectYoung();
+    static void EnsureNurseryFits(size_t n_bytes);
+    static bool LargeSpaceFits(size_t n_bytes);
+
+    static void MarkAndFetchTargetObjects();
+    static bool MarkAndFetchRecursively(Register vreg);
+    static void MarkChildren(const Register &obj);
+    static void MarkArray(ObjectHeader *obj);
+    static void MarkObject(ObjectHeader *obj);
+    static void MarkFunction(ObjectHeader *obj);
+
+    static void MoveObjects();
+    static void RebindLinks();
 };
 
 }  // namespace k3s
 
-#endif  // ALLOCATOR_GC_H
+#endif  // ALLOCATOR_GC_REGION_H
@@ -0,0 +1,281 @@
+#ifndef ALLOCATOR_GC_TELEMETRY_H
+#define ALLOCATOR_GC_TELEMETRY_H
+
+#include "allocator/containers.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <iterator>
+
+namespace k3s {
+
+/**
+ * Always-on GC instrumentation (it doesn't depend on `LOG_INFO`, which is compiled out in release builds).
+ *
+ * Each pause of the mutator is recorded once: collections nested into another pause (e.g. tenured collection
+ * caused by promotion) extend the outer record. Pause times are aggregated into log2 histograms per kind,
+ * the most recent pauses are kept in full for the report written at exit.
+ */
+class GCTelemetry
+{
+public:
+    enum class PauseKind : uint8_t {
+        YOUNG,
+        TENURED_START,
+        TENURED_STEP,
+        TENURED_FULL,
+        COUNT,
+    };
+
+    enum class Cause : uint8_t {
+        // The nursery can't fit an allocation:
+        NURSERY_FULL,
+        // Occupancy of the old generation has reached the marking threshold:
+        OLD_OCCUPANCY,
+        // Incremental tenured step after `GC::TENURED_STEP_ALLOCATION_BYTES` of allocations:
+        ALLOCATION_STEP,
+        // Promoted objects don't fit in the tenured space:
+        TENURED_EXHAUSTED,
+        // Large object doesn't fit in the heap limit:
+        LARGE_SPACE_EXHAUSTED,
+        // The whole heap is collected before taking a snapshot:
+        HEAP_SNAPSHOT,
+        // The whole heap is collected before writing a runtime image:
+        RUNTIME_IMAGE,
+        COUNT,
+    };
+
+    struct HeapOccupancy
+    {
+        size_t nursery {0};
+        size_t survivors {0};
+        size_t tenured {0};
+        size_t large {0};
+    };
+
+    struct PauseRecord
+    {
+        PauseKind kind {};
+        Cause cause {};
+        // Bit per `PauseKind` of collections performed within the pause (including `kind`):
+        uint8_t kinds_mask {0};
+        uint64_t start_us {0};
+        uint64_t pause_us {0};
+        // Allocated since the previous pause:
+        size_t allocated_bytes {0};
+        // Copied to the survivor space and promoted by young collection:
+        size_t copied_bytes {0};
+        size_t promoted_bytes {0};
+        HeapOccupancy before {};
+        HeapOccupancy after {};
+    };
+
+    // Bucket 0 counts pauses below 1us, bucket `i` - pauses in [2^(i-1), 2^i) us, the last one - all longer pauses:
+    static constexpr size_t N_HISTOGRAM_BUCKETS = 24;
+    static constexpr size_t MAX_RECENT_PAUSES = 1024;
+
+    struct KindTotals
+    {
+        size_t n_pauses {0};
+        uint64_t total_pause_us {0};
+        uint64_t max_pause_us {0};
+        std::array<size_t, N_HISTOGRAM_BUCKETS> histogram {};
+    };
+
+    GCTelemetry()
+    {
+        start_time_ = std::chrono::steady_clock::now();
+        recent_pauses_.reserve(MAX_RECENT_PAUSES);
+    }
+
+    // Uptime is counted from now on, e.g. after the runtime is mapped from the code cache:
+    void ResetClock()
+    {
+        start_time_ = std::chrono::steady_clock::now();
+    }
+
+    void SetLogEnabled(bool is_enabled)
+    {
+        is_log_enabled_ = is_enabled;
+    }
+
+    /// Returns true if the pause is started, false if it is nested into the current one.
+    /// \p allocated_bytes is the total amount allocated since startup.
+    bool BeginPause(PauseKind kind, Cause cause, const HeapOccupancy &occupancy, size_t allocated_bytes)
+    {
+        current_.kinds_mask |= 1U << static_cast<size_t>(kind);
+        if (depth_++ != 0) {
+            return false;
+        }
+        auto now = std::chrono::steady_clock::now();
+        current_.kind = kind;
+        current_.cause = cause;
+        current_.kinds_mask = 1U << static_cast<size_t>(kind);
+        current_.start_us = std::chrono::duration_cast<std::chrono::microseconds>(now - start_time_).count();
+        current_.allocated_bytes = allocated_bytes - allocated_at_last_pause_;
+        current_.copied_bytes = 0;
+        current_.promoted_bytes = 0;
+        current_.before = occupancy;
+        allocated_at_last_pause_ = allocated_bytes;
+        pause_start_ = now;
+        return true;
+    }
+
+    // Young collection reports the amount of evacuated objects, it may be nested into another pause:
+    void RecordEvacuation(size_t copied_bytes, size_t promoted_bytes)
+    {
+        current_.copied_bytes += copied_bytes;
+        current_.promoted_bytes += promoted_bytes;
+    }
+
+    void EndPause(const HeapOccupancy &occupancy)
+    {
+        ASSERT(depth_ != 0);
+        if (--depth_ != 0) {
+            return;
+        }
+        current_.pause_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - pause_start_).count();
+        current_.after = occupancy;
+        auto &totals = totals_[static_cast<size_t>(current_.kind)];
+        totals.n_pauses++;
+        totals.total_pause_us += current_.pause_us;
+        totals.max_pause_us = std::max(totals.max_pause_us, current_.pause_us);
+        totals.histogram[GetBucketIdx(current_.pause_us)]++;
+        n_pauses_++;
+        if (recent_pauses_.size() < MAX_RECENT_PAUSES) {
+            recent_pauses_.push_back(current_);
+        } else {
+            recent_pauses_[(n_pauses_ - 1) % MAX_RECENT_PAUSES] = current_;
+        }
+        if (is_log_enabled_) {
+            WriteLogLine(std::cerr, current_);
+        }
+    }
+
+    // Allocations which bypass the nursery:
+    void RecordDirectAllocation(size_t n_bytes)
+    {
+        direct_allocated_bytes_ += n_bytes;
+    }
+
+    void RecordNurseryCollection(size_t n_bytes)
+    {
+        nursery_allocated_bytes_ += n_bytes;
+    }
+
+    // Total allocated since startup, given the current nursery occupancy:
+    size_t GetAllocatedBytes(size_t nursery_used) const
+    {
+        return direct_allocated_bytes_ + nursery_allocated_bytes_ + nursery_used;
+    }
+
+    uint64_t GetUptimeUs() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time_).count();
+    }
+
+    size_t GetPausesCount() const
+    {
+        return n_pauses_;
+    }
+
+    const KindTotals &GetTotals(PauseKind kind) const
+    {
+        return totals_[static_cast<size_t>(kind)];
+    }
+
+    // Calls `visitor(record)` for the recent pauses from the oldest one:
+    template <typename VisitorFn>
+    void VisitRecentPauses(VisitorFn visitor) const
+    {
+        size_t first = (n_pauses_ > MAX_RECENT_PAUSES) ? n_pauses_ % MAX_RECENT_PAUSES : 0;
+        for (size_t i = 0; i < recent_pauses_.size(); i++) {
+            visitor(recent_pauses_[(first + i) % recent_pauses_.size()]);
+        }
+    }
+
+    static const char *GetKindName(PauseKind kind)
+    {
+        static constexpr const char *NAMES[] = {"young", "tenured-start", "tenured-step", "tenured-full"};
+        static_assert(std::size(NAMES) == static_cast<size_t>(PauseKind::COUNT));
+        return NAMES[static_cast<size_t>(kind)];
+    }
+
+    static const char *GetCauseName(Cause cause)
+    {
+        static constexpr const char *NAMES[] = {"nursery-full", "old-occupancy", "allocation-step", "tenured-exhausted",
+                                                "large-space-exhausted", "heap-snapshot", "runtime-image"};
+        static_assert(std::size(NAMES) == static_cast<size_t>(Cause::COUNT));
+        return NAMES[static_cast<size_t>(cause)];
+    }
+
+    // Fraction of the nursery evacuated by young collection:
+    static size_t GetSurvivalPercent(const PauseRecord &record)
+    {
+        if (record.before.nursery == 0) {
+            return 0;
+        }
+        return std::min<size_t>((record.copied_bytes + record.promoted_bytes) * 100 / record.before.nursery, 100);
+    }
+
+    // Upper bound (exclusive) of the histogram bucket in microseconds:
+    static uint64_t GetBucketBound(size_t bucket_idx)
+    {
+        return uint64_t(1) << bucket_idx;
+    }
+
+private:
+    static size_t GetBucketIdx(uint64_t pause_us)
+    {
+        size_t idx = 0;
+        while ((idx + 1 < N_HISTOGRAM_BUCKETS) && (pause_us >= GetBucketBound(idx))) {
+            idx++;
+        }
+        return idx;
+    }
+
+    // E.g. "[GC] #3 young+tenured-full (nursery-full) at 152ms: pause 840us, allocated 8192K, copied 12K, promoted 1030K,
+    //       survived 12%, nursery 8192K->0K, survivors 4K->12K, tenured 2048K->1900K, large 0K->0K":
+    void WriteLogLine(std::ostream &os, const PauseRecord &record) const
+    {
+        constexpr size_t K = 1024;
+        os << "[GC] #" << n_pauses_ << " " << GetKindName(record.kind);
+        for (size_t kind = 0; kind < static_cast<size_t>(PauseKind::COUNT); kind++) {
+            if ((kind != static_cast<size_t>(record.kind)) && ((record.kinds_mask >> kind) & 1U)) {
+                os << "+" << GetKindName(static_cast<PauseKind>(kind));
+            }
+        }
+        os << " (" << GetCauseName(record.cause) << ") at " << record.start_us / 1000 << "ms: pause " << record.pause_us
+           << "us, allocated " << record.allocated_bytes / K << "K";
+        if ((record.kinds_mask & (1U << static_cast<size_t>(PauseKind::YOUNG))) != 0) {
+            os << ", copied " << record.copied_bytes / K << "K, promoted " << record.promoted_bytes / K << "K, survived "
+               << GetSurvivalPercent(record) << "%";
+        }
+        os << ", nursery " << record.before.nursery / K << "K->" << record.after.nursery / K << "K"
+           << ", survivors " << record.before.survivors / K << "K->" << record.after.survivors / K << "K"
+           << ", tenured " << record.before.tenured / K << "K->" << record.after.tenured / K << "K"
+           << ", large " << record.before.large / K << "K->" << record.after.large / K << "K" << std::endl;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_time_;
+    std::chrono::steady_clock::time_point pause_start_;
+    bool is_log_enabled_ {false};
+    size_t depth_ {0};
+    PauseRecord current_ {};
+    size_t n_pauses_ {0};
+    std::array<KindTotals, static_cast<size_t>(PauseKind::COUNT)> totals_ {};
+    ConstVector<PauseRecord> recent_pauses_;
+
+    size_t direct_allocated_bytes_ {0};
+    size_t nursery_allocated_bytes_ {0};
+    size_t allocated_at_last_pause_ {0};
+};
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_GC_TELEMETRY_H
@@ -0,0 +1,34 @@
+#ifndef ALLOCATOR_HEAP_OPTIONS_H
+#define ALLOCATOR_HEAP_OPTIONS_H
+
+#include <cstddef>
+
+namespace k3s {
+
+struct HeapOptions
+{
+    static constexpr size_t DEFAULT_NURSERY_SIZE = 8U * 1024 * 1024;
+    static constexpr size_t DEFAULT_MIN_NURSERY_SIZE = 1U * 1024 * 1024;
+    static constexpr size_t DEFAULT_MAX_NURSERY_SIZE = 64U * 1024 * 1024;
+    static constexpr size_t DEFAULT_TENURED_SIZE = 8U * 1024 * 1024;
+    static constexpr size_t DEFAULT_MAX_HEAP_SIZE = 1024U * 1024 * 1024;
+
+    // Initial size of the nursery, it is resized within [min_nursery_size, max_nursery_size] according to the survival rate:
+    size_t nursery_size {DEFAULT_NURSERY_SIZE};
+    size_t min_nursery_size {DEFAULT_MIN_NURSERY_SIZE};
+    size_t max_nursery_size {DEFAULT_MAX_NURSERY_SIZE};
+    // Initial size of the tenured space, it grows on demand until the heap reaches `max_heap_size`:
+    size_t tenured_size {DEFAULT_TENURED_SIZE};
+    size_t max_heap_size {DEFAULT_MAX_HEAP_SIZE};
+    // Young regions and the tenured space are advised to be backed with transparent huge pages:
+    size_t huge_pages {0};
+    // Memory of young regions and the tenured space is faulted in when it is committed:
+    size_t prefault {0};
+    // Pages of the nursery and the "from" space are given back to the OS after each young collection,
+    // otherwise they are kept hot for the next allocations:
+    size_t release_evacuated {0};
+};
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_HEAP_OPTIONS_H
@@ -0,0 +1,149 @@
+#ifndef ALLOCATOR_HEAP_SNAPSHOT_H
+#define ALLOCATOR_HEAP_SNAPSHOT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+namespace k3s {
+
+/**
+ * Binary format of heap snapshots. A snapshot starts with `MAGIC`, followed by records. Each record is
+ * a tag byte and its fields, integers are unsigned LEB128:
+ *   SITE    site_id, pc                               - allocation site (pc of the allocating instruction)
+ *   ROOT    address                                   - reference from the stack of the interpreter
+ *   OBJECT  address, type, site_id, size, n_refs, n_refs * address
+ *   END     n_objects, total_size
+ * Type is the value of `ObjectHeader::Type`, site_id is zero if the site of the object isn't known.
+ * Records are written while the heap is walked, so the writer needs no memory besides its stream buffer.
+ */
+namespace heap_snapshot {
+
+static constexpr char MAGIC[] = "K3SHEAP1";
+static constexpr size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+enum class Tag : uint8_t {
+    END,
+    SITE,
+    ROOT,
+    OBJECT,
+};
+
+class Writer
+{
+public:
+    explicit Writer(std::ostream &os) : os_(os)
+    {
+        os_.write(MAGIC, MAGIC_SIZE);
+    }
+
+    void WriteSite(size_t site_id, size_t pc)
+    {
+        WriteTag(Tag::SITE);
+        WriteUint(site_id);
+        WriteUint(pc);
+    }
+
+    void WriteRoot(uintptr_t address)
+    {
+        WriteTag(Tag::ROOT);
+        WriteUint(address);
+    }
+
+    // Should be followed by `n_refs` calls of `WriteReference`:
+    void BeginObject(uintptr_t address, uint8_t type, size_t site_id, size_t size, size_t n_refs)
+    {
+        WriteTag(Tag::OBJECT);
+        WriteUint(address);
+        WriteUint(type);
+        WriteUint(site_id);
+        WriteUint(size);
+        WriteUint(n_refs);
+        n_objects_++;
+        total_size_ += size;
+    }
+
+    void WriteReference(uintptr_t address)
+    {
+        WriteUint(address);
+    }
+
+    void Finish()
+    {
+        WriteTag(Tag::END);
+        WriteUint(n_objects_);
+        WriteUint(total_size_);
+        os_.flush();
+    }
+
+private:
+    void WriteTag(Tag tag)
+    {
+        os_.put(static_cast<char>(tag));
+    }
+
+    void WriteUint(uint64_t value)
+    {
+        while (value >= 0x80U) {
+            os_.put(static_cast<char>((value & 0x7FU) | 0x80U));
+            value >>= 7U;
+        }
+        os_.put(static_cast<char>(value));
+    }
+
+private:
+    std::ostream &os_;
+    size_t n_objects_ {0};
+    size_t total_size_ {0};
+};
+
+// Reading functions return false if the snapshot is truncated or malformed:
+class Reader
+{
+public:
+    explicit Reader(std::istream &is) : is_(is) {}
+
+    bool ReadMagic()
+    {
+        char magic[MAGIC_SIZE] {};
+        is_.read(magic, MAGIC_SIZE);
+        return is_ && (std::memcmp(magic, MAGIC, MAGIC_SIZE) == 0);
+    }
+
+    bool ReadTag(Tag *tag)
+    {
+        int byte = is_.get();
+        if ((byte == std::char_traits<char>::eof()) || (byte > static_cast<int>(Tag::OBJECT))) {
+            return false;
+        }
+        *tag = static_cast<Tag>(byte);
+        return true;
+    }
+
+    bool ReadUint(uint64_t *value)
+    {
+        *value = 0;
+        for (size_t shift = 0; shift < 64U; shift += 7U) {
+            int byte = is_.get();
+            if (byte == std::char_traits<char>::eof()) {
+                return false;
+            }
+            *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::istream &is_;
+};
+
+}  // namespace heap_snapshot
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_HEAP_SNAPSHOT_H
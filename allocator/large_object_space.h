@@ -0,0 +1,245 @@
+#ifndef ALLOCATOR_LARGE_OBJECT_SPACE_H
+#define ALLOCATOR_LARGE_OBJECT_SPACE_H
+
+#include "allocator/object_header.h"
+#include "allocator/virtual_memory.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+
+namespace k3s {
+
+/**
+ * Non-moving space for large strings and arrays.
+ *
+ * Each object occupies its own run of pages which is committed on allocation, so large objects are never copied
+ * by young collections. Runs cover [start, cursor) without gaps and are linked in address order, so the space
+ * may be swept and adjacent free runs are coalesced. Only the first page of a free run stays committed
+ * (it holds the run header), the rest is returned to the OS. Free runs are reused first-fit.
+ */
+class LargeObjectSpace
+{
+public:
+    // Strings and arrays of at least this size are allocated here:
+    static constexpr size_t MIN_OBJECT_SIZE = 32U * 1024;
+    // Tenured marking is started when live runs exceed this threshold or twice the size left by the last sweep:
+    static constexpr size_t MIN_COLLECTION_THRESHOLD = 16U * 1024 * 1024;
+
+    void Init(char *start, size_t reserved_size)
+    {
+        ASSERT(reinterpret_cast<uintptr_t>(start) % PAGE_SIZE == 0);
+        start_ = start;
+        reserved_size_ = reserved_size;
+        cursor_ = 0;
+        committed_ = 0;
+        live_size_ = 0;
+        collection_threshold_ = MIN_COLLECTION_THRESHOLD;
+        last_run_ = nullptr;
+        free_runs_ = nullptr;
+    }
+
+    bool Contains(const void *ptr) const
+    {
+        auto *char_ptr = reinterpret_cast<const char *>(ptr);
+        return (char_ptr >= start_) && (char_ptr < start_ + reserved_size_);
+    }
+
+    static size_t GetRunSize(size_t n_bytes)
+    {
+        return AlignUp(n_bytes + RUN_HEADER_SIZE, PAGE_SIZE);
+    }
+
+    // Returns nullptr if the reserved range is exhausted:
+    void *AllocBytes(size_t n_bytes)
+    {
+        size_t run_size = GetRunSize(n_bytes);
+        Run *run = PopFreeRun(run_size);
+        if (run == nullptr) {
+            if (cursor_ + run_size > reserved_size_) {
+                return nullptr;
+            }
+            run = reinterpret_cast<Run *>(start_ + cursor_);
+            CommitMemory(run, run_size);
+            committed_ += run_size;
+            cursor_ += run_size;
+            new (run) Run();
+            run->size_ = run_size;
+            run->prev_ = last_run_;
+            if (last_run_ != nullptr) {
+                last_run_->next_ = run;
+            }
+            last_run_ = run;
+        }
+        live_size_ += run->size_;
+        return run->GetObject();
+    }
+
+    /// Frees runs of objects for which `is_alive` returns false.
+    template <typename IsAliveFn>
+    void Sweep(IsAliveFn is_alive)
+    {
+        Run *run = (cursor_ != 0) ? reinterpret_cast<Run *>(start_) : nullptr;
+        for (; run != nullptr; run = run->next_) {
+            if (!run->is_free_ && !is_alive(run->GetObject())) {
+                run = FreeRun(run);
+            }
+        }
+        collection_threshold_ = std::max(MIN_COLLECTION_THRESHOLD, live_size_ * 2);
+    }
+
+    template <typename VisitorFn>
+    void VisitObjects(VisitorFn visitor) const
+    {
+        Run *run = (cursor_ != 0) ? reinterpret_cast<Run *>(start_) : nullptr;
+        for (; run != nullptr; run = run->next_) {
+            if (!run->is_free_) {
+                visitor(run->GetObject());
+            }
+        }
+    }
+
+    bool ShouldCollect() const
+    {
+        return live_size_ >= collection_threshold_;
+    }
+
+    // Including header pages of free runs:
+    size_t GetCommittedSize() const
+    {
+        return committed_;
+    }
+
+    size_t GetLiveSize() const
+    {
+        return live_size_;
+    }
+
+private:
+    struct Run
+    {
+        // Neighbours by address:
+        Run *prev_ {};
+        Run *next_ {};
+        // Links of the free list:
+        Run *prev_free_ {};
+        Run *next_free_ {};
+        size_t size_ {};
+        bool is_free_ {};
+
+        ObjectHeader *GetObject()
+        {
+            return reinterpret_cast<ObjectHeader *>(reinterpret_cast<char *>(this) + RUN_HEADER_SIZE);
+        }
+    };
+    static constexpr size_t RUN_HEADER_SIZE = AlignUp(sizeof(Run), ObjectHeader::OBJECT_ALIGNMENT);
+
+    Run *PopFreeRun(size_t run_size)
+    {
+        Run *run = free_runs_;
+        while ((run != nullptr) && (run->size_ < run_size)) {
+            run = run->next_free_;
+        }
+        if (run == nullptr) {
+            return nullptr;
+        }
+        UnlinkFreeRun(run);
+        run->is_free_ = false;
+        // The header page is committed already:
+        CommitMemory(reinterpret_cast<char *>(run) + PAGE_SIZE, run_size - PAGE_SIZE);
+        committed_ += run_size - PAGE_SIZE;
+        if (run->size_ > run_size) {
+            auto *tail = reinterpret_cast<Run *>(reinterpret_cast<char *>(run) + run_size);
+            CommitMemory(tail, PAGE_SIZE);
+            committed_ += PAGE_SIZE;
+            new (tail) Run();
+            tail->size_ = run->size_ - run_size;
+            tail->is_free_ = true;
+            tail->prev_ = run;
+            tail->next_ = run->next_;
+            if (run->next_ != nullptr) {
+                run->next_->prev_ = tail;
+            } else {
+                last_run_ = tail;
+            }
+            run->next_ = tail;
+            run->size_ = run_size;
+            PushFreeRun(tail);
+        }
+        return run;
+    }
+
+    // Returns the free run which contains `run` after coalescing:
+    Run *FreeRun(Run *run)
+    {
+        live_size_ -= run->size_;
+        committed_ -= run->size_ - PAGE_SIZE;
+        DecommitMemory(reinterpret_cast<char *>(run) + PAGE_SIZE, run->size_ - PAGE_SIZE);
+        run->is_free_ = true;
+        if ((run->next_ != nullptr) && run->next_->is_free_) {
+            auto *next = run->next_;
+            UnlinkFreeRun(next);
+            run->size_ += next->size_;
+            RemoveRun(next);
+        }
+        if ((run->prev_ != nullptr) && run->prev_->is_free_) {
+            auto *prev = run->prev_;
+            prev->size_ += run->size_;
+            RemoveRun(run);
+            return prev;
+        }
+        PushFreeRun(run);
+        return run;
+    }
+
+    // Removes a run which is merged into its previous neighbour:
+    void RemoveRun(Run *run)
+    {
+        run->prev_->next_ = run->next_;
+        if (run->next_ != nullptr) {
+            run->next_->prev_ = run->prev_;
+        } else {
+            last_run_ = run->prev_;
+        }
+        DecommitMemory(run, PAGE_SIZE);
+        committed_ -= PAGE_SIZE;
+    }
+
+    void PushFreeRun(Run *run)
+    {
+        run->prev_free_ = nullptr;
+        run->next_free_ = free_runs_;
+        if (free_runs_ != nullptr) {
+            free_runs_->prev_free_ = run;
+        }
+        free_runs_ = run;
+    }
+
+    void UnlinkFreeRun(Run *run)
+    {
+        if (run->prev_free_ != nullptr) {
+            run->prev_free_->next_free_ = run->next_free_;
+        } else {
+            free_runs_ = run->next_free_;
+        }
+        if (run->next_free_ != nullptr) {
+            run->next_free_->prev_free_ = run->prev_free_;
+        }
+    }
+
+private:
+    char *start_ {};
+    size_t reserved_size_ {};
+    size_t cursor_ {};
+    size_t committed_ {};
+    // Total size of runs occupied by objects:
+    size_t live_size_ {};
+    size_t collection_threshold_ {};
+    Run *last_run_ {};
+    Run *free_runs_ {};
+};
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_LARGE_OBJECT_SPACE_H
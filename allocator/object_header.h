@@ -7,66 +7,240 @@
 
 namespace k3s {
 
+/**
+ * Header of each heap object, a single 64-bit word:
+ *   [0, 3)   type tag
+ *   [3]      remembered flag
+ *   [4]      forwarded flag
+ *   [5, 9)   age
+ *   [9, 19)  allocation site id
+ *   [19, 21) mark of young collections
+ *   [21, 33) mark of tenured collections
+ *   [33, 64) length (number of elements or, for fixed-size chunks, number of 8-byte words)
+ * Allocated size isn't stored, it is derived from the type and the length. When an object is evacuated,
+ * the forwarding pointer overlays the first word of its payload, so every object is at least `MIN_OBJECT_SIZE`.
+ */
 class ObjectHeader
 {
 public:
-    using MarkT = uint64_t;
+    using MarkT = uint32_t;
+    using TenuredMarkT = uint16_t;
+    using SiteIdT = uint16_t;
+
+    enum class Type : uint8_t {
+        // Zero is reserved, so zeroed memory isn't mistaken for an object header:
+        FREE_CHUNK = 1,
+        STRING,
+        FUNCTION,
+        ARRAY,
+        OBJECT,
+    };
+
+    static constexpr size_t HEADER_SIZE = sizeof(uint64_t);
+    static constexpr size_t OBJECT_ALIGNMENT = sizeof(uint64_t);
+    static constexpr size_t MIN_OBJECT_SIZE = HEADER_SIZE + sizeof(void *);
+    // Layouts of the classes in interpreter/types, they check these values with static asserts:
+    static constexpr size_t REGISTER_SIZE = 16U;
+    static constexpr size_t FUNCTION_SIZE = HEADER_SIZE + sizeof(size_t) + 9 * REGISTER_SIZE;
+    static constexpr size_t OBJECT_BASE_SIZE = HEADER_SIZE + sizeof(void *);
+
+    static constexpr size_t AGE_BITS = 4U;
+    static constexpr size_t MAX_AGE = (1U << AGE_BITS) - 1;
+    static constexpr size_t SITE_ID_BITS = 10U;
+    static constexpr size_t MAX_SITE_ID = (1U << SITE_ID_BITS) - 1;
+    // Marks are epochs, zero means "never marked":
+    static constexpr size_t MARK_BITS = 2U;
+    static constexpr MarkT MAX_MARK = (1U << MARK_BITS) - 1;
+    static constexpr size_t TENURED_MARK_BITS = 12U;
+    static constexpr TenuredMarkT MAX_TENURED_MARK = (1U << TENURED_MARK_BITS) - 1;
+    static constexpr size_t LENGTH_BITS = 31U;
+    static constexpr size_t MAX_LENGTH = (uint64_t(1) << LENGTH_BITS) - 1;
+
+    ObjectHeader(Type type, size_t length)
+    {
+        ASSERT(length <= MAX_LENGTH);
+        word_ = static_cast<uint64_t>(type) | (uint64_t(length) << LENGTH_SHIFT);
+    }
+
+    static constexpr size_t ComputeSize(Type type, size_t length)
+    {
+        size_t size = 0;
+        switch (type) {
+        case Type::FREE_CHUNK:
+            return length * OBJECT_ALIGNMENT;
+        case Type::STRING:
+            // Including the terminating null:
+            size = HEADER_SIZE + length + 1;
+            break;
+        case Type::FUNCTION:
+            size = FUNCTION_SIZE;
+            break;
+        case Type::ARRAY:
+            size = HEADER_SIZE + length * REGISTER_SIZE;
+            break;
+        case Type::OBJECT:
+            size = OBJECT_BASE_SIZE + length * REGISTER_SIZE;
+            break;
+        }
+        size = (size + OBJECT_ALIGNMENT - 1) / OBJECT_ALIGNMENT * OBJECT_ALIGNMENT;
+        return (size < MIN_OBJECT_SIZE) ? MIN_OBJECT_SIZE : size;
+    }
 
 #ifndef NDEBUG
-#define CHECK() if (_debug_mark_ != 0xCAFE) { LOG_FATAL(ObjectHeader, "Accessed invalid object header"); } 
+#define CHECK() if ((GetField(0, TYPE_BITS) == 0) || (GetField(0, TYPE_BITS) > static_cast<uint64_t>(Type::OBJECT))) { \
+    LOG_FATAL(ObjectHeader, "Accessed invalid object header"); }
 #else
 #define CHECK()
 #endif
 
+    Type GetType() const
+    {
+        CHECK();
+        return static_cast<Type>(GetField(0, TYPE_BITS));
+    }
+
+    size_t GetLength() const
+    {
+        CHECK();
+        return GetField(LENGTH_SHIFT, LENGTH_BITS);
+    }
+
+    size_t GetAllocatedSize() const
+    {
+        CHECK();
+        return ComputeSize(GetType(), GetLength());
+    }
+
     void Mark(MarkT mark)
     {
         CHECK();
-        mark_ = mark;
+        ASSERT(mark <= MAX_MARK);
+        SetField(MARK_SHIFT, MARK_BITS, mark);
+    }
+
+    bool IsMarked(MarkT mark) const
+    {
+        CHECK();
+        return GetField(MARK_SHIFT, MARK_BITS) == mark;
+    }
+
+    // Tenured marking uses its own epoch, so young collections may run in the middle of a tenured cycle:
+    void MarkTenured(TenuredMarkT mark)
+    {
+        CHECK();
+        ASSERT(mark <= MAX_TENURED_MARK);
+        SetField(TENURED_MARK_SHIFT, TENURED_MARK_BITS, mark);
+    }
+
+    bool IsTenuredMarked(TenuredMarkT mark) const
+    {
+        CHECK();
+        return GetField(TENURED_MARK_SHIFT, TENURED_MARK_BITS) == mark;
     }
-    
-    bool IsMarked(MarkT mark)
+
+    // Set for tenured objects which are in the remembered set (i.e. may hold references to young objects):
+    void SetRemembered(bool remembered)
     {
         CHECK();
-        return mark_ == mark;
+        SetField(REMEMBERED_SHIFT, 1U, remembered ? 1U : 0U);
     }
 
-    void SetAllocatedSize(size_t size)
+    bool IsRemembered() const
     {
         CHECK();
-        allocated_size_ = size;
+        return GetField(REMEMBERED_SHIFT, 1U) != 0;
     }
-    auto GetAllocatedSize() const
+
+    // Unused chunks of the tenured space have their own type:
+    bool IsFreeChunk() const
+    {
+        return GetType() == Type::FREE_CHUNK;
+    }
+
+    // Number of young collections survived by the object (saturates at `MAX_AGE`):
+    size_t GetAge() const
+    {
+        CHECK();
+        return GetField(AGE_SHIFT, AGE_BITS);
+    }
+
+    void IncrementAge()
+    {
+        CHECK();
+        if (GetAge() < MAX_AGE) {
+            SetField(AGE_SHIFT, AGE_BITS, GetAge() + 1);
+        }
+    }
+
+    // Allocation site of the object (zero if it isn't tracked):
+    void SetSiteId(SiteIdT site_id)
+    {
+        CHECK();
+        ASSERT(site_id <= MAX_SITE_ID);
+        SetField(SITE_ID_SHIFT, SITE_ID_BITS, site_id);
+    }
+
+    SiteIdT GetSiteId() const
     {
         CHECK();
-        return allocated_size_;
+        return GetField(SITE_ID_SHIFT, SITE_ID_BITS);
     }
+
+    // The old copy of an evacuated object keeps only the header, its payload is overwritten:
     void SetRelocatedPtr(void *ptr)
     {
         CHECK();
         // An Object should be relocated less than once per gc trigger:
-        ASSERT(relocated_ptr_ == nullptr);
-        relocated_ptr_ = reinterpret_cast<ObjectHeader *>(ptr);
+        ASSERT(!WasRelocated());
+        SetField(FORWARDED_SHIFT, 1U, 1U);
+        *GetForwardingSlot() = reinterpret_cast<ObjectHeader *>(ptr);
     }
-    auto GetRelocatedPtr() const
+    ObjectHeader *GetRelocatedPtr() const
     {
         CHECK();
-        return relocated_ptr_;
+        return WasRelocated() ? *GetForwardingSlot() : nullptr;
     }
     bool WasRelocated() const
     {
         CHECK();
-        return relocated_ptr_ != nullptr;
+        return GetField(FORWARDED_SHIFT, 1U) != 0;
     }
 
+#undef CHECK
+
 private:
-#ifndef NDEBUG
-    uint16_t _debug_mark_ {0xCAFE};
-#endif
-    MarkT mark_ {};
-    size_t allocated_size_ {};
-    ObjectHeader *relocated_ptr_ {};
+    static constexpr size_t TYPE_BITS = 3U;
+    static constexpr size_t REMEMBERED_SHIFT = TYPE_BITS;
+    static constexpr size_t FORWARDED_SHIFT = REMEMBERED_SHIFT + 1;
+    static constexpr size_t AGE_SHIFT = FORWARDED_SHIFT + 1;
+    static constexpr size_t SITE_ID_SHIFT = AGE_SHIFT + AGE_BITS;
+    static constexpr size_t MARK_SHIFT = SITE_ID_SHIFT + SITE_ID_BITS;
+    static constexpr size_t TENURED_MARK_SHIFT = MARK_SHIFT + MARK_BITS;
+    static constexpr size_t LENGTH_SHIFT = TENURED_MARK_SHIFT + TENURED_MARK_BITS;
+    static_assert(LENGTH_SHIFT + LENGTH_BITS == 64U);
+
+    uint64_t GetField(size_t shift, size_t bits) const
+    {
+        return (word_ >> shift) & ((uint64_t(1) << bits) - 1);
+    }
+
+    void SetField(size_t shift, size_t bits, uint64_t value)
+    {
+        uint64_t mask = ((uint64_t(1) << bits) - 1) << shift;
+        word_ = (word_ & ~mask) | ((value << shift) & mask);
+    }
+
+    ObjectHeader **GetForwardingSlot() const
+    {
+        return reinterpret_cast<ObjectHeader **>(const_cast<ObjectHeader *>(this) + 1);
+    }
+
+private:
+    uint64_t word_;
 };
 
+static_assert(sizeof(ObjectHeader) == ObjectHeader::HEADER_SIZE);
+
 }
 
 #endif
@@ -1,12 +1,23 @@
 #ifndef ALLOCATOR_REGION_H
 #define ALLOCATOR_REGION_H
 
+#include "allocator/virtual_memory.h"
 #include "common/macro.h"
+#include <sys/mman.h>
 #include <cstdint>
 #include <cstddef>
 
 namespace k3s {
 
+/**
+ * Metadata region at the fixed address.
+ *
+ * `Alloc`/`AllocBytes` bump the cursor, such memory lives until `Reset`. Blocks of the allocator adapter
+ * are returned to free lists on `deallocate`, so containers don't leak their old buffers on growth or rehash.
+ * Blocks up to `MAX_SMALL_BLOCK_SIZE` are rounded up to a power of two and kept in a list per size class,
+ * larger ones are kept in a first-fit list and their pages are given back to the OS while they are free.
+ * The control area (cursor and free lists) is placed at the start of the region.
+ */
 template <uintptr_t START_PTR, size_t SIZE>
 class Region
 {
@@ -22,13 +33,39 @@ class Region
         bool operator==(AllocatorRequirements<U> &a2) const { return true; }
         [[nodiscard]] T* allocate(size_t n)
         {
-            return Region::Alloc<T>(n);
+            return reinterpret_cast<T *>(Region::AllocBlock(n * sizeof(T)));
         }
         void deallocate(T *ptr, size_t n)
         {
-            return;
+            Region::FreeBlock(ptr, n * sizeof(T));
         }
     };
+
+    struct FreeNode
+    {
+        FreeNode *next;
+        // Used by large blocks only:
+        size_t size;
+    };
+
+public:
+    static constexpr size_t ALIGNMENT = 16U;
+    static constexpr size_t MIN_BLOCK_SIZE = 16U;
+    static constexpr size_t MAX_SMALL_BLOCK_SIZE = 64U * 1024;
+    // Size class `i` holds blocks of `MIN_BLOCK_SIZE << i` bytes:
+    static constexpr size_t N_SIZE_CLASSES = 13U;
+    static_assert((MIN_BLOCK_SIZE << (N_SIZE_CLASSES - 1)) == MAX_SMALL_BLOCK_SIZE);
+    static_assert(sizeof(FreeNode) <= MIN_BLOCK_SIZE);
+
+private:
+    struct Control
+    {
+        size_t cursor;
+        FreeNode *small_blocks[N_SIZE_CLASSES];
+        FreeNode *large_blocks;
+    };
+    static constexpr size_t CONTROL_SIZE = AlignUp(sizeof(Control), ALIGNMENT);
+
 public:
     static bool Contains(const void *ptr)
     {
@@ -36,9 +73,11 @@ public:
         return (intptr >= START_PTR) && (intptr < (START_PTR + SIZE));
     }
 
+    // All allocated memory is released at once, e.g. the GC internals region is reset after each collection:
     static void Reset()
     {
-        *GetCursor() = sizeof(*GetCursor()); 
+        *GetControl() = Control {};
+        *GetCursor() = CONTROL_SIZE;
     }
     template <typename T>
     auto Adapter()
@@ -52,7 +91,7 @@ public:
     }
     static auto *GetCursor()
     {
-        return reinterpret_cast<size_t *>(START_PTR);
+        return &GetControl()->cursor;
     }
     static char *GetStartPtr()
     {
@@ -60,19 +99,117 @@ public:
     }
     static void *AllocBytes(size_t n_bytes)
     {
-        size_t new_cursor = *GetCursor() + n_bytes;
-        if (new_cursor > SIZE) {
+        size_t cursor = AlignUp(*GetCursor(), ALIGNMENT);
+        if (n_bytes > SIZE - cursor) {
             LOG_FATAL(ALLOCATOR, "OOM");
         }
-        auto allocated = GetStartPtr() + *GetCursor();
-        *GetCursor() = new_cursor;
-        return allocated;
+        *GetCursor() = cursor + n_bytes;
+        return GetStartPtr() + cursor;
     }
+
+    /// Allocates a block which may be returned by `FreeBlock` with the same \p n_bytes.
+    static void *AllocBlock(size_t n_bytes)
+    {
+        auto *control = GetControl();
+        if (n_bytes <= MAX_SMALL_BLOCK_SIZE) {
+            size_t class_idx = GetSizeClass(n_bytes);
+            auto *block = control->small_blocks[class_idx];
+            if (block != nullptr) {
+                control->small_blocks[class_idx] = block->next;
+                return block;
+            }
+            return AllocBytes(GetClassSize(class_idx));
+        }
+        n_bytes = AlignUp(n_bytes, ALIGNMENT);
+        for (auto **link = &control->large_blocks; *link != nullptr; link = &(*link)->next) {
+            auto *block = *link;
+            if (block->size < n_bytes) {
+                continue;
+            }
+            *link = block->next;
+            // The tail is kept for smaller blocks:
+            AddFreeRange(reinterpret_cast<char *>(block) + n_bytes, block->size - n_bytes);
+            return block;
+        }
+        return AllocBytes(n_bytes);
+    }
+
+    static void FreeBlock(void *ptr, size_t n_bytes)
+    {
+        ASSERT(Contains(ptr));
+        if (n_bytes <= MAX_SMALL_BLOCK_SIZE) {
+            PushSmallBlock(ptr, GetSizeClass(n_bytes));
+            return;
+        }
+        n_bytes = AlignUp(n_bytes, ALIGNMENT);
+        // Whole pages of the block are released, except the one with the list node:
+        auto start = AlignUp(reinterpret_cast<uintptr_t>(ptr) + sizeof(FreeNode), PAGE_SIZE);
+        auto end = (reinterpret_cast<uintptr_t>(ptr) + n_bytes) / PAGE_SIZE * PAGE_SIZE;
+        if (start < end) {
+            madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
+        }
+        PushLargeBlock(ptr, n_bytes);
+    }
+
     static size_t GetRemainingSpace()
     {
         return SIZE - *GetCursor();
     }
-    static constexpr size_t MAX_ALLOC_SIZE = SIZE - sizeof(*GetCursor());
+
+    static constexpr size_t MAX_ALLOC_SIZE = SIZE - CONTROL_SIZE;
+
+private:
+    static Control *GetControl()
+    {
+        return reinterpret_cast<Control *>(START_PTR);
+    }
+
+    // The smallest class which fits `n_bytes`:
+    static size_t GetSizeClass(size_t n_bytes)
+    {
+        if (n_bytes <= MIN_BLOCK_SIZE) {
+            return 0;
+        }
+        return (sizeof(unsigned long long) * 8U) - __builtin_clzll((n_bytes - 1) / MIN_BLOCK_SIZE);
+    }
+
+    static constexpr size_t GetClassSize(size_t class_idx)
+    {
+        return MIN_BLOCK_SIZE << class_idx;
+    }
+
+    static void PushSmallBlock(void *ptr, size_t class_idx)
+    {
+        auto *control = GetControl();
+        auto *block = reinterpret_cast<FreeNode *>(ptr);
+        block->next = control->small_blocks[class_idx];
+        control->small_blocks[class_idx] = block;
+    }
+
+    static void PushLargeBlock(void *ptr, size_t n_bytes)
+    {
+        auto *control = GetControl();
+        auto *block = reinterpret_cast<FreeNode *>(ptr);
+        block->next = control->large_blocks;
+        block->size = n_bytes;
+        control->large_blocks = block;
+    }
+
+    // Splits [ptr, ptr + n_bytes) into free blocks, `n_bytes` is a multiple of `ALIGNMENT`:
+    static void AddFreeRange(char *ptr, size_t n_bytes)
+    {
+        if (n_bytes > MAX_SMALL_BLOCK_SIZE) {
+            PushLargeBlock(ptr, n_bytes);
+            return;
+        }
+        while (n_bytes >= MIN_BLOCK_SIZE) {
+            // The largest class which fits into the rest:
+            size_t class_idx = (sizeof(unsigned long long) * 8U - 1) - __builtin_clzll(n_bytes / MIN_BLOCK_SIZE);
+            PushSmallBlock(ptr, class_idx);
+            ptr += GetClassSize(class_idx);
+            n_bytes -= GetClassSize(class_idx);
+        }
+    }
 };
 
 } // namespace k3s
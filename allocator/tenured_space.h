@@ -0,0 +1,308 @@
+#ifndef ALLOCATOR_TENURED_SPACE_H
+#define ALLOCATOR_TENURED_SPACE_H
+
+#include "allocator/object_header.h"
+#include "allocator/virtual_memory.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+
+namespace k3s {
+
+/**
+ * Non-moving space for tenured objects.
+ *
+ * Memory is handed out from segregated free lists (refilled by sweeping) and, when they are empty,
+ * by bumping the cursor. The space is always walkable: every chunk in [first chunk, cursor) starts with
+ * an `ObjectHeader` whose allocated size is the size of the chunk, so the sweeper may iterate over it.
+ * Free chunks keep their size (in 8-byte words) in the length of the header.
+ *
+ * Only `capacity_` bytes of the reserved range are committed, the space grows up to `max_capacity_`.
+ * The limit may change at runtime, as the tenured space shares the heap size limit with the large object space.
+ */
+class TenuredSpace
+{
+public:
+    struct FreeChunk : public ObjectHeader
+    {
+        explicit FreeChunk(size_t chunk_size) : ObjectHeader(Type::FREE_CHUNK, chunk_size / ALIGNMENT) {}
+
+        FreeChunk *next_ {};
+    };
+
+    static constexpr size_t ALIGNMENT = ObjectHeader::OBJECT_ALIGNMENT;
+    static constexpr size_t MIN_CHUNK_SIZE = AlignUp(sizeof(FreeChunk), ALIGNMENT);
+    static_assert(MIN_CHUNK_SIZE == ObjectHeader::MIN_OBJECT_SIZE);
+    static constexpr size_t MAX_CHUNK_SIZE = ObjectHeader::MAX_LENGTH * ALIGNMENT;
+    // Chunks up to `MAX_BINNED_SIZE` are kept in exact-size bins, larger ones in a first-fit list:
+    static constexpr size_t N_BINS = 64U;
+    static constexpr size_t MAX_BINNED_SIZE = MIN_CHUNK_SIZE + (N_BINS - 1) * ALIGNMENT;
+    // Minimal amount of memory committed at once:
+    static constexpr size_t GROW_GRANULARITY = 1024U * 1024;
+
+    void Init(char *start, size_t capacity, size_t reserved_size, bool prefault)
+    {
+        ASSERT(reinterpret_cast<uintptr_t>(start) % PAGE_SIZE == 0);
+        start_ = start;
+        prefault_ = prefault;
+        capacity_ = 0;
+        reserved_size_ = reserved_size;
+        max_capacity_ = reserved_size;
+        if (!Grow(capacity)) {
+            LOG_FATAL(ALLOCATOR, "Tenured size exceeds heap limit");
+        }
+        Reset();
+    }
+
+    bool Contains(const void *ptr) const
+    {
+        auto *char_ptr = reinterpret_cast<const char *>(ptr);
+        return (char_ptr >= start_) && (char_ptr < start_ + reserved_size_);
+    }
+
+    void Reset()
+    {
+        cursor_ = 0;
+        free_bytes_ = 0;
+        sweep_pos_ = 0;
+        sweep_limit_ = 0;
+        ClearFreeLists();
+    }
+
+    /// Commits at least \p n_bytes more. Returns false if the space can't grow that much.
+    bool Grow(size_t n_bytes)
+    {
+        size_t new_capacity = AlignUp(capacity_ + std::max(n_bytes, GROW_GRANULARITY), PAGE_SIZE);
+        new_capacity = std::min(new_capacity, max_capacity_);
+        if (new_capacity < capacity_ + n_bytes) {
+            return false;
+        }
+        CommitMemory(start_ + capacity_, new_capacity - capacity_);
+        if (prefault_) {
+            PrefaultMemory(start_ + capacity_, new_capacity - capacity_);
+        }
+        capacity_ = new_capacity;
+        return true;
+    }
+
+    // Free lists may be too fragmented even if `GetRemainingSpace` reports enough memory, then the space is grown:
+    void *AllocBytes(size_t n_bytes)
+    {
+        void *allocated = TryAllocBytes(n_bytes);
+        if (allocated != nullptr) {
+            return allocated;
+        }
+        n_bytes = AlignUp(n_bytes, ALIGNMENT);
+        if (!Grow(cursor_ + n_bytes - capacity_)) {
+            LOG_FATAL(ALLOCATOR, "OOM (tenured space)");
+        }
+        allocated = start_ + cursor_;
+        cursor_ += n_bytes;
+        return allocated;
+    }
+
+    // Returns nullptr if the space should be grown:
+    void *TryAllocBytes(size_t n_bytes)
+    {
+        n_bytes = AlignUp(n_bytes, ALIGNMENT);
+        ASSERT(n_bytes >= MIN_CHUNK_SIZE);
+
+        if (n_bytes <= MAX_BINNED_SIZE) {
+            // Exact fit, otherwise the smallest binned chunk which may be split:
+            auto *chunk = PopBinnedChunk(GetBinIdx(n_bytes), GetBinIdx(n_bytes) + 1);
+            if (chunk == nullptr && n_bytes + MIN_CHUNK_SIZE <= MAX_BINNED_SIZE) {
+                chunk = PopBinnedChunk(GetBinIdx(n_bytes + MIN_CHUNK_SIZE), N_BINS);
+            }
+            if (chunk != nullptr) {
+                return SplitChunk(chunk, n_bytes);
+            }
+        }
+        for (auto **link = &large_; *link != nullptr; link = &(*link)->next_) {
+            auto *chunk = *link;
+            size_t chunk_size = chunk->GetAllocatedSize();
+            if ((chunk_size != n_bytes) && (chunk_size < n_bytes + MIN_CHUNK_SIZE)) {
+                continue;
+            }
+            *link = chunk->next_;
+            free_bytes_ -= chunk_size;
+            return SplitChunk(chunk, n_bytes);
+        }
+
+        if (cursor_ + n_bytes > capacity_) {
+            return nullptr;
+        }
+        auto allocated = start_ + cursor_;
+        cursor_ += n_bytes;
+        return allocated;
+    }
+
+    // Free-list memory is counted too, so allocations may fail because of fragmentation:
+    size_t GetRemainingSpace() const
+    {
+        return capacity_ - cursor_ + free_bytes_;
+    }
+
+    size_t GetUsedSpace() const
+    {
+        return cursor_ - free_bytes_;
+    }
+
+    size_t GetCapacity() const
+    {
+        return capacity_;
+    }
+
+    size_t GetMaxCapacity() const
+    {
+        return max_capacity_;
+    }
+
+    void SetMaxCapacity(size_t max_capacity)
+    {
+        ASSERT(max_capacity >= capacity_ && max_capacity <= reserved_size_);
+        max_capacity_ = max_capacity;
+    }
+
+    // Skips free chunks. Dead objects are visited unless they are swept:
+    template <typename VisitorFn>
+    void VisitObjects(VisitorFn visitor) const
+    {
+        size_t pos = 0;
+        while (pos < cursor_) {
+            auto *chunk = reinterpret_cast<ObjectHeader *>(start_ + pos);
+            pos += chunk->GetAllocatedSize();
+            if (!chunk->IsFreeChunk()) {
+                visitor(chunk);
+            }
+        }
+    }
+
+    // Sweeping covers chunks allocated before `StartSweep` only. Objects allocated during sweeping either
+    // reuse already swept chunks or are placed after `sweep_limit_`, so they are never visited:
+    void StartSweep()
+    {
+        sweep_pos_ = 0;
+        sweep_limit_ = cursor_;
+        free_bytes_ = 0;
+        ClearFreeLists();
+    }
+
+    /// Sweeps chunks until `should_yield()` returns true. Adjacent dead chunks are coalesced.
+    /// Returns true when the whole space is swept.
+    template <typename IsAliveFn, typename ShouldYieldFn>
+    bool SweepStep(IsAliveFn is_alive, ShouldYieldFn should_yield)
+    {
+        size_t run_start = sweep_pos_;
+        while (sweep_pos_ < sweep_limit_) {
+            auto *chunk = reinterpret_cast<ObjectHeader *>(start_ + sweep_pos_);
+            size_t chunk_size = chunk->GetAllocatedSize();
+            ASSERT(chunk_size % ALIGNMENT == 0);
+            if (!chunk->IsFreeChunk() && is_alive(chunk)) {
+                AddFreeChunk(start_ + run_start, sweep_pos_ - run_start);
+                sweep_pos_ += chunk_size;
+                run_start = sweep_pos_;
+                if (should_yield()) {
+                    return false;
+                }
+                continue;
+            }
+            sweep_pos_ += chunk_size;
+        }
+        AddFreeChunk(start_ + run_start, sweep_pos_ - run_start);
+        return true;
+    }
+
+private:
+    static size_t GetBinIdx(size_t chunk_size)
+    {
+        ASSERT(chunk_size >= MIN_CHUNK_SIZE && chunk_size <= MAX_BINNED_SIZE);
+        return (chunk_size - MIN_CHUNK_SIZE) / ALIGNMENT;
+    }
+
+    void ClearFreeLists()
+    {
+        for (auto &bin : bins_) {
+            bin = nullptr;
+        }
+        bins_mask_ = 0;
+        large_ = nullptr;
+    }
+
+    // Pops a chunk from the first non-empty bin in [first_idx, end_idx):
+    FreeChunk *PopBinnedChunk(size_t first_idx, size_t end_idx)
+    {
+        static_assert(N_BINS == 64U);
+        uint64_t mask = (first_idx < N_BINS) ? (bins_mask_ >> first_idx) << first_idx : 0;
+        if (end_idx < N_BINS) {
+            mask &= (uint64_t(1) << end_idx) - 1;
+        }
+        if (mask == 0) {
+            return nullptr;
+        }
+        size_t idx = __builtin_ctzll(mask);
+        auto *chunk = bins_[idx];
+        bins_[idx] = chunk->next_;
+        if (bins_[idx] == nullptr) {
+            bins_mask_ &= ~(uint64_t(1) << idx);
+        }
+        free_bytes_ -= chunk->GetAllocatedSize();
+        return chunk;
+    }
+
+    // Returns the tail of the chunk to free lists:
+    void *SplitChunk(FreeChunk *chunk, size_t n_bytes)
+    {
+        size_t chunk_size = chunk->GetAllocatedSize();
+        ASSERT(chunk_size == n_bytes || chunk_size >= n_bytes + MIN_CHUNK_SIZE);
+        if (chunk_size != n_bytes) {
+            AddFreeChunk(reinterpret_cast<char *>(chunk) + n_bytes, chunk_size - n_bytes);
+        }
+        return chunk;
+    }
+
+    void AddFreeChunk(char *ptr, size_t chunk_size)
+    {
+        // Size of a chunk is limited by the length field of the header:
+        while (chunk_size > MAX_CHUNK_SIZE) {
+            size_t part_size = (chunk_size - MAX_CHUNK_SIZE < MIN_CHUNK_SIZE) ? MAX_CHUNK_SIZE - MIN_CHUNK_SIZE : MAX_CHUNK_SIZE;
+            AddFreeChunk(ptr, part_size);
+            ptr += part_size;
+            chunk_size -= part_size;
+        }
+        if (chunk_size == 0) {
+            return;
+        }
+        ASSERT(chunk_size >= MIN_CHUNK_SIZE);
+        auto *chunk = new (ptr) FreeChunk(chunk_size);
+        if (chunk_size <= MAX_BINNED_SIZE) {
+            chunk->next_ = bins_[GetBinIdx(chunk_size)];
+            bins_[GetBinIdx(chunk_size)] = chunk;
+            bins_mask_ |= uint64_t(1) << GetBinIdx(chunk_size);
+        } else {
+            chunk->next_ = large_;
+            large_ = chunk;
+        }
+        free_bytes_ += chunk_size;
+    }
+
+private:
+    char *start_ {};
+    size_t capacity_ {};
+    size_t max_capacity_ {};
+    size_t reserved_size_ {};
+    size_t cursor_ {};
+    size_t free_bytes_ {};
+    size_t sweep_pos_ {};
+    size_t sweep_limit_ {};
+    bool prefault_ {};
+    FreeChunk *bins_[N_BINS] {};
+    // Bit `i` is set if `bins_[i]` isn't empty:
+    uint64_t bins_mask_ {};
+    FreeChunk *large_ {};
+};
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_TENURED_SPACE_H
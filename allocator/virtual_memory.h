@@ -0,0 +1,70 @@
+#ifndef ALLOCATOR_VIRTUAL_MEMORY_H
+#define ALLOCATOR_VIRTUAL_MEMORY_H
+
+#include "common/macro.h"
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstddef>
+
+namespace k3s {
+
+static constexpr size_t PAGE_SIZE = 4096U;
+static constexpr size_t HUGE_PAGE_SIZE = 2U * 1024 * 1024;
+
+/// Reserves address space at \p addr without committing memory.
+inline void ReserveMemory(uintptr_t addr, size_t size)
+{
+    void *buf = mmap(reinterpret_cast<void *>(addr), size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (buf != reinterpret_cast<void *>(addr)) {
+        LOG_FATAL(ALLOCATOR, "Can't reserve " << size << " bytes at " << reinterpret_cast<void *>(addr));
+    }
+}
+
+/// Makes reserved pages in [\p ptr, \p ptr + \p size) accessible.
+inline void CommitMemory(void *ptr, size_t size)
+{
+    ASSERT(reinterpret_cast<uintptr_t>(ptr) % PAGE_SIZE == 0);
+    if (mprotect(ptr, AlignUp(size, PAGE_SIZE), PROT_READ | PROT_WRITE) != 0) {
+        LOG_FATAL(ALLOCATOR, "Can't commit " << size << " bytes at " << ptr);
+    }
+}
+
+/// Returns pages in [\p ptr, \p ptr + \p size) to the OS, the range stays reserved.
+inline void DecommitMemory(void *ptr, size_t size)
+{
+    ASSERT(reinterpret_cast<uintptr_t>(ptr) % PAGE_SIZE == 0);
+    madvise(ptr, AlignUp(size, PAGE_SIZE), MADV_DONTNEED);
+    mprotect(ptr, AlignUp(size, PAGE_SIZE), PROT_NONE);
+}
+
+/// Asks the OS to back [\p ptr, \p ptr + \p size) with transparent huge pages. It is only a hint,
+/// e.g. THP may be disabled, so errors are ignored. Reserved ranges keep the hint once they are committed.
+inline void AdviseHugePages(void *ptr, size_t size)
+{
+    madvise(ptr, size, MADV_HUGEPAGE);
+}
+
+/// Faults in committed pages in [\p ptr, \p ptr + \p size) in advance.
+inline void PrefaultMemory(void *ptr, size_t size)
+{
+    ASSERT(reinterpret_cast<uintptr_t>(ptr) % PAGE_SIZE == 0);
+    if (madvise(ptr, AlignUp(size, PAGE_SIZE), MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+    // Kernels before 5.14 don't support MADV_POPULATE_WRITE:
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        reinterpret_cast<volatile char *>(ptr)[offset] = 0;
+    }
+}
+
+/// Drops contents of committed pages in [\p ptr, \p ptr + \p size), they stay accessible and read as zeros.
+/// Pages mapped from a runtime image read its contents again, so callers shouldn't rely on zeros.
+inline void ReleaseMemory(void *ptr, size_t size)
+{
+    ASSERT(reinterpret_cast<uintptr_t>(ptr) % PAGE_SIZE == 0);
+    madvise(ptr, AlignUp(size, PAGE_SIZE), MADV_DONTNEED);
+}
+
+}  // namespace k3s
+
+#endif  // ALLOCATOR_VIRTUAL_MEMORY_H
@@ -2,11 +2,14 @@
 #define ASSEMBLER_H
 
 #include "interpreter/generated/inst_decoder.h"
+#include "interpreter/generated/inst_dataflow.h"
 #include "interpreter/types/coretypes.h"
 #include "common/macro.h"
 #include "classfile/class_file.h"
+#include "assembler/locals.h"
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <unordered_map>
 
@@ -23,18 +26,39 @@ extern AsmEncoder ENCODER;
 class AsmEncoder {
     struct ObjectDescr
     {
+        std::string name_;
         Vector<std::string> data_fields_;
         Vector<std::string> methods_;
         Vector<size_t> methods_bc_offsets_;
     };
 public:
+    // Functions and methods in order of their code:
+    struct FunctionDescr
+    {
+        std::string name_;
+        size_t entry_pc_;
+    };
+    // Symbols of other modules in order of declaration:
+    struct ImportDescr
+    {
+        std::string module_;
+        std::string symbol_;
+        uint8_t pool_id_;
+    };
+
     static int Process(FILE *file);
 
     static void DumpToFile(FILE *file);
 
+    /// Runs `BytecodeOptimizer` at \p level over the encoded program and remaps entries of functions.
+    static void Optimize(int level);
+
     template<size_t opc_size, size_t op1_size, size_t op2_size>
-    static void Encode(uint8_t opcode, uint8_t op1, uint8_t op2) {
+    static void Encode(uint8_t opcode, int op1, int op2) {
         ASSERT((opc_size + op1_size + op2_size) == 16U);
+        op1 = RecordLocal(op1, LocalOperand::Position::FIRST_NEAR);
+        op2 = RecordLocal(op2, LocalOperand::Position::SECOND_NEAR);
+        // A negative immediate of `opc_r4_i4` is truncated to its 4 bits by the shift:
         uint8_t operands = op2;
         operands <<= InstDecoder::SECOND_NEAR_REG_SHIFT;
         ASSERT(op1 <= InstDecoder::FIRST_NEAR_REG_MASK);
@@ -43,9 +67,13 @@ public:
     }
 
     template<size_t opc_size, size_t op1_size>
-    static void Encode(uint8_t opcode, uint8_t operand) {
+    static void Encode(uint8_t opcode, int operand) {
         ASSERT((opc_size + op1_size) == 16U);
-        ENCODER.instructions_buffer_.emplace_back(opcode, operand);
+        // Immediates are encoded here too, they never reach `LOCAL_REG_BASE`:
+        if (operand >= LOCAL_REG_BASE) {
+            operand = RecordLocal(operand, LocalOperand::Position::FAR);
+        }
+        ENCODER.instructions_buffer_.emplace_back(opcode, static_cast<uint8_t>(operand));
     }
     template<size_t opc_size>
     static void Encode(uint8_t opcode) {
@@ -65,6 +93,7 @@ public:
         auto bc_offset = ENCODER.instructions_buffer_.size();
         LOG_DEBUG(ASSEMBLER, "Function `" << c_str << "` (pc " << bc_offset << ")");
         ENCODER.constant_pool_.SetFunction(ENCODER.temp_idx_, bc_offset);
+        ENCODER.functions_.push_back({c_str, bc_offset});
     }
     
     static void DeclareAndDefineMethod(char *c_str)
@@ -73,6 +102,7 @@ public:
         LOG_DEBUG(ASSEMBLER, "Method `" << c_str << "` (pc " << bc_offset << ")");
         ENCODER.objects_storage_.back().methods_bc_offsets_.push_back(bc_offset);
         ENCODER.objects_storage_.back().methods_.emplace_back(c_str);
+        ENCODER.functions_.push_back({ENCODER.objects_storage_.back().name_ + "::" + c_str, bc_offset});
     }
     
     static void DeclareAndDefineAnyDataMember(char *c_str)
@@ -85,6 +115,31 @@ public:
         DeclareId(c_str);
         ENCODER.constant_pool_.SetObject(ENCODER.temp_idx_, ENCODER.objects_storage_.size());
         ENCODER.objects_storage_.emplace_back();
+        ENCODER.objects_storage_.back().name_ = c_str;
+    }
+
+    static void DeclareImportModule(const char *c_str)
+    {
+        ENCODER.import_module_ = c_str;
+    }
+
+    // The symbol is referenced by its name, so names of imports share the namespace with declarations:
+    static void DeclareImport(char *c_str)
+    {
+        DeclareId(c_str);
+        LOG_DEBUG(ASSEMBLER, "Import `" << ENCODER.import_module_ << "." << c_str << "`");
+        ENCODER.imports_.push_back({ENCODER.import_module_, c_str, ENCODER.temp_idx_});
+    }
+
+    /// Returns false if \p name isn't declared.
+    static bool FindId(const std::string &name, uint8_t *id)
+    {
+        auto it = ENCODER.declared_objects_.find(name);
+        if (it == ENCODER.declared_objects_.end()) {
+            return false;
+        }
+        *id = it->second;
+        return true;
     }
 
     static void FinalizeObject()
@@ -131,6 +186,11 @@ public:
         
         if (ENCODER.declared_labels_.find(key) != ENCODER.declared_labels_.end()) {
             size_t label_offset = ENCODER.declared_labels_[key];
+            // Functions are verified separately, see `Verifier`. Forward labels of other functions are
+            // reported as unresolved by `CheckLabelsResolved`:
+            if (label_offset < ENCODER.functions_.back().entry_pc_) {
+                LOG_FATAL(ENCODER, "Label '" << key << "' is defined in another function");
+            }
             return bit_cast<uint8_t>(GetResolveRelativeOffset(label_offset, inst_with_pending_label_idx));
         }
 
@@ -185,11 +245,42 @@ public:
         if (ENCODER.unresolved_labels_.size() != 0) {
             LOG_FATAL(ENCODER, "There are " << ENCODER.unresolved_labels_.size() << " unresolved labels!");
         }
-        if (ENCODER.instructions_buffer_.back().GetOpcode() != Opcode::RET) {
-            LOG_FATAL(ENCODER, "Function should end with `RET`");
+        // `tailcall` returns too, so it may end the function:
+        if (InstDataflow::Get(ENCODER.instructions_buffer_.back()).flow != InstDataflow::Flow::RETURN) {
+            LOG_FATAL(ENCODER, "Function should end with `RET` or `TAILCALL`");
         } 
     }
 
+    /// Returns the operand value of the local `%name` of the current function, it is replaced by a register
+    /// in `AllocateLocals` at the end of the function.
+    static int ResolveLocal(const char *c_str)
+    {
+        ASSERT(c_str[0] == '%');
+        std::string key(c_str + 1);
+        auto it = ENCODER.locals_.find(key);
+        if (it == ENCODER.locals_.end()) {
+            it = ENCODER.locals_.emplace(key, ENCODER.local_names_.size()).first;
+            ENCODER.local_names_.push_back(key);
+        }
+        return LOCAL_REG_BASE + static_cast<int>(it->second);
+    }
+
+    /// Returns the value of a 4-bit immediate (`addi`), which is an integer literal.
+    static int ParseSmallImm(const char *c_str)
+    {
+        char *end = nullptr;
+        long imm = strtol(c_str, &end, 10);
+        if ((*end != '\0') || (imm < InstDecoder::MIN_SMALL_IMM) || (imm > InstDecoder::MAX_SMALL_IMM)) {
+            LOG_FATAL(ENCODER, "Immediate '" << c_str << "' is not an integer in ["
+                      << static_cast<int>(InstDecoder::MIN_SMALL_IMM) << ", "
+                      << static_cast<int>(InstDecoder::MAX_SMALL_IMM) << "]");
+        }
+        return static_cast<int>(imm);
+    }
+
+    /// Assigns registers to locals of the function just parsed (see `LocalsAllocator`) and patches their operands.
+    static void AllocateLocals();
+
     static ConstantPool &GetConstantPool()
     {
         return ENCODER.constant_pool_;
@@ -205,6 +296,110 @@ public:
         return objects_storage_;
     }
 
+    const auto &GetStackMaps()
+    {
+        return stack_maps_;
+    }
+
+    const auto &GetFunctions()
+    {
+        return functions_;
+    }
+
+    const auto &GetImports()
+    {
+        return imports_;
+    }
+
+    const auto &GetDeclaredIds()
+    {
+        return declared_objects_;
+    }
+
+    /// Computes live registers of each safepoint by backward dataflow over the whole program.
+    /// Calls aren't edges of the control flow graph, so functions don't have to be separated.
+    static void BuildStackMaps()
+    {
+        using MaskT = InstDataflow::MaskT;
+        const auto &instructions = ENCODER.instructions_buffer_;
+        size_t n_insts = instructions.size();
+        Vector<InstDataflow> dataflow(n_insts);
+        Vector<size_t> targets(n_insts);
+        for (size_t pc = 0; pc < n_insts; pc++) {
+            dataflow[pc] = InstDataflow::Get(instructions[pc]);
+            auto flow = dataflow[pc].flow;
+            if (flow == InstDataflow::Flow::JUMP || flow == InstDataflow::Flow::BRANCH) {
+                auto offset = bit_cast<int8_t>(instructions[pc].GetOperands());
+                auto target = static_cast<ptrdiff_t>(pc) + offset;
+                if (target < 0 || static_cast<size_t>(target) >= n_insts) {
+                    LOG_FATAL(ENCODER, "Branch target is out of code (pc " << pc << ")");
+                }
+                targets[pc] = target;
+            }
+        }
+
+        auto get_live_in = [](const Vector<MaskT> &live_in, size_t pc) {
+            return (pc < live_in.size()) ? live_in[pc] : MaskT(0);
+        };
+        Vector<MaskT> live_in(n_insts, 0);
+        Vector<MaskT> live_out(n_insts, 0);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t pc = n_insts; pc-- > 0;) {
+                MaskT out = 0;
+                switch (dataflow[pc].flow) {
+                case InstDataflow::Flow::NEXT:
+                    out = get_live_in(live_in, pc + 1);
+                    break;
+                case InstDataflow::Flow::JUMP:
+                    out = live_in[targets[pc]];
+                    break;
+                case InstDataflow::Flow::BRANCH:
+                    out = get_live_in(live_in, pc + 1) | live_in[targets[pc]];
+                    break;
+                case InstDataflow::Flow::RETURN:
+                    break;
+                }
+                MaskT in = (out & ~dataflow[pc].defs) | dataflow[pc].uses;
+                changed |= (in != live_in[pc]) || (out != live_out[pc]);
+                live_in[pc] = in;
+                live_out[pc] = out;
+            }
+        }
+
+        // Allocations may trigger GC both before and right after their outputs are written (tenured marking
+        // may be started when the object is already stored), while caller frames are scanned during the call,
+        // so only registers used after the return are live:
+        ENCODER.stack_maps_.clear();
+        for (size_t pc = 0; pc < n_insts; pc++) {
+            switch (dataflow[pc].safepoint) {
+            case InstDataflow::Safepoint::ALLOC:
+                ENCODER.stack_maps_.push_back({static_cast<uint32_t>(pc), live_in[pc] | dataflow[pc].defs});
+                break;
+            case InstDataflow::Safepoint::CALL:
+                ENCODER.stack_maps_.push_back({static_cast<uint32_t>(pc), live_out[pc]});
+                break;
+            case InstDataflow::Safepoint::NONE:
+                break;
+            }
+        }
+        LOG_DEBUG(ASSEMBLER, "Stack maps: " << ENCODER.stack_maps_.size() << " safepoints");
+    }
+
+private:
+    // Operand values of locals, they are out of range of both registers and immediates:
+    static constexpr int LOCAL_REG_BASE = 1 << 16;
+
+    static int RecordLocal(int operand, LocalOperand::Position position)
+    {
+        if (operand < LOCAL_REG_BASE) {
+            return operand;
+        }
+        size_t local = operand - LOCAL_REG_BASE;
+        ENCODER.local_operands_.push_back({ENCODER.instructions_buffer_.size(), position, local});
+        return 0;
+    }
+
 private:
     Vector<BytecodeInstruction> instructions_buffer_ {};
     Hash<std::string, uint8_t> declared_objects_ {};
@@ -212,7 +407,15 @@ private:
     Hash<std::string, Vector<size_t>> unresolved_labels_ {};
     Vector<std::string> strings_storage_ {};
     Vector<ObjectDescr> objects_storage_ {};
+    Vector<StackMapRecord> stack_maps_ {};
+    Vector<FunctionDescr> functions_ {};
+    Vector<ImportDescr> imports_ {};
+    std::string import_module_ {};
     ConstantPool constant_pool_ {};
+    // Locals of the current function:
+    Hash<std::string, size_t> locals_ {};
+    Vector<std::string> local_names_ {};
+    Vector<LocalOperand> local_operands_ {};
 
     uint8_t temp_idx_ {};
     bool is_class_context_ {false};
@@ -0,0 +1,332 @@
+#include "assembler/inliner.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace k3s {
+
+namespace {
+
+using Flow = InstDataflow::Flow;
+using Operands = InstDataflow::Operands;
+
+constexpr InstDataflow::MaskT ACC_MASK = InstDataflow::MaskT(1) << InstDataflow::ACC_BIT;
+constexpr InstDataflow::MaskT REGS_MASK = ACC_MASK - 1;
+
+bool IsJumpOrBranch(Flow flow)
+{
+    return (flow == Flow::JUMP) || (flow == Flow::BRANCH);
+}
+
+bool FitsOffset(ptrdiff_t offset)
+{
+    return (offset >= std::numeric_limits<int8_t>::min()) && (offset <= std::numeric_limits<int8_t>::max());
+}
+
+uint8_t EncodeNearRegs(size_t first, size_t second)
+{
+    ASSERT(first < InstDataflow::N_REGS && second < InstDataflow::N_REGS);
+    return static_cast<uint8_t>(first | (second << InstDecoder::SECOND_NEAR_REG_SHIFT));
+}
+
+BytecodeInstruction MakeMov(size_t from, size_t to)
+{
+    return BytecodeInstruction(static_cast<uint8_t>(Opcode::MOV), EncodeNearRegs(from, to));
+}
+
+BytecodeInstruction MakeJump(ptrdiff_t offset)
+{
+    ASSERT(FitsOffset(offset));
+    return BytecodeInstruction(static_cast<uint8_t>(Opcode::JUMP), bit_cast<uint8_t>(static_cast<int8_t>(offset)));
+}
+
+}  // namespace
+
+BytecodeInliner::BytecodeInliner(std::vector<BytecodeInstruction> *instructions, const ConstantPool &constant_pool,
+                                 std::vector<size_t> entries)
+    : instructions_(instructions), constant_pool_(constant_pool), entries_(std::move(entries))
+{
+    std::sort(entries_.begin(), entries_.end());
+    new_pcs_.resize(instructions_->size() + 1);
+    std::iota(new_pcs_.begin(), new_pcs_.end(), 0);
+}
+
+size_t BytecodeInliner::GetTarget(size_t pc) const
+{
+    const auto &inst = (*instructions_)[pc];
+    auto target = static_cast<ptrdiff_t>(pc) + bit_cast<int8_t>(inst.GetOperands());
+    if (target < 0 || static_cast<size_t>(target) >= instructions_->size()) {
+        LOG_FATAL(ENCODER, "Branch target is out of code (pc " << pc << ")");
+    }
+    return target;
+}
+
+size_t BytecodeInliner::GetFunctionEnd(size_t entry) const
+{
+    auto next = std::upper_bound(entries_.begin(), entries_.end(), entry);
+    return (next != entries_.end()) ? *next : instructions_->size();
+}
+
+void BytecodeInliner::Run()
+{
+    size_t budget = instructions_->size();
+    // Liveness is recomputed after each call site, as the caller changes:
+    for (bool inlined = true; inlined && (growth_ < budget);) {
+        inlined = false;
+        ComputeLiveness();
+        for (size_t pc = 0; pc < instructions_->size(); pc++) {
+            CallSite site {};
+            MaskT callee_regs = 0;
+            if (FindCallSite(pc, &site) && CanInline(site, &callee_regs) && Inline(site, callee_regs)) {
+                inlined = true;
+                break;
+            }
+        }
+    }
+}
+
+void BytecodeInliner::ComputeLiveness()
+{
+    const auto &instructions = *instructions_;
+    size_t n_insts = instructions.size();
+    std::vector<InstDataflow> dataflow(n_insts);
+    is_target_.assign(n_insts, false);
+    for (auto entry : entries_) {
+        is_target_[entry] = true;
+    }
+    for (size_t pc = 0; pc < n_insts; pc++) {
+        dataflow[pc] = InstDataflow::Get(instructions[pc]);
+        if (IsJumpOrBranch(dataflow[pc].flow)) {
+            is_target_[GetTarget(pc)] = true;
+        }
+    }
+
+    live_in_.assign(n_insts + 1, 0);
+    live_out_.assign(n_insts, 0);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t pc = n_insts; pc-- > 0;) {
+            auto flow = dataflow[pc].flow;
+            MaskT out = 0;
+            if (flow == Flow::NEXT || flow == Flow::BRANCH) {
+                out |= live_in_[pc + 1];
+            }
+            if (IsJumpOrBranch(flow)) {
+                out |= live_in_[GetTarget(pc)];
+            }
+            MaskT in = (out & ~dataflow[pc].defs) | dataflow[pc].uses;
+            changed |= (in != live_in_[pc]);
+            live_in_[pc] = in;
+            live_out_[pc] = out;
+        }
+    }
+}
+
+bool BytecodeInliner::FindCallSite(size_t pc, CallSite *site) const
+{
+    const auto &instructions = *instructions_;
+    size_t n_insts = instructions.size();
+    if (instructions[pc].GetOpcode() != Opcode::LDAI) {
+        return false;
+    }
+    const auto &element = constant_pool_.GetElement(instructions[pc].GetOperands());
+    if (element.type_ != ConstantPool::Type::FUNC) {
+        return false;
+    }
+    site->begin = pc;
+    site->callee_entry = new_pcs_[element.val_];
+    site->callee_end = GetFunctionEnd(site->callee_entry);
+    site->args = {NO_REG, NO_REG};
+    site->ret_reg = NO_REG;
+
+    // The function object is only set up between `ldai` and `call`:
+    size_t call = pc + 1;
+    for (; call < n_insts; call++) {
+        auto opcode = instructions[call].GetOpcode();
+        if (opcode != Opcode::SETARG0 && opcode != Opcode::SETARG1) {
+            break;
+        }
+        site->args[(opcode == Opcode::SETARG0) ? 0 : 1] = instructions[call].GetOperands();
+    }
+    if (call == n_insts || instructions[call].GetOpcode() != Opcode::CALL) {
+        return false;
+    }
+    site->end = call;
+    if (call + 1 < n_insts && instructions[call + 1].GetOpcode() == Opcode::GETRET0) {
+        site->end = call + 1;
+        site->ret_reg = instructions[call + 1].GetOperands();
+    }
+    for (size_t i = site->begin + 1; i <= site->end; i++) {
+        if (is_target_[i] || InstDataflow::Get(instructions[i]).far_reg) {
+            return false;
+        }
+    }
+    return (live_out_[site->end] & ACC_MASK) == 0;
+}
+
+bool BytecodeInliner::CanInline(const CallSite &site, MaskT *callee_regs) const
+{
+    const auto &instructions = *instructions_;
+    if (site.callee_end - site.callee_entry > MAX_CALLEE_SIZE) {
+        return false;
+    }
+    // Registers of the callee would be read before they are written:
+    if (live_in_[site.callee_entry] != 0) {
+        return false;
+    }
+    *callee_regs = 0;
+    for (size_t pc = site.callee_entry; pc < site.callee_end; pc++) {
+        const auto &inst = instructions[pc];
+        auto dataflow = InstDataflow::Get(inst);
+        switch (inst.GetOpcode()) {
+        case Opcode::CALL:
+        case Opcode::TAILCALL:
+        case Opcode::SETARG0:
+        case Opcode::SETARG1:
+        case Opcode::GETRET0:
+        case Opcode::GETTHIS:
+            return false;
+        case Opcode::GETARG0:
+        case Opcode::GETARG1:
+            if (site.args[(inst.GetOpcode() == Opcode::GETARG0) ? 0 : 1] == NO_REG) {
+                return false;
+            }
+            break;
+        case Opcode::RET:
+            // Otherwise the result isn't set on some path:
+            if (site.ret_reg != NO_REG && (pc == site.callee_entry || is_target_[pc] ||
+                                           instructions[pc - 1].GetOpcode() != Opcode::SETRET0)) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+        // Only near registers are renamed:
+        if (dataflow.far_reg) {
+            return false;
+        }
+        if (IsJumpOrBranch(dataflow.flow)) {
+            size_t target = GetTarget(pc);
+            if (target < site.callee_entry || target >= site.callee_end) {
+                return false;
+            }
+        }
+        *callee_regs |= (dataflow.uses | dataflow.defs) & REGS_MASK;
+    }
+    return InstDataflow::Get(instructions[site.callee_end - 1]).flow != Flow::NEXT;
+}
+
+bool BytecodeInliner::Inline(const CallSite &site, MaskT callee_regs)
+{
+    auto &instructions = *instructions_;
+
+    // Registers of the callee are renamed to near registers which aren't used after the call sequence:
+    MaskT busy = live_out_[site.end];
+    for (auto arg : site.args) {
+        busy |= (arg != NO_REG) ? (MaskT(1) << arg) : 0;
+    }
+    busy |= (site.ret_reg != NO_REG) ? (MaskT(1) << site.ret_reg) : 0;
+    auto allocate = [&busy]() {
+        for (size_t reg = 0; reg < InstDataflow::N_REGS; reg++) {
+            if ((busy & (MaskT(1) << reg)) == 0) {
+                busy |= MaskT(1) << reg;
+                return static_cast<int>(reg);
+            }
+        }
+        return NO_REG;
+    };
+    std::array<int, InstDataflow::N_REGS> reg_map {};
+    for (size_t reg = 0; reg < InstDataflow::N_REGS; reg++) {
+        reg_map[reg] = ((callee_regs & (MaskT(1) << reg)) != 0) ? allocate() : NO_REG;
+        if ((callee_regs & (MaskT(1) << reg)) != 0 && reg_map[reg] == NO_REG) {
+            return false;
+        }
+    }
+    // The result can't be written to an argument register until all of the arguments are read:
+    bool is_ret_arg = (site.ret_reg != NO_REG) && (site.ret_reg == site.args[0] || site.ret_reg == site.args[1]);
+    int ret_reg = is_ret_arg ? allocate() : site.ret_reg;
+    if (ret_reg == NO_REG && site.ret_reg != NO_REG) {
+        return false;
+    }
+
+    // The body keeps the size of the callee, so its branches stay as they are. `jump +1` is removed by
+    // `BytecodeOptimizer` later:
+    size_t callee_size = site.callee_end - site.callee_entry;
+    std::vector<BytecodeInstruction> body;
+    for (size_t pc = site.callee_entry; pc < site.callee_end; pc++) {
+        auto inst = instructions[pc];
+        auto operands = inst.GetOperands();
+        switch (inst.GetOpcode()) {
+        case Opcode::GETARG0:
+        case Opcode::GETARG1:
+            inst = MakeMov(site.args[(inst.GetOpcode() == Opcode::GETARG0) ? 0 : 1], reg_map[operands]);
+            break;
+        case Opcode::SETRET0:
+            inst = (ret_reg != NO_REG) ? MakeMov(reg_map[operands], ret_reg) : MakeJump(1);
+            break;
+        case Opcode::RET:
+            inst = MakeJump(callee_size - (pc - site.callee_entry));
+            break;
+        default:
+            switch (InstDataflow::Get(inst).operands) {
+            case Operands::NEAR_REGS:
+                inst.SetOperands(EncodeNearRegs(reg_map[operands & InstDecoder::FIRST_NEAR_REG_MASK],
+                                                reg_map[(operands & InstDecoder::SECOND_NEAR_REG_MASK) >>
+                                                        InstDecoder::SECOND_NEAR_REG_SHIFT]));
+                break;
+            case Operands::NEAR_REG_IMM:
+                inst.SetOperands((operands & ~InstDecoder::FIRST_NEAR_REG_MASK) |
+                                 reg_map[operands & InstDecoder::FIRST_NEAR_REG_MASK]);
+                break;
+            case Operands::FAR_REG:
+                inst.SetOperands(reg_map[operands]);
+                break;
+            default:
+                break;
+            }
+        }
+        body.push_back(inst);
+    }
+    if (is_ret_arg) {
+        body.push_back(MakeMov(ret_reg, site.ret_reg));
+    }
+
+    // Branches around the call sequence are shifted by the difference of sizes:
+    auto delta = static_cast<ptrdiff_t>(body.size()) - static_cast<ptrdiff_t>(site.end + 1 - site.begin);
+    auto get_new_pc = [&site, delta](size_t pc) {
+        return (pc <= site.begin) ? pc : static_cast<size_t>(static_cast<ptrdiff_t>(pc) + delta);
+    };
+    std::vector<BytecodeInstruction> result;
+    result.reserve(instructions.size() + body.size());
+    for (size_t pc = 0; pc < instructions.size(); pc++) {
+        if (pc == site.begin) {
+            result.insert(result.end(), body.begin(), body.end());
+            pc = site.end;
+            continue;
+        }
+        auto inst = instructions[pc];
+        if (IsJumpOrBranch(InstDataflow::Get(inst).flow)) {
+            auto offset = static_cast<ptrdiff_t>(get_new_pc(GetTarget(pc))) - static_cast<ptrdiff_t>(get_new_pc(pc));
+            if (!FitsOffset(offset)) {
+                return false;
+            }
+            inst.SetOperands(bit_cast<uint8_t>(static_cast<int8_t>(offset)));
+        }
+        result.push_back(inst);
+    }
+
+    instructions = std::move(result);
+    for (auto &entry : entries_) {
+        entry = get_new_pc(entry);
+    }
+    for (auto &pc : new_pcs_) {
+        pc = get_new_pc(pc);
+    }
+    growth_ += std::max<ptrdiff_t>(delta, 0);
+    n_inlined_++;
+    return true;
+}
+
+}  // namespace k3s
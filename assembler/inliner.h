@@ -0,0 +1,81 @@
+#ifndef ASSEMBLER_INLINER_H
+#define ASSEMBLER_INLINER_H
+
+#include "interpreter/generated/inst_dataflow.h"
+#include "interpreter/bytecode_instruction.h"
+#include "classfile/class_file.h"
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace k3s {
+
+/**
+ * Inliner of small leaf functions, it runs at -O3 before `BytecodeOptimizer`. A call site
+ *     ldai F; setarg0 rA; setarg1 rB; call; getret0 rX
+ * of a function F without calls is replaced by the body of F: registers of F are renamed to near registers which
+ * are dead at the call site, `getargN` becomes a `mov` from the argument register, `setret0` a `mov` to rX and `ret`
+ * a jump past the body. The function object isn't allocated then, so the accumulator should be dead after the call.
+ * Methods are called through `getelem` of an object, so their callee isn't known and they aren't inlined.
+ */
+class BytecodeInliner {
+public:
+    // Functions longer than this are never inlined:
+    static constexpr size_t MAX_CALLEE_SIZE = 24U;
+
+    BytecodeInliner(std::vector<BytecodeInstruction> *instructions, const ConstantPool &constant_pool,
+                    std::vector<size_t> entries);
+
+    /// Inlines call sites until there are none left or the program grows twice.
+    void Run();
+
+    /// Returns the new pc of the instruction at \p pc, which isn't within an inlined call sequence.
+    size_t GetNewPc(size_t pc) const
+    {
+        return new_pcs_[pc];
+    }
+
+    size_t GetInlinedCount() const
+    {
+        return n_inlined_;
+    }
+
+private:
+    using MaskT = InstDataflow::MaskT;
+    static constexpr int NO_REG = -1;
+
+    // `ldai` of the callee at `begin`, the call sequence ends at `end` (`call` or `getret0`):
+    struct CallSite
+    {
+        size_t begin;
+        size_t end;
+        size_t callee_entry;
+        size_t callee_end;
+        std::array<int, 2> args;
+        int ret_reg;
+    };
+
+    void ComputeLiveness();
+    bool FindCallSite(size_t pc, CallSite *site) const;
+    bool CanInline(const CallSite &site, MaskT *callee_regs) const;
+    bool Inline(const CallSite &site, MaskT callee_regs);
+    size_t GetTarget(size_t pc) const;
+    size_t GetFunctionEnd(size_t entry) const;
+
+private:
+    std::vector<BytecodeInstruction> *instructions_;
+    const ConstantPool &constant_pool_;
+    // Sorted entries of functions and methods:
+    std::vector<size_t> entries_;
+    std::vector<size_t> new_pcs_;
+    std::vector<MaskT> live_in_;
+    std::vector<MaskT> live_out_;
+    std::vector<bool> is_target_;
+    size_t n_inlined_ {};
+    size_t growth_ {};
+};
+
+}  // namespace k3s
+
+#endif  // ASSEMBLER_INLINER_H
@@ -0,0 +1,271 @@
+#include "assembler/locals.h"
+#include "assembler/assembler.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <numeric>
+
+namespace k3s {
+
+namespace {
+
+using Flow = InstDataflow::Flow;
+using Operands = InstDataflow::Operands;
+using MaskT = InstDataflow::MaskT;
+
+// Weight of a use grows 8 times per nesting loop, deeper loops aren't distinguished:
+constexpr size_t MAX_WEIGHTED_DEPTH = 6U;
+constexpr size_t WEIGHT_SHIFT_PER_LOOP = 3U;
+
+}  // namespace
+
+LocalsAllocator::LocalsAllocator(const std::vector<BytecodeInstruction> &instructions, size_t begin, size_t end,
+                                 const std::vector<LocalOperand> &operands, size_t n_locals)
+    : instructions_(instructions), begin_(begin), end_(end), operands_(operands), n_locals_(n_locals)
+{
+}
+
+std::vector<size_t> LocalsAllocator::GetSuccessors(size_t pc) const
+{
+    auto flow = InstDataflow::Get(instructions_[pc]).flow;
+    std::vector<size_t> succs;
+    if ((flow == Flow::NEXT || flow == Flow::BRANCH) && (pc + 1 < end_)) {
+        succs.push_back(pc + 1);
+    }
+    if (flow == Flow::JUMP || flow == Flow::BRANCH) {
+        auto target = static_cast<ptrdiff_t>(pc) + bit_cast<int8_t>(instructions_[pc].GetOperands());
+        if (target >= static_cast<ptrdiff_t>(begin_) && target < static_cast<ptrdiff_t>(end_)) {
+            succs.push_back(target);
+        }
+    }
+    return succs;
+}
+
+void LocalsAllocator::ComputeDataflow()
+{
+    dataflow_.assign(end_ - begin_, {});
+    needs_near_.assign(n_locals_, false);
+    reserved_.assign(InstDataflow::MAX_REGS, false);
+
+    auto operand = operands_.begin();
+    for (size_t pc = begin_; pc < end_; pc++) {
+        const auto &inst = instructions_[pc];
+        auto dataflow = InstDataflow::Get(inst);
+        auto first = operand;
+        while (operand != operands_.end() && operand->pc == pc) {
+            operand++;
+        }
+        if (first == operand) {
+            // Registers named explicitly:
+            for (size_t reg = 0; reg < InstDataflow::N_REGS; reg++) {
+                reserved_[reg] = reserved_[reg] || (((dataflow.uses | dataflow.defs) & (MaskT(1) << reg)) != 0);
+            }
+            if (dataflow.far_reg) {
+                reserved_[inst.GetOperands()] = true;
+            }
+            continue;
+        }
+
+        // Operands are numbered in the probe, so bits of its masks tell which of them are read and written:
+        auto probe = inst;
+        bool is_local[2] {};
+        for (auto it = first; it != operand; it++) {
+            is_local[(it->position == LocalOperand::Position::SECOND_NEAR) ? 1 : 0] = true;
+        }
+        if (dataflow.operands == Operands::NEAR_REGS) {
+            uint8_t regs[2] = {static_cast<uint8_t>(inst.GetOperands() & InstDecoder::FIRST_NEAR_REG_MASK),
+                               static_cast<uint8_t>(inst.GetOperands() >> InstDecoder::SECOND_NEAR_REG_SHIFT)};
+            for (size_t i = 0; i < 2; i++) {
+                reserved_[regs[i]] = reserved_[regs[i]] || !is_local[i];
+            }
+            probe.SetOperands(1U << InstDecoder::SECOND_NEAR_REG_SHIFT);
+        } else {
+            probe.SetOperands(0);
+        }
+        auto probe_dataflow = InstDataflow::Get(probe);
+        auto &locals = dataflow_[pc - begin_];
+        for (auto it = first; it != operand; it++) {
+            auto bit = MaskT(1) << ((it->position == LocalOperand::Position::SECOND_NEAR) ? 1 : 0);
+            if ((probe_dataflow.uses & bit) != 0) {
+                locals.uses.push_back(it->local);
+            }
+            if ((probe_dataflow.defs & bit) != 0) {
+                locals.defs.push_back(it->local);
+            }
+            needs_near_[it->local] = needs_near_[it->local] || (it->position != LocalOperand::Position::FAR);
+        }
+    }
+}
+
+void LocalsAllocator::ComputeLiveness()
+{
+    size_t n_insts = end_ - begin_;
+    std::vector<std::vector<bool>> live_in(n_insts, std::vector<bool>(n_locals_, false));
+    live_out_.assign(n_insts, std::vector<bool>(n_locals_, false));
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t pc = end_; pc-- > begin_;) {
+            size_t idx = pc - begin_;
+            auto out = std::vector<bool>(n_locals_, false);
+            for (auto succ : GetSuccessors(pc)) {
+                const auto &succ_in = live_in[succ - begin_];
+                for (size_t local = 0; local < n_locals_; local++) {
+                    out[local] = out[local] || succ_in[local];
+                }
+            }
+            auto in = out;
+            for (auto local : dataflow_[idx].defs) {
+                in[local] = false;
+            }
+            for (auto local : dataflow_[idx].uses) {
+                in[local] = true;
+            }
+            changed |= (in != live_in[idx]);
+            live_in[idx] = std::move(in);
+            live_out_[idx] = std::move(out);
+        }
+    }
+
+    entry_live_ = (n_insts != 0) ? live_in[0] : std::vector<bool>(n_locals_, false);
+}
+
+void LocalsAllocator::ComputeInterference()
+{
+    // Locals which are read before they are written hold unknown values from the entry, so they interfere
+    // with each other:
+    interference_.assign(n_locals_, std::vector<bool>(n_locals_, false));
+    for (size_t a = 0; a < n_locals_; a++) {
+        for (size_t b = 0; b < n_locals_; b++) {
+            interference_[a][b] = (a != b) && entry_live_[a] && entry_live_[b];
+        }
+    }
+    for (size_t pc = begin_; pc < end_; pc++) {
+        const auto &locals = dataflow_[pc - begin_];
+        const auto &out = live_out_[pc - begin_];
+        // The source of a move may share the register with the destination:
+        bool is_move = instructions_[pc].GetOpcode() == Opcode::MOV;
+        for (auto def : locals.defs) {
+            for (size_t local = 0; local < n_locals_; local++) {
+                if (!out[local] || local == def) {
+                    continue;
+                }
+                if (is_move && std::find(locals.uses.begin(), locals.uses.end(), local) != locals.uses.end()) {
+                    continue;
+                }
+                interference_[def][local] = true;
+                interference_[local][def] = true;
+            }
+        }
+    }
+}
+
+void LocalsAllocator::ComputeWeights()
+{
+    std::vector<size_t> depth(end_ - begin_, 0);
+    for (size_t pc = begin_; pc < end_; pc++) {
+        for (auto succ : GetSuccessors(pc)) {
+            if (succ <= pc) {
+                for (size_t i = succ; i <= pc; i++) {
+                    depth[i - begin_]++;
+                }
+            }
+        }
+    }
+    weights_.assign(n_locals_, 0);
+    for (size_t pc = begin_; pc < end_; pc++) {
+        const auto &locals = dataflow_[pc - begin_];
+        uint64_t weight = uint64_t(1) << (std::min(depth[pc - begin_], MAX_WEIGHTED_DEPTH) * WEIGHT_SHIFT_PER_LOOP);
+        for (auto local : locals.uses) {
+            weights_[local] += weight;
+        }
+        for (auto local : locals.defs) {
+            weights_[local] += weight;
+        }
+    }
+}
+
+bool LocalsAllocator::Assign(size_t local, size_t first_reg, size_t end_reg)
+{
+    auto taken = reserved_;
+    for (size_t other = 0; other < n_locals_; other++) {
+        if (interference_[local][other] && regs_[other] != NO_REG) {
+            taken[regs_[other]] = true;
+        }
+    }
+    for (size_t reg = first_reg; reg < end_reg; reg++) {
+        if (!taken[reg]) {
+            regs_[local] = static_cast<int>(reg);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LocalsAllocator::Run()
+{
+    ComputeDataflow();
+    ComputeLiveness();
+    ComputeInterference();
+    ComputeWeights();
+
+    std::vector<size_t> order(n_locals_);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        if (needs_near_[a] != needs_near_[b]) {
+            return static_cast<bool>(needs_near_[a]);
+        }
+        return weights_[a] > weights_[b];
+    });
+    regs_.assign(n_locals_, NO_REG);
+    for (auto local : order) {
+        if (Assign(local, 0, InstDataflow::N_REGS)) {
+            continue;
+        }
+        if (needs_near_[local] || !Assign(local, InstDataflow::N_REGS, InstDataflow::MAX_REGS)) {
+            failed_local_ = local;
+            return false;
+        }
+    }
+    return true;
+}
+
+void AsmEncoder::AllocateLocals()
+{
+    if (ENCODER.local_names_.empty()) {
+        return;
+    }
+    auto &instructions = ENCODER.instructions_buffer_;
+    const auto &function = ENCODER.functions_.back();
+    LocalsAllocator allocator(instructions, function.entry_pc_, instructions.size(), ENCODER.local_operands_,
+                              ENCODER.local_names_.size());
+    if (!allocator.Run()) {
+        LOG_FATAL(ENCODER, "Too many locals are live at once in `" << function.name_ << "`, no register is left for `%"
+                  << ENCODER.local_names_[allocator.GetFailedLocal()] << "`");
+    }
+
+    for (const auto &operand : ENCODER.local_operands_) {
+        auto reg = static_cast<uint8_t>(allocator.GetRegister(operand.local));
+        auto &inst = instructions[operand.pc];
+        auto operands = inst.GetOperands();
+        switch (operand.position) {
+        case LocalOperand::Position::FIRST_NEAR:
+            inst.SetOperands((operands & ~InstDecoder::FIRST_NEAR_REG_MASK) | reg);
+            break;
+        case LocalOperand::Position::SECOND_NEAR:
+            inst.SetOperands((operands & InstDecoder::FIRST_NEAR_REG_MASK) | (reg << InstDecoder::SECOND_NEAR_REG_SHIFT));
+            break;
+        case LocalOperand::Position::FAR:
+            inst.SetOperands(reg);
+            break;
+        }
+    }
+    for (size_t local = 0; local < ENCODER.local_names_.size(); local++) {
+        LOG_DEBUG(ASSEMBLER, "`" << function.name_ << "`: %" << ENCODER.local_names_[local] << " -> r"
+                  << allocator.GetRegister(local));
+    }
+
+    ENCODER.locals_.clear();
+    ENCODER.local_names_.clear();
+    ENCODER.local_operands_.clear();
+}
+
+}  // namespace k3s
@@ -0,0 +1,88 @@
+#ifndef ASSEMBLER_LOCALS_H
+#define ASSEMBLER_LOCALS_H
+
+#include "interpreter/generated/inst_dataflow.h"
+#include "interpreter/bytecode_instruction.h"
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace k3s {
+
+/// Operand of an encoded instruction which names a local (`%name`) instead of a register.
+struct LocalOperand
+{
+    enum class Position : uint8_t {
+        FIRST_NEAR,
+        SECOND_NEAR,
+        FAR,
+    };
+
+    size_t pc;
+    Position position;
+    size_t local;
+};
+
+/**
+ * Register allocator for named locals of a function. Locals which are live at the same time interfere, the rest
+ * may share a register. Locals are assigned in order of their weight (uses, 8 times more per nesting loop):
+ * first those which are operands of `opc_r4_r4` instructions, as they need one of r0..r15, then the others, which
+ * get a far register (r16..r255, reachable by `opc_r8` instructions) once near ones are taken. Registers named
+ * explicitly in the function are never assigned.
+ */
+class LocalsAllocator {
+public:
+    static constexpr int NO_REG = -1;
+
+    LocalsAllocator(const std::vector<BytecodeInstruction> &instructions, size_t begin, size_t end,
+                    const std::vector<LocalOperand> &operands, size_t n_locals);
+
+    /// Returns false if some local doesn't get a register, `GetFailedLocal` is the local then.
+    bool Run();
+
+    int GetRegister(size_t local) const
+    {
+        return regs_[local];
+    }
+
+    size_t GetFailedLocal() const
+    {
+        return failed_local_;
+    }
+
+private:
+    // Locals read and written by each instruction:
+    struct LocalsDataflow
+    {
+        std::vector<size_t> uses;
+        std::vector<size_t> defs;
+    };
+
+    void ComputeDataflow();
+    void ComputeLiveness();
+    void ComputeInterference();
+    void ComputeWeights();
+    std::vector<size_t> GetSuccessors(size_t pc) const;
+    bool Assign(size_t local, size_t first_reg, size_t end_reg);
+
+private:
+    const std::vector<BytecodeInstruction> &instructions_;
+    size_t begin_;
+    size_t end_;
+    const std::vector<LocalOperand> &operands_;
+    size_t n_locals_;
+
+    std::vector<LocalsDataflow> dataflow_;
+    std::vector<std::vector<bool>> live_out_;
+    std::vector<bool> entry_live_;
+    std::vector<std::vector<bool>> interference_;
+    std::vector<uint64_t> weights_;
+    std::vector<bool> needs_near_;
+    std::vector<bool> reserved_;
+    std::vector<int> regs_;
+    size_t failed_local_ {};
+};
+
+}  // namespace k3s
+
+#endif  // ASSEMBLER_LOCALS_H
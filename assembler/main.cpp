@@ -1,38 +1,58 @@
 #include "assembler.h"
+#include "assembler/optimizer.h"
 #include "assembler/generated/grammar.l.hpp"
 #include "common/macro.h"
 #include "classfile/class_file.h"
 
 #include <cstddef>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
+// Usage: asm [-O<level>] <input> <output>, `-O` alone selects the highest level:
 int main(int argc, char *argv[])
 {
-    if (argc <= 2) {
+    int opt_level = 0;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "-O", 2) != 0) {
+            files.push_back(argv[i]);
+            continue;
+        }
+        char *end = nullptr;
+        opt_level = (argv[i][2] == '\0') ? k3s::BytecodeOptimizer::MAX_LEVEL : std::strtol(argv[i] + 2, &end, 10);
+        if ((end != nullptr && *end != '\0') || opt_level < 0 || opt_level > k3s::BytecodeOptimizer::MAX_LEVEL) {
+            LOG_FATAL(ASSEMBLER, "Invalid optimization level: '" << argv[i] << "'");
+        }
+    }
+    if (files.size() < 2) {
         LOG_FATAL(ASSEMBLER, "Please, provide file");
     }
-    auto file = std::fopen(argv[1], "r");
+    auto file = std::fopen(files[0], "r");
     if (file == nullptr) {
-        LOG_FATAL(ASSEMBLER, "Error reading file: '" << argv[1] << "'");
+        LOG_FATAL(ASSEMBLER, "Error reading file: '" << files[0] << "'");
     }
 
     if (k3s::AsmEncoder::Process(file) != 0) {
-        LOG_FATAL(ASSEMBLER, "Parsing '" << argv[1] << "' failed");
+        LOG_FATAL(ASSEMBLER, "Parsing '" << files[0] << "' failed");
     }
 
-    if (argc >= 3) {
-        auto out_file = std::fopen(argv[2], "wb");
-        if (out_file == nullptr) {
-            LOG_FATAL(ASSEMBLER, "Can't open file: " << argv[2] << "'");
-        }
-        k3s::AsmEncoder::DumpToFile(out_file);
-        std::fclose(out_file);
+    auto out_file = std::fopen(files[1], "wb");
+    if (out_file == nullptr) {
+        LOG_FATAL(ASSEMBLER, "Can't open file: " << files[1] << "'");
+    }
+    if (opt_level != 0) {
+        k3s::AsmEncoder::Optimize(opt_level);
     }
+    k3s::AsmEncoder::DumpToFile(out_file);
+    std::fclose(out_file);
 
     return 0;
 }
 
 void k3s::AsmEncoder::DumpToFile(FILE *file) {
+    BuildStackMaps();
     ClassFile cf;
     return cf.DumpClassFile(file);
 }
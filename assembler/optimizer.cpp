@@ -0,0 +1,536 @@
+#include "assembler/optimizer.h"
+#include "assembler/assembler.h"
+#include "assembler/inliner.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <deque>
+#include <limits>
+
+namespace k3s {
+
+namespace {
+
+using Flow = InstDataflow::Flow;
+using MaskT = InstDataflow::MaskT;
+
+// Chains of jumps are followed up to this length, so cycles of jumps are threaded once:
+constexpr size_t MAX_THREADING_DEPTH = 8U;
+// Constants are ids of the constant pool, so defined values are numbered after them:
+constexpr uint32_t FIRST_DEFINED_VALUE = ConstantPool::CONSTANT_POOL_SIZE;
+
+bool IsJumpOrBranch(Flow flow)
+{
+    return (flow == Flow::JUMP) || (flow == Flow::BRANCH);
+}
+
+bool FitsOffset(size_t target, size_t pc)
+{
+    auto offset = static_cast<ptrdiff_t>(target) - static_cast<ptrdiff_t>(pc);
+    return (offset >= std::numeric_limits<int8_t>::min()) && (offset <= std::numeric_limits<int8_t>::max());
+}
+
+void SetTarget(BytecodeInstruction *inst, size_t target, size_t pc)
+{
+    ASSERT(FitsOffset(target, pc));
+    auto offset = static_cast<int8_t>(static_cast<ptrdiff_t>(target) - static_cast<ptrdiff_t>(pc));
+    inst->SetOperands(bit_cast<uint8_t>(offset));
+}
+
+}  // namespace
+
+BytecodeOptimizer::BytecodeOptimizer(std::vector<BytecodeInstruction> *instructions, const ConstantPool &constant_pool,
+                                     std::vector<size_t> entries)
+    : instructions_(instructions),
+      constant_pool_(constant_pool),
+      entries_(std::move(entries)),
+      removed_(instructions->size(), false)
+{
+}
+
+void BytecodeOptimizer::Run(int level)
+{
+    if (level >= 1) {
+        ThreadJumps();
+        FoldTailCalls();
+        RemoveUnreachable();
+    }
+    if (level >= 2) {
+        FoldIncrements();
+        ForwardValues();
+        RemoveDeadStores();
+    }
+    Compact();
+}
+
+size_t BytecodeOptimizer::GetTarget(size_t pc) const
+{
+    const auto &inst = (*instructions_)[pc];
+    auto target = static_cast<ptrdiff_t>(pc) + bit_cast<int8_t>(inst.GetOperands());
+    if (target < 0 || static_cast<size_t>(target) >= instructions_->size()) {
+        LOG_FATAL(ENCODER, "Branch target is out of code (pc " << pc << ")");
+    }
+    return target;
+}
+
+std::vector<size_t> BytecodeOptimizer::GetSuccessorPcs(size_t pc) const
+{
+    size_t n_insts = instructions_->size();
+    auto flow = removed_[pc] ? Flow::NEXT : InstDataflow::Get((*instructions_)[pc]).flow;
+    std::vector<size_t> succs;
+    if ((flow == Flow::NEXT || flow == Flow::BRANCH) && (pc + 1 < n_insts)) {
+        succs.push_back(pc + 1);
+    }
+    if (IsJumpOrBranch(flow)) {
+        succs.push_back(GetTarget(pc));
+    }
+    return succs;
+}
+
+void BytecodeOptimizer::ThreadJumps()
+{
+    auto &instructions = *instructions_;
+    for (size_t pc = 0; pc < instructions.size(); pc++) {
+        auto flow = InstDataflow::Get(instructions[pc]).flow;
+        if (!IsJumpOrBranch(flow)) {
+            continue;
+        }
+        size_t target = GetTarget(pc);
+        for (size_t depth = 0; depth < MAX_THREADING_DEPTH; depth++) {
+            if (instructions[target].GetOpcode() != Opcode::JUMP) {
+                break;
+            }
+            size_t next = GetTarget(target);
+            if ((next == target) || !FitsOffset(next, pc)) {
+                break;
+            }
+            target = next;
+        }
+        SetTarget(&instructions[pc], target, pc);
+        // `ret` is as short as `jump`, so the jump is replaced by the return itself:
+        if ((flow == Flow::JUMP) && (instructions[target].GetOpcode() == Opcode::RET)) {
+            instructions[pc] = instructions[target];
+        }
+    }
+}
+
+void BytecodeOptimizer::FoldTailCalls()
+{
+    auto &instructions = *instructions_;
+    auto is_at = [&instructions](size_t pc, Opcode opcode) {
+        return (pc < instructions.size()) && (instructions[pc].GetOpcode() == opcode);
+    };
+    for (size_t pc = 0; pc < instructions.size(); pc++) {
+        if (!is_at(pc, Opcode::CALL) || !is_at(pc + 1, Opcode::GETRET0) || !is_at(pc + 2, Opcode::SETRET0) ||
+            !is_at(pc + 3, Opcode::RET) || (instructions[pc + 1].GetOperands() != instructions[pc + 2].GetOperands())) {
+            continue;
+        }
+        // The rest of the sequence stays if other paths reach it, otherwise it is removed as unreachable:
+        instructions[pc] = BytecodeInstruction(static_cast<uint8_t>(Opcode::TAILCALL), 0);
+    }
+}
+
+void BytecodeOptimizer::RemoveUnreachable()
+{
+    std::vector<bool> reachable(instructions_->size(), false);
+    std::vector<size_t> worklist;
+    for (auto entry : entries_) {
+        reachable[entry] = true;
+        worklist.push_back(entry);
+    }
+    while (!worklist.empty()) {
+        size_t pc = worklist.back();
+        worklist.pop_back();
+        for (auto succ : GetSuccessorPcs(pc)) {
+            if (!reachable[succ]) {
+                reachable[succ] = true;
+                worklist.push_back(succ);
+            }
+        }
+    }
+    for (size_t pc = 0; pc < reachable.size(); pc++) {
+        removed_[pc] = removed_[pc] || !reachable[pc];
+    }
+}
+
+void BytecodeOptimizer::BuildBlocks()
+{
+    size_t n_insts = instructions_->size();
+    std::vector<bool> is_leader(n_insts, false);
+    for (auto entry : entries_) {
+        is_leader[entry] = true;
+    }
+    for (size_t pc = 0; pc < n_insts; pc++) {
+        if (removed_[pc]) {
+            continue;
+        }
+        auto flow = InstDataflow::Get((*instructions_)[pc]).flow;
+        if (IsJumpOrBranch(flow)) {
+            is_leader[GetTarget(pc)] = true;
+        }
+        if ((flow != Flow::NEXT) && (pc + 1 < n_insts)) {
+            is_leader[pc + 1] = true;
+        }
+    }
+
+    blocks_.clear();
+    block_of_pc_.assign(n_insts, n_insts);
+    for (size_t pc = 0; pc < n_insts; pc++) {
+        if (pc == 0 || is_leader[pc]) {
+            block_of_pc_[pc] = blocks_.size();
+            blocks_.push_back({pc, pc + 1, {}});
+        } else {
+            blocks_.back().end = pc + 1;
+        }
+    }
+    // Removed instructions fall through, so successors are given by the last one:
+    for (auto &block : blocks_) {
+        for (auto succ : GetSuccessorPcs(block.end - 1)) {
+            block.succs.push_back(block_of_pc_[succ]);
+        }
+    }
+}
+
+bool BytecodeOptimizer::IsReusableConstant(uint8_t constant_pool_id) const
+{
+    // Objects and functions are copied on each `ldai`, so only immutable constants may be shared:
+    auto type = constant_pool_.GetElement(constant_pool_id).type_;
+    return (type == ConstantPool::Type::NUM) || (type == ConstantPool::Type::STR);
+}
+
+bool BytecodeOptimizer::GetSmallConstant(uint8_t constant_pool_id, int8_t *imm) const
+{
+    const auto &element = constant_pool_.GetElement(constant_pool_id);
+    if (element.type_ != ConstantPool::Type::NUM) {
+        return false;
+    }
+    auto num = bit_cast<double>(element.val_);
+    if ((num < InstDecoder::MIN_SMALL_IMM) || (num > InstDecoder::MAX_SMALL_IMM) || (num != static_cast<int8_t>(num))) {
+        return false;
+    }
+    *imm = static_cast<int8_t>(num);
+    return true;
+}
+
+void BytecodeOptimizer::DefineValue(ValueState *state, size_t location, ValueId value)
+{
+    // The previous value of the same definition isn't held anywhere after it is executed again:
+    std::replace(state->begin(), state->end(), value, UNKNOWN_VALUE);
+    (*state)[location] = value;
+}
+
+bool BytecodeOptimizer::TransferValues(size_t pc, ValueState *state, BytecodeInstruction *replacement) const
+{
+    const auto &inst = (*instructions_)[pc];
+    auto defined_value = [pc](size_t location) {
+        return static_cast<ValueId>(FIRST_DEFINED_VALUE + pc * N_LOCATIONS + location);
+    };
+    auto copy = [state, &defined_value](size_t from, size_t to) {
+        if ((*state)[from] == UNKNOWN_VALUE) {
+            DefineValue(state, from, defined_value(from));
+        } else if ((*state)[from] == (*state)[to]) {
+            return false;
+        }
+        (*state)[to] = (*state)[from];
+        return true;
+    };
+
+    auto dataflow = InstDataflow::Get(inst);
+    switch (inst.GetOpcode()) {
+    // Far registers aren't tracked, so their values are unknown:
+    case Opcode::LDA:
+        if (dataflow.far_reg) {
+            break;
+        }
+        return copy(inst.GetOperands() & InstDecoder::FIRST_FAR_REG_MASK, ACC);
+    case Opcode::STA:
+        if (dataflow.far_reg) {
+            break;
+        }
+        return copy(ACC, inst.GetOperands() & InstDecoder::FIRST_FAR_REG_MASK);
+    case Opcode::MOV:
+        return copy(inst.GetOperands() & InstDecoder::FIRST_NEAR_REG_MASK,
+                    (inst.GetOperands() & InstDecoder::SECOND_NEAR_REG_MASK) >> InstDecoder::SECOND_NEAR_REG_SHIFT);
+    case Opcode::LDAI: {
+        uint8_t constant_pool_id = inst.GetOperands();
+        if (!IsReusableConstant(constant_pool_id)) {
+            break;
+        }
+        if ((*state)[ACC] == constant_pool_id) {
+            return false;
+        }
+        for (size_t reg = 0; reg < InstDataflow::N_REGS; reg++) {
+            if ((*state)[reg] == constant_pool_id) {
+                *replacement = BytecodeInstruction(static_cast<uint8_t>(Opcode::LDA), reg);
+                break;
+            }
+        }
+        (*state)[ACC] = constant_pool_id;
+        return true;
+    }
+    default:
+        break;
+    }
+
+    auto defs = dataflow.defs;
+    for (size_t location = 0; location < N_LOCATIONS; location++) {
+        if ((defs & (MaskT(1) << location)) != 0) {
+            DefineValue(state, location, defined_value(location));
+        }
+    }
+    return true;
+}
+
+void BytecodeOptimizer::ForwardValues()
+{
+    BuildBlocks();
+    ValueState unknown_state;
+    unknown_state.fill(UNKNOWN_VALUE);
+    BytecodeInstruction unused_replacement(0, 0);
+
+    // Values known at the start of each block, a value is kept only if it is the same on all incoming paths.
+    // Entries may be called with any values:
+    std::vector<ValueState> in_states(blocks_.size(), unknown_state);
+    std::vector<bool> visited(blocks_.size(), false);
+    std::vector<bool> queued(blocks_.size(), false);
+    std::deque<size_t> worklist;
+    for (auto entry : entries_) {
+        size_t block = block_of_pc_[entry];
+        if (!visited[block]) {
+            visited[block] = true;
+            queued[block] = true;
+            worklist.push_back(block);
+        }
+    }
+    while (!worklist.empty()) {
+        size_t block = worklist.front();
+        worklist.pop_front();
+        queued[block] = false;
+        ValueState state = in_states[block];
+        for (size_t pc = blocks_[block].begin; pc < blocks_[block].end; pc++) {
+            if (!removed_[pc]) {
+                TransferValues(pc, &state, &unused_replacement);
+            }
+        }
+        for (auto succ : blocks_[block].succs) {
+            bool changed = !visited[succ];
+            if (!visited[succ]) {
+                visited[succ] = true;
+                in_states[succ] = state;
+            }
+            for (size_t location = 0; location < N_LOCATIONS; location++) {
+                if ((in_states[succ][location] != UNKNOWN_VALUE) && (in_states[succ][location] != state[location])) {
+                    in_states[succ][location] = UNKNOWN_VALUE;
+                    changed = true;
+                }
+            }
+            if (changed && !queued[succ]) {
+                queued[succ] = true;
+                worklist.push_back(succ);
+            }
+        }
+    }
+
+    for (size_t block = 0; block < blocks_.size(); block++) {
+        if (!visited[block]) {
+            continue;
+        }
+        ValueState state = in_states[block];
+        for (size_t pc = blocks_[block].begin; pc < blocks_[block].end; pc++) {
+            if (removed_[pc]) {
+                continue;
+            }
+            auto replacement = (*instructions_)[pc];
+            if (TransferValues(pc, &state, &replacement)) {
+                (*instructions_)[pc] = replacement;
+            } else {
+                removed_[pc] = true;
+            }
+        }
+    }
+}
+
+std::vector<MaskT> BytecodeOptimizer::ComputeLiveOut() const
+{
+    const auto &instructions = *instructions_;
+    size_t n_insts = instructions.size();
+    std::vector<MaskT> live_in(n_insts + 1, 0);
+    std::vector<MaskT> live_out(n_insts, 0);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t pc = n_insts; pc-- > 0;) {
+            MaskT out = 0;
+            for (auto succ : GetSuccessorPcs(pc)) {
+                out |= live_in[succ];
+            }
+            MaskT in = out;
+            if (!removed_[pc]) {
+                auto dataflow = InstDataflow::Get(instructions[pc]);
+                in = (out & ~dataflow.defs) | dataflow.uses;
+            }
+            changed |= (in != live_in[pc]);
+            live_in[pc] = in;
+            live_out[pc] = out;
+        }
+    }
+    return live_out;
+}
+
+void BytecodeOptimizer::FoldIncrements()
+{
+    auto &instructions = *instructions_;
+    size_t n_insts = instructions.size();
+    BuildBlocks();
+    auto live_out = ComputeLiveOut();
+    // Nothing jumps into the middle of the sequence, so it is executed as a whole:
+    auto is_sequence = [this, n_insts](size_t pc) {
+        return !removed_[pc] && !removed_[pc + 1] && !removed_[pc + 2] && (block_of_pc_[pc + 1] == n_insts) &&
+               (block_of_pc_[pc + 2] == n_insts);
+    };
+    for (size_t pc = 0; pc + 2 < n_insts; pc++) {
+        const auto &load = instructions[pc];
+        const auto &add = instructions[pc + 1];
+        const auto &store = instructions[pc + 2];
+        if ((load.GetOpcode() != Opcode::LDAI) || (add.GetOpcode() != Opcode::ADD2) ||
+            (store.GetOpcode() != Opcode::STA) || (add.GetOperands() != store.GetOperands()) || !is_sequence(pc)) {
+            continue;
+        }
+        // `addi` leaves the accumulator as it was:
+        int8_t imm = 0;
+        if (((live_out[pc + 2] & (MaskT(1) << ACC)) != 0) || !GetSmallConstant(load.GetOperands(), &imm)) {
+            continue;
+        }
+        uint8_t reg = add.GetOperands();
+        if (imm == 1 || imm == -1) {
+            instructions[pc] = BytecodeInstruction(static_cast<uint8_t>((imm == 1) ? Opcode::INC : Opcode::DEC), reg);
+        } else if (reg < InstDataflow::N_REGS) {
+            auto operands = static_cast<uint8_t>((bit_cast<uint8_t>(imm) << InstDecoder::SECOND_NEAR_REG_SHIFT) | reg);
+            instructions[pc] = BytecodeInstruction(static_cast<uint8_t>(Opcode::ADDI), operands);
+        } else {
+            continue;
+        }
+        removed_[pc + 1] = true;
+        removed_[pc + 2] = true;
+        pc += 2;
+    }
+}
+
+void BytecodeOptimizer::RemoveDeadStores()
+{
+    auto &instructions = *instructions_;
+    size_t n_insts = instructions.size();
+    auto is_removable = [this, &instructions](size_t pc) {
+        if (InstDataflow::Get(instructions[pc]).far_reg) {
+            return false;
+        }
+        switch (instructions[pc].GetOpcode()) {
+        case Opcode::LDA:
+        case Opcode::STA:
+        case Opcode::MOV:
+        case Opcode::STNULL:
+            return true;
+        case Opcode::LDAI:
+            return IsReusableConstant(instructions[pc].GetOperands());
+        default:
+            return false;
+        }
+    };
+
+    // Removal of a store may make its inputs dead, so liveness is recomputed until nothing is removed:
+    for (bool removed_any = true; removed_any;) {
+        removed_any = false;
+        auto live_out = ComputeLiveOut();
+        for (size_t pc = 0; pc < n_insts; pc++) {
+            if (removed_[pc] || !is_removable(pc)) {
+                continue;
+            }
+            if ((InstDataflow::Get(instructions[pc]).defs & live_out[pc]) == 0) {
+                removed_[pc] = true;
+                removed_any = true;
+            }
+        }
+    }
+}
+
+void BytecodeOptimizer::Compact()
+{
+    auto &instructions = *instructions_;
+    size_t n_insts = instructions.size();
+    auto compute_new_pcs = [this, n_insts]() {
+        new_pcs_.resize(n_insts + 1);
+        size_t new_pc = 0;
+        for (size_t pc = 0; pc < n_insts; pc++) {
+            new_pcs_[pc] = new_pc;
+            new_pc += removed_[pc] ? 0 : 1;
+        }
+        new_pcs_[n_insts] = new_pc;
+    };
+
+    // Jumps to the next kept instruction are removed, which may turn other jumps into such ones:
+    for (bool changed = true; changed;) {
+        changed = false;
+        compute_new_pcs();
+        for (size_t pc = 0; pc < n_insts; pc++) {
+            if (!removed_[pc] && (instructions[pc].GetOpcode() == Opcode::JUMP) &&
+                (new_pcs_[GetTarget(pc)] == new_pcs_[pc] + 1)) {
+                removed_[pc] = true;
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<BytecodeInstruction> compacted;
+    compacted.reserve(new_pcs_[n_insts]);
+    for (size_t pc = 0; pc < n_insts; pc++) {
+        if (removed_[pc]) {
+            continue;
+        }
+        auto inst = instructions[pc];
+        if (IsJumpOrBranch(InstDataflow::Get(inst).flow)) {
+            SetTarget(&inst, new_pcs_[GetTarget(pc)], new_pcs_[pc]);
+        }
+        compacted.push_back(inst);
+    }
+    instructions = std::move(compacted);
+}
+
+void AsmEncoder::Optimize(int level)
+{
+    auto get_entries = []() {
+        std::vector<size_t> entries;
+        for (const auto &function : ENCODER.functions_) {
+            entries.push_back(function.entry_pc_);
+        }
+        return entries;
+    };
+    auto remap_entries = [](const auto &pass) {
+        for (auto &function : ENCODER.functions_) {
+            function.entry_pc_ = pass.GetNewPc(function.entry_pc_);
+        }
+        for (auto &object : ENCODER.objects_storage_) {
+            for (auto &offset : object.methods_bc_offsets_) {
+                offset = pass.GetNewPc(offset);
+            }
+        }
+        for (size_t id = 0; id < ConstantPool::CONSTANT_POOL_SIZE; id++) {
+            const auto &element = ENCODER.constant_pool_.GetElement(id);
+            if (element.type_ == ConstantPool::Type::FUNC) {
+                ENCODER.constant_pool_.SetFunction(id, pass.GetNewPc(element.val_));
+            }
+        }
+    };
+    [[maybe_unused]] size_t n_insts = ENCODER.instructions_buffer_.size();
+
+    if (level >= 3) {
+        BytecodeInliner inliner(&ENCODER.instructions_buffer_, ENCODER.constant_pool_, get_entries());
+        inliner.Run();
+        remap_entries(inliner);
+        LOG_DEBUG(ASSEMBLER, "Inlined " << inliner.GetInlinedCount() << " call sites");
+    }
+    BytecodeOptimizer optimizer(&ENCODER.instructions_buffer_, ENCODER.constant_pool_, get_entries());
+    optimizer.Run(level);
+    remap_entries(optimizer);
+    LOG_DEBUG(ASSEMBLER, "Optimization -O" << level << ": " << n_insts << " -> "
+                         << ENCODER.instructions_buffer_.size() << " instructions");
+}
+
+}  // namespace k3s
@@ -0,0 +1,93 @@
+#ifndef ASSEMBLER_OPTIMIZER_H
+#define ASSEMBLER_OPTIMIZER_H
+
+#include "interpreter/generated/inst_dataflow.h"
+#include "interpreter/bytecode_instruction.h"
+#include "classfile/class_file.h"
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace k3s {
+
+/**
+ * Optimization pipeline of the assembler, it rewrites the encoded program before stack maps are built:
+ *   -O1: jump threading, `call; getret0 rX; setret0 rX; ret` to `tailcall`, removal of unreachable code
+ *        and of jumps to the next instruction;
+ *   -O2: also removal of redundant `lda`/`sta`/`mov`, reuse of constants kept in registers,
+ *        removal of stores to dead registers and folding of `ldai C; add2 rX; sta rX` into `inc`/`dec`/`addi`;
+ *   -O3: also inlining of small functions by `BytecodeInliner` before the other passes.
+ * Instructions are only removed or replaced by instructions of the same size, so branch offsets never grow
+ * after threading. Functions are connected by `call` only, so the program is a single control flow graph
+ * with an entry per function and method.
+ */
+class BytecodeOptimizer {
+public:
+    static constexpr int MAX_LEVEL = 3;
+
+    BytecodeOptimizer(std::vector<BytecodeInstruction> *instructions, const ConstantPool &constant_pool,
+                      std::vector<size_t> entries);
+
+    void Run(int level);
+
+    /// Returns the new pc of the instruction at \p pc, or of the next kept one if the instruction was removed.
+    size_t GetNewPc(size_t pc) const
+    {
+        return new_pcs_[pc];
+    }
+
+private:
+    // Value ids of the accumulator and registers: constants are ids of the constant pool, values defined
+    // by instructions are numbered after them (see `DefineValue`):
+    using ValueId = uint32_t;
+    static constexpr ValueId UNKNOWN_VALUE = ~ValueId(0);
+    static constexpr size_t N_LOCATIONS = InstDataflow::N_REGS + 1;
+    static constexpr size_t ACC = InstDataflow::ACC_BIT;
+    using ValueState = std::array<ValueId, N_LOCATIONS>;
+
+    struct Block
+    {
+        size_t begin;
+        size_t end;
+        std::vector<size_t> succs;
+    };
+
+    void ThreadJumps();
+    // Replaces `call` by `tailcall` if the function returns the result of the call right away:
+    void FoldTailCalls();
+    void RemoveUnreachable();
+    // Replaces `ldai C; add2 rX; sta rX` by `inc rX`, `dec rX` or `addi rX C` if the accumulator is dead after it:
+    void FoldIncrements();
+    void ForwardValues();
+    void RemoveDeadStores();
+    void Compact();
+
+    void BuildBlocks();
+    // Returns targets of the control flow from \p pc (removed instructions are skipped):
+    std::vector<size_t> GetSuccessorPcs(size_t pc) const;
+    size_t GetTarget(size_t pc) const;
+    bool IsReusableConstant(uint8_t constant_pool_id) const;
+    // Returns false unless the constant is an integer which fits an `addi` immediate:
+    bool GetSmallConstant(uint8_t constant_pool_id, int8_t *imm) const;
+    // Registers live after each instruction:
+    std::vector<InstDataflow::MaskT> ComputeLiveOut() const;
+    // Applies an instruction to \p state, returns false if it doesn't change the state and may be removed.
+    // Sets \p replacement to a cheaper instruction with the same effect if there is one:
+    bool TransferValues(size_t pc, ValueState *state, BytecodeInstruction *replacement) const;
+    static void DefineValue(ValueState *state, size_t location, ValueId value);
+
+private:
+    std::vector<BytecodeInstruction> *instructions_;
+    const ConstantPool &constant_pool_;
+    std::vector<size_t> entries_;
+    std::vector<bool> removed_;
+    std::vector<size_t> new_pcs_;
+    std::vector<Block> blocks_;
+    // Index of the block which starts at pc, or the number of instructions if there is none:
+    std::vector<size_t> block_of_pc_;
+};
+
+}  // namespace k3s
+
+#endif  // ASSEMBLER_OPTIMIZER_H
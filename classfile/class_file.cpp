@@ -1,268 +1,523 @@
 #include "classfile/class_file.h"
+#include "classfile/module.h"
 #include "assembler/assembler.h"
 
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 
+#include <cstring>
 #include <vector>
 #include <fstream>
 
 namespace k3s {
 
-void ClassFile::AllocateBuffer() 
+uint64_t ClassFile::ComputeChecksum(const char *data, size_t size)
 {
-    size_t file_size = sizeof(ClassFileHeader);
-    file_size +=
-        ENCODER.GetInstructionsBuffer().size() * sizeof(BytecodeInstruction);
-    for (auto pool_element : ENCODER.GetConstantPool().Elements()) {
-        file_size += EstimateEncodingSize(pool_element);
-    }
-    file_buffer_.resize(file_size);
-    buf_pos_ = 0;
+    constexpr uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325ULL;
+    constexpr uint64_t FNV_PRIME = 0x100000001B3ULL;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    size_t pos = 0;
+    for (; pos + sizeof(uint64_t) <= size; pos += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + pos, sizeof(word));
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+    for (; pos < size; pos++) {
+        hash = (hash ^ static_cast<uint8_t>(data[pos])) * FNV_PRIME;
+    }
+    return hash;
 }
 
-void ClassFile::WriteHeader() 
+uint32_t ClassFile::AddString(const std::string &str)
 {
-    ClassFileHeader header;
-    size_t header_size = sizeof(header);
-    header.code_offset = header_size;
-    auto main_id = ENCODER.TryResolveName(ENTRY_FUNC_NAME);
-    header.entry_point =
-        ENCODER.GetConstantPool().GetFunctionBytecodeOffset(main_id);
-    header.table_offset =
-        header.code_offset +
-        ENCODER.GetInstructionsBuffer().size() * sizeof(BytecodeInstruction);
-    write_buf(reinterpret_cast<char *>(&header), header_size);
-    ASSERT(buf_pos_ == header_size && "Trash header write");
+    auto it = string_ids_.find(str);
+    if (it != string_ids_.end()) {
+        return it->second;
+    }
+    auto offset = static_cast<uint32_t>(string_table_.size());
+    string_table_.insert(string_table_.end(), str.c_str(), str.c_str() + str.size() + 1);
+    string_ids_.emplace(str, offset);
+    return offset;
 }
 
-void ClassFile::WriteCodeSection() 
+void ClassFile::WriteSection(SectionKind kind, const char *data, size_t size)
 {
-    size_t code_size = ENCODER.GetInstructionsBuffer().size() * sizeof(ENCODER.GetInstructionsBuffer()[0]);
-    char * code_ptr = reinterpret_cast<char *>(ENCODER.GetInstructionsBuffer().data());
-    write_buf(code_ptr, code_size);
+    file_buffer_.resize(AlignUp(file_buffer_.size(), SECTION_ALIGNMENT));
+    sections_.push_back({kind, 0, file_buffer_.size(), size});
+    file_buffer_.insert(file_buffer_.end(), data, data + size);
 }
 
-void ClassFile::WriteConstantPool() 
+Vector<char> ClassFile::BuildCodeSection()
 {
-    size_t pool_size = ENCODER.GetConstantPool().Elements().size();
-    for (int8_t pool_id = 0; pool_id < pool_size; ++pool_id) {
-        WriteObj(ENCODER.GetConstantPool().GetElement(pool_id), pool_id);
-    }
+    const auto &instructions = ENCODER.GetInstructionsBuffer();
+    auto *code_ptr = reinterpret_cast<const char *>(instructions.data());
+    return Vector<char>(code_ptr, code_ptr + instructions.size() * sizeof(BytecodeInstruction));
 }
 
-void ClassFile::DumpClassFile(FILE *fileptr)
+Vector<char> ClassFile::BuildFunctionsSection()
 {
-    ASSERT(fileptr);
-    AllocateBuffer();
-    WriteHeader();
-    ASSERT(buf_pos_ < file_buffer_.size() && "Invalid header write");
-    WriteCodeSection();
-    ASSERT(buf_pos_ < file_buffer_.size() && "Invalid code write");
-    WriteConstantPool();
-    ASSERT(buf_pos_ <= file_buffer_.size() && "Invalid table write");
-    std::fwrite(file_buffer_.data(), sizeof(file_buffer_[0]), file_buffer_.size(), fileptr);
-}
-
-size_t ClassFile::EstimateEncodingSize(const ConstantPool::Element &element) 
-{
-    size_t size = sizeof(MetaRecord);
-    switch (element.type_) {
-        case Register::Type::FUNC:
-            size += sizeof(FuncRecord);
-            break;
-        case Register::Type::NUM:
-            size += sizeof(NumRecord);
-            break;
-        case Register::Type::STR:
-            size += sizeof(StrRecord);
-            size += ENCODER.GetStringsStorage()[element.val_].size() + 1;
-            break;
-        case Register::Type::OBJ:
-            size += sizeof(ObjRecord);
-            for (const auto &str : ENCODER.GetObjectsStorage()[element.val_].data_fields_) {
-                size += str.size() + 1;
+    const auto &instructions = ENCODER.GetInstructionsBuffer();
+    const auto &functions = ENCODER.GetFunctions();
+    Vector<FunctionRecord> records;
+    for (size_t i = 0; i < functions.size(); i++) {
+        size_t entry_pc = functions[i].entry_pc_;
+        size_t end_pc = (i + 1 < functions.size()) ? functions[i + 1].entry_pc_ : instructions.size();
+        InstDataflow::MaskT regs = 0;
+        size_t n_far_regs = 0;
+        size_t n_args = 0;
+        for (size_t pc = entry_pc; pc < end_pc; pc++) {
+            auto dataflow = InstDataflow::Get(instructions[pc]);
+            regs |= dataflow.uses | dataflow.defs;
+            if (dataflow.far_reg) {
+                n_far_regs = std::max<size_t>(n_far_regs, instructions[pc].GetOperands() + 1U);
             }
-            for (const auto &str : ENCODER.GetObjectsStorage()[element.val_].methods_) {
-                size += str.size() + 1;
-                size += sizeof(ENCODER.GetObjectsStorage()[element.val_].methods_bc_offsets_[0]);
+            if (instructions[pc].GetOpcode() == Opcode::GETARG0) {
+                n_args = std::max<size_t>(n_args, 1);
+            } else if (instructions[pc].GetOpcode() == Opcode::GETARG1) {
+                n_args = std::max<size_t>(n_args, 2);
             }
-            ASSERT(ENCODER.GetObjectsStorage()[element.val_].methods_.size() == ENCODER.GetObjectsStorage()[element.val_].methods_bc_offsets_.size());
-            break;
-        case Register::Type::ANY:
-            size = 0;
-            break;
-        default:
-            std::cerr << "Warning: calculating size of unsupported type.\n";
-            size = 0;
+        }
+        regs &= ~(InstDataflow::MaskT(1) << InstDataflow::ACC_BIT);
+        size_t n_regs = (regs == 0) ? 0 : (sizeof(unsigned) * 8U - __builtin_clz(regs));
+        n_regs = std::max(n_regs, n_far_regs);
+        records.push_back({static_cast<uint32_t>(entry_pc), static_cast<uint32_t>(end_pc - entry_pc),
+                           AddString(functions[i].name_), static_cast<uint16_t>(n_regs), static_cast<uint16_t>(n_args)});
     }
-    return size;
+    auto *records_ptr = reinterpret_cast<const char *>(records.data());
+    return Vector<char>(records_ptr, records_ptr + records.size() * sizeof(FunctionRecord));
 }
 
-void ClassFile::WriteObj(const ConstantPool::Element &element, int8_t pool_id) 
+Vector<char> ClassFile::BuildObjectsSection(Vector<uint32_t> *layout_offsets)
 {
-    size_t obj_size = 0;
-    MetaRecord meta = {
-        .type = element.type_
+    const auto &functions = ENCODER.GetFunctions();
+    auto get_function_idx = [&functions](size_t entry_pc) {
+        auto it = std::lower_bound(functions.begin(), functions.end(), entry_pc, [](const auto &func, size_t key) {
+            return func.entry_pc_ < key;
+        });
+        ASSERT(it != functions.end() && it->entry_pc_ == entry_pc);
+        return static_cast<uint32_t>(it - functions.begin());
     };
-    if (element.type_ == Register::Type::ANY) {
-        return;
-    }
-    write_buf(reinterpret_cast<char *>(&meta), sizeof(meta));
-    switch (element.type_) {
-        case Register::Type::FUNC: {
-            FuncRecord record = { .bc_offset = element.val_, .id = pool_id };
-            write_buf(reinterpret_cast<char *>(&record), sizeof(record));
-            break;
+
+    Vector<uint32_t> words;
+    for (const auto &obj : ENCODER.GetObjectsStorage()) {
+        layout_offsets->push_back(words.size() * sizeof(uint32_t));
+        words.push_back(AddString(obj.name_));
+        words.push_back(obj.data_fields_.size());
+        words.push_back(obj.methods_.size());
+        for (const auto &str : obj.data_fields_) {
+            words.push_back(AddString(str));
         }
-        case Register::Type::NUM: {
-            NumRecord record = { .value = bit_cast<double>(element.val_), .id = pool_id };
-            write_buf(reinterpret_cast<char *>(&record), sizeof(record));
-            break;
+        for (const auto &str : obj.methods_) {
+            words.push_back(AddString(str));
         }
-        case Register::Type::STR: {
-            StrRecord record = { .size = ENCODER.GetStringsStorage()[element.val_].size(), .id = pool_id };
-            write_buf(reinterpret_cast<char *>(&record), sizeof(record));
-            write_buf(ENCODER.GetStringsStorage()[element.val_].c_str(), record.size + 1);
-            break;
+        ASSERT(obj.methods_.size() == obj.methods_bc_offsets_.size());
+        for (const auto bc_offs : obj.methods_bc_offsets_) {
+            words.push_back(get_function_idx(bc_offs));
         }
-        case Register::Type::OBJ: {
-            ObjRecord record = { .data_fields_n_ = ENCODER.GetObjectsStorage()[element.val_].data_fields_.size(),
-                                 .methods_n_ = ENCODER.GetObjectsStorage()[element.val_].methods_.size(), .id = pool_id };
-            write_buf(reinterpret_cast<char *>(&record), sizeof(record));
-            for (const auto &str : ENCODER.GetObjectsStorage()[element.val_].data_fields_) {
-                write_buf(str.c_str(), str.size() + 1);
-            }
-            for (const auto &str : ENCODER.GetObjectsStorage()[element.val_].methods_) {
-                write_buf(str.c_str(), str.size() + 1);
-            }
-            for (const auto bc_offs : ENCODER.GetObjectsStorage()[element.val_].methods_bc_offsets_) {
-                write_buf(reinterpret_cast<const char *>(&bc_offs), sizeof(bc_offs));
+    }
+    auto *words_ptr = reinterpret_cast<const char *>(words.data());
+    return Vector<char>(words_ptr, words_ptr + words.size() * sizeof(uint32_t));
+}
+
+Vector<char> ClassFile::BuildConstantPool(const Vector<uint32_t> &layout_offsets)
+{
+    const auto &functions = ENCODER.GetFunctions();
+    const auto &elements = ENCODER.GetConstantPool().Elements();
+    const auto &imports = ENCODER.GetImports();
+    // Trailing unused ids aren't written, ids of imports aren't set in the pool:
+    size_t n_records = elements.size();
+    while ((n_records != 0) && (elements[n_records - 1].type_ == Register::Type::ANY)) {
+        n_records--;
+    }
+    for (const auto &import : imports) {
+        n_records = std::max<size_t>(n_records, import.pool_id_ + 1U);
+    }
+    Vector<PoolRecord> records(n_records);
+    for (size_t id = 0; id < n_records; id++) {
+        const auto &element = elements[id];
+        auto &record = records[id];
+        record.type = static_cast<uint8_t>(element.type_);
+        switch (element.type_) {
+            case Register::Type::FUNC: {
+                auto it = std::find_if(functions.begin(), functions.end(), [&element](const auto &func) {
+                    return func.entry_pc_ == element.val_;
+                });
+                ASSERT(it != functions.end());
+                record.value = it - functions.begin();
+                break;
             }
-            break;
+            case Register::Type::NUM:
+                record.value = element.val_;
+                break;
+            case Register::Type::STR:
+                record.value = AddString(ENCODER.GetStringsStorage()[element.val_]);
+                break;
+            case Register::Type::OBJ:
+                record.value = layout_offsets[element.val_];
+                break;
+            case Register::Type::ANY:
+                break;
+            default:
+                LOG_FATAL(ENCODER, "Encoding of unsupported constant pool type");
         }
-        default:
-            // ASSERT(0 && "Unreachable: encoding of unsupported object type");
-            break;
     }
+    for (size_t i = 0; i < imports.size(); i++) {
+        records[imports[i].pool_id_].type = POOL_RECORD_IMPORT;
+        records[imports[i].pool_id_].value = i;
+    }
+    auto *records_ptr = reinterpret_cast<const char *>(records.data());
+    return Vector<char>(records_ptr, records_ptr + records.size() * sizeof(PoolRecord));
 }
 
-void ClassFile::write_buf(const char *src, size_t nbytes) 
+Vector<char> ClassFile::BuildImports()
 {
-    ASSERT(src && "Invalid pointer");
-    char *buf_ptr = file_buffer_.data() + buf_pos_;
-    std::memcpy(buf_ptr, src, nbytes);
-    buf_pos_ += nbytes;
+    Vector<ImportRecord> records;
+    for (const auto &import : ENCODER.GetImports()) {
+        records.push_back({AddString(import.module_), AddString(import.symbol_)});
+    }
+    auto *records_ptr = reinterpret_cast<const char *>(records.data());
+    return Vector<char>(records_ptr, records_ptr + records.size() * sizeof(ImportRecord));
 }
 
-size_t GetFileSize(int fd)
+// Every declared function and object is exported:
+Vector<char> ClassFile::BuildExports()
 {
-    auto pos = lseek(fd, 0, SEEK_CUR);
-    size_t size = lseek(fd, 0, SEEK_END);
-    lseek(fd, pos, SEEK_SET);
-    return size;
+    const auto &elements = ENCODER.GetConstantPool().Elements();
+    Vector<std::pair<std::string, uint8_t>> exports;
+    for (const auto &[name, id] : ENCODER.GetDeclaredIds()) {
+        if ((elements[id].type_ == Register::Type::FUNC) || (elements[id].type_ == Register::Type::OBJ)) {
+            exports.emplace_back(name, id);
+        }
+    }
+    std::sort(exports.begin(), exports.end());
+    Vector<ExportRecord> records;
+    for (const auto &[name, id] : exports) {
+        records.push_back({AddString(name), id});
+    }
+    auto *records_ptr = reinterpret_cast<const char *>(records.data());
+    return Vector<char>(records_ptr, records_ptr + records.size() * sizeof(ExportRecord));
 }
-char *ReadFile(int fd, size_t size, Allocator *allocator)
+
+Vector<char> ClassFile::BuildStackMaps()
 {
-    auto buf = allocator->ConstRegion().AllocBytes(size);
-    auto ret = read(fd, buf, size);
-    ASSERT(ret == size);
-    return reinterpret_cast<char *>(buf);
+    const auto &stack_maps = ENCODER.GetStackMaps();
+    auto *records_ptr = reinterpret_cast<const char *>(stack_maps.data());
+    return Vector<char>(records_ptr, records_ptr + stack_maps.size() * sizeof(StackMapRecord));
 }
 
-int ClassFile::LoadClassFile(const char *fn, ClassFileHeader **header,
-                            BytecodeInstruction **instr_buffer,
-                            ConstantPool *const_pool, Allocator *allocator) 
+void ClassFile::DumpClassFile(FILE *fileptr)
 {
-    int fd = open(fn, O_RDONLY);
-    ASSERT(fd != -1);
-    auto file_size = GetFileSize(fd);
-    auto filebuf = ReadFile(fd, file_size, allocator);
-    close(fd);
-    
-    *header = ClassFile::LoadHeader(filebuf);
+    ASSERT(fileptr);
+    // Other sections add their strings, so the string table is complete only after they are built:
+    Vector<uint32_t> layout_offsets;
+    auto code = BuildCodeSection();
+    auto functions = BuildFunctionsSection();
+    auto objects = BuildObjectsSection(&layout_offsets);
+    auto constant_pool = BuildConstantPool(layout_offsets);
+    auto stack_maps = BuildStackMaps();
+    auto imports = BuildImports();
+    auto exports = BuildExports();
 
-    size_t code_size = (*header)->table_offset - (*header)->code_offset;
-    ASSERT(code_size % sizeof(BytecodeInstruction) == 0 && "Invalid codesize");
-    *instr_buffer = ClassFile::LoadCodeSection(filebuf);
+    size_t n_sections = 5U + !stack_maps.empty() + !imports.empty() + !exports.empty();
+    file_buffer_.assign(sizeof(ClassFileHeader) + n_sections * sizeof(SectionEntry), 0);
+    sections_.clear();
+    WriteSection(SectionKind::CODE, code.data(), code.size());
+    WriteSection(SectionKind::STRINGS, string_table_.data(), string_table_.size());
+    WriteSection(SectionKind::CONSTANT_POOL, constant_pool.data(), constant_pool.size());
+    WriteSection(SectionKind::FUNCTIONS, functions.data(), functions.size());
+    WriteSection(SectionKind::OBJECTS, objects.data(), objects.size());
+    if (!stack_maps.empty()) {
+        WriteSection(SectionKind::STACK_MAPS, stack_maps.data(), stack_maps.size());
+    }
+    if (!imports.empty()) {
+        WriteSection(SectionKind::IMPORTS, imports.data(), imports.size());
+    }
+    if (!exports.empty()) {
+        WriteSection(SectionKind::EXPORTS, exports.data(), exports.size());
+    }
+    ASSERT(sections_.size() == n_sections);
+    std::memcpy(file_buffer_.data() + sizeof(ClassFileHeader), sections_.data(), n_sections * sizeof(SectionEntry));
 
+    ClassFileHeader header {};
+    std::memcpy(header.magic, CLASS_FILE_MAGIC, sizeof(header.magic));
+    header.version = CLASS_FILE_VERSION;
+    header.n_sections = n_sections;
+    uint8_t entry_id = 0;
+    bool has_entry = ENCODER.FindId(ENTRY_FUNC_NAME, &entry_id) &&
+                     (ENCODER.GetConstantPool().Elements()[entry_id].type_ == Register::Type::FUNC);
+    header.entry_point = has_entry ? ENCODER.GetConstantPool().GetFunctionBytecodeOffset(entry_id) : NO_ENTRY_POINT;
+    header.checksum = ComputeChecksum(file_buffer_.data() + sizeof(header), file_buffer_.size() - sizeof(header));
+    std::memcpy(file_buffer_.data(), &header, sizeof(header));
+    std::fwrite(file_buffer_.data(), sizeof(file_buffer_[0]), file_buffer_.size(), fileptr);
+}
 
-    int err_code = ClassFile::LoadConstantPool(filebuf + sizeof(ClassFileHeader) + code_size, file_size -  sizeof(ClassFileHeader) - code_size,  const_pool, allocator);
+size_t GetFileSize(int fd)
+{
+    struct stat file_stat {};
+    if (fstat(fd, &file_stat) != 0) {
+        return 0;
+    }
+    return file_stat.st_size;
+}
 
-    return err_code;
+const SectionEntry *ClassFile::FindSection(const ClassFileHeader *header, SectionKind kind)
+{
+    auto *sections = reinterpret_cast<const SectionEntry *>(header + 1);
+    for (size_t i = 0; i < header->n_sections; i++) {
+        if (sections[i].kind == kind) {
+            return &sections[i];
+        }
+    }
+    return nullptr;
 }
 
-ClassFileHeader *ClassFile::LoadHeader(char *fileptr) 
+ClassFileHeader *ClassFile::MapClassFile(const char *fn, void *map_addr, size_t map_size, size_t *file_size)
 {
-    return reinterpret_cast<ClassFileHeader*>(fileptr);
+    int fd = open(fn, O_RDONLY);
+    if (fd == -1) {
+        std::cerr << "Can't open class file: " << fn << std::endl;
+        return nullptr;
+    }
+    *file_size = GetFileSize(fd);
+    if (*file_size < sizeof(ClassFileHeader)) {
+        close(fd);
+        std::cerr << "Invalid class file: " << fn << std::endl;
+        return nullptr;
+    }
+    if ((map_addr != nullptr) && (*file_size > map_size)) {
+        close(fd);
+        std::cerr << "Class file is too large: " << fn << std::endl;
+        return nullptr;
+    }
+    // The mapping is never unmapped: the code, strings and names of object members are used in place:
+    void *mapping = mmap(map_addr, *file_size, PROT_READ, MAP_PRIVATE | ((map_addr != nullptr) ? MAP_FIXED : 0), fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Can't map class file: " << fn << std::endl;
+        return nullptr;
+    }
+    auto *file_header = reinterpret_cast<ClassFileHeader *>(mapping);
+    if (std::memcmp(file_header->magic, CLASS_FILE_MAGIC, sizeof(CLASS_FILE_MAGIC)) != 0) {
+        std::cerr << "Not a class file: " << fn << std::endl;
+        return nullptr;
+    }
+    if (file_header->version != CLASS_FILE_VERSION) {
+        std::cerr << "Unsupported class file version " << file_header->version << " (expected "
+                  << CLASS_FILE_VERSION << "): " << fn << std::endl;
+        return nullptr;
+    }
+    return file_header;
 }
 
-BytecodeInstruction *ClassFile::LoadCodeSection(char *filebuf) 
+int ClassFile::LoadClassFile(const char *fn, void *map_addr, size_t map_size, const BytecodeInstruction *program,
+                             Module *module)
 {
-    return reinterpret_cast<BytecodeInstruction *>(filebuf + sizeof(ClassFileHeader));
+    size_t file_size = 0;
+    auto *file_header = MapClassFile(fn, map_addr, map_size, &file_size);
+    if (file_header == nullptr) {
+        return 1;
+    }
+    auto filebuf = reinterpret_cast<const char *>(file_header);
+
+    size_t directory_end = sizeof(ClassFileHeader) + file_header->n_sections * sizeof(SectionEntry);
+    if (directory_end > file_size) {
+        std::cerr << "Invalid class file: " << fn << std::endl;
+        return 1;
+    }
+    if (ComputeChecksum(filebuf + sizeof(ClassFileHeader), file_size - sizeof(ClassFileHeader)) != file_header->checksum) {
+        std::cerr << "Class file is corrupted (checksum mismatch): " << fn << std::endl;
+        return 1;
+    }
+
+    constexpr size_t N_KINDS = static_cast<size_t>(SectionKind::COUNT);
+    std::array<const SectionEntry *, N_KINDS> sections {};
+    for (size_t i = 0; i < N_KINDS; i++) {
+        auto kind = static_cast<SectionKind>(i);
+        sections[i] = FindSection(file_header, kind);
+        bool is_optional = (kind == SectionKind::STACK_MAPS) || (kind == SectionKind::IMPORTS) ||
+                           (kind == SectionKind::EXPORTS);
+        if ((sections[i] == nullptr) && is_optional) {
+            continue;
+        }
+        if ((sections[i] == nullptr) || (sections[i]->offset % SECTION_ALIGNMENT != 0) ||
+            (sections[i]->offset < directory_end) || (sections[i]->size > file_size - sections[i]->offset)) {
+            std::cerr << "Invalid section " << i << " in class file: " << fn << std::endl;
+            return 1;
+        }
+    }
+    // Optional sections are empty if they are missing:
+    auto get_section = [filebuf, &sections](SectionKind kind) {
+        auto *section = sections[static_cast<size_t>(kind)];
+        return (section != nullptr) ? filebuf + section->offset : nullptr;
+    };
+    auto get_section_size = [&sections](SectionKind kind) {
+        auto *section = sections[static_cast<size_t>(kind)];
+        return (section != nullptr) ? section->size : 0;
+    };
+
+    size_t code_size = get_section_size(SectionKind::CODE);
+    size_t strings_size = get_section_size(SectionKind::STRINGS);
+    size_t functions_size = get_section_size(SectionKind::FUNCTIONS);
+    size_t imports_size = get_section_size(SectionKind::IMPORTS);
+    size_t exports_size = get_section_size(SectionKind::EXPORTS);
+    if ((code_size % sizeof(BytecodeInstruction) != 0) || (functions_size % sizeof(FunctionRecord) != 0) ||
+        (imports_size % sizeof(ImportRecord) != 0) || (exports_size % sizeof(ExportRecord) != 0) ||
+        ((strings_size != 0) && (get_section(SectionKind::STRINGS)[strings_size - 1] != '\0'))) {
+        std::cerr << "Invalid class file: " << fn << std::endl;
+        return 1;
+    }
+    size_t n_insts = code_size / sizeof(BytecodeInstruction);
+    if ((file_header->entry_point != NO_ENTRY_POINT) && (file_header->entry_point >= n_insts)) {
+        std::cerr << "Invalid entry point in class file: " << fn << std::endl;
+        return 1;
+    }
+
+    // Functions are verified one by one, so their ranges may neither overlap nor leave the code section:
+    auto *function_records = reinterpret_cast<const FunctionRecord *>(get_section(SectionKind::FUNCTIONS));
+    size_t n_functions = functions_size / sizeof(FunctionRecord);
+    size_t prev_end_pc = 0;
+    for (size_t i = 0; i < n_functions; i++) {
+        const auto &record = function_records[i];
+        if ((record.entry_pc < prev_end_pc) || (record.entry_pc >= n_insts) || (record.code_size == 0) ||
+            (record.code_size > n_insts - record.entry_pc) || (record.name >= strings_size)) {
+            std::cerr << "Invalid function " << i << " in class file: " << fn << std::endl;
+            return 1;
+        }
+        prev_end_pc = record.entry_pc + record.code_size;
+    }
+
+    auto *imports = reinterpret_cast<const ImportRecord *>(get_section(SectionKind::IMPORTS));
+    size_t n_imports = imports_size / sizeof(ImportRecord);
+    for (size_t i = 0; i < n_imports; i++) {
+        if ((imports[i].module >= strings_size) || (imports[i].symbol >= strings_size)) {
+            std::cerr << "Invalid import " << i << " in class file: " << fn << std::endl;
+            return 1;
+        }
+    }
+    // Exports are looked up by binary search, so their names must be sorted and unique:
+    auto *exports = reinterpret_cast<const ExportRecord *>(get_section(SectionKind::EXPORTS));
+    auto *string_table = get_section(SectionKind::STRINGS);
+    size_t n_exports = exports_size / sizeof(ExportRecord);
+    for (size_t i = 0; i < n_exports; i++) {
+        if ((exports[i].name >= strings_size) || (exports[i].pool_id >= ConstantPool::CONSTANT_POOL_SIZE) ||
+            ((i != 0) && (std::strcmp(string_table + exports[i - 1].name, string_table + exports[i].name) >= 0))) {
+            std::cerr << "Invalid export " << i << " in class file: " << fn << std::endl;
+            return 1;
+        }
+    }
+
+    auto *code = reinterpret_cast<const BytecodeInstruction *>(get_section(SectionKind::CODE));
+    if (program == nullptr) {
+        program = code;
+    }
+    ASSERT(code >= program);
+    size_t base_pc = code - program;
+    module->SetClassFile(file_header, file_size, code, n_insts, base_pc, string_table);
+    module->SetExports(exports, n_exports);
+
+    auto *stack_maps_section = sections[static_cast<size_t>(SectionKind::STACK_MAPS)];
+    if (stack_maps_section != nullptr) {
+        module->GetStackMaps()->Set(reinterpret_cast<const StackMapRecord *>(filebuf + stack_maps_section->offset),
+                                    stack_maps_section->size / sizeof(StackMapRecord), base_pc);
+    }
+
+    auto *functions = module->GetFunctions();
+    functions->Set(function_records, n_functions, string_table, base_pc);
+    auto *const_pool = module->GetConstantPool();
+    const_pool->SetClassFileTables(string_table, functions, imports);
+
+    return ClassFile::LoadConstantPool(get_section(SectionKind::CONSTANT_POOL), get_section_size(SectionKind::CONSTANT_POOL),
+                                       get_section(SectionKind::OBJECTS), get_section_size(SectionKind::OBJECTS),
+                                       string_table, strings_size, *functions, n_imports, const_pool);
 }
 
-int ClassFile::LoadConstantPool(char *constpool_file, size_t bytes_count, ConstantPool *constant_pool, Allocator *allocator)
+int ClassFile::LoadConstantPool(const char *pool_section, size_t pool_size, const char *objects_section,
+                                size_t objects_size, const char *string_table, size_t strings_size,
+                                const FunctionTable &functions, size_t n_imports, ConstantPool *constant_pool)
 {
-    for (size_t pos = 0; pos < bytes_count; ) {
-        MetaRecord meta;
-        std::memcpy(&meta, constpool_file + pos, sizeof(meta));
-        pos += sizeof(meta);
-        switch (meta.type) {
-        case Register::Type::FUNC: {
-            auto *record = reinterpret_cast<FuncRecord *>(constpool_file + pos);
-            pos += sizeof(*record);
-            constant_pool->SetFunction(record->id, record->bc_offset);
+    size_t n_records = pool_size / sizeof(PoolRecord);
+    if ((pool_size % sizeof(PoolRecord) != 0) || (n_records > ConstantPool::CONSTANT_POOL_SIZE)) {
+        std::cerr << "Invalid constant pool section\n";
+        return 1;
+    }
+    auto *records = reinterpret_cast<const PoolRecord *>(pool_section);
+    for (size_t id = 0; id < n_records; id++) {
+        const auto &record = records[id];
+        if (record.type == POOL_RECORD_IMPORT) {
+            if (record.value >= n_imports) {
+                std::cerr << "Invalid import index of constant pool element " << id << "\n";
+                return 1;
+            }
+            constant_pool->SetImport(id, record.value);
+            continue;
+        }
+        switch (static_cast<Register::Type>(record.type)) {
+        case Register::Type::FUNC:
+            if (record.value >= functions.Size()) {
+                std::cerr << "Invalid function index of constant pool element " << id << "\n";
+                return 1;
+            }
+            constant_pool->SetFunction(id, functions.GetEntryPc(functions[record.value]));
             break;
-        } case Register::Type::NUM: {
-            auto *record = reinterpret_cast<NumRecord *>(constpool_file + pos);
-            pos += sizeof(*record);
-            constant_pool->SetNum(record->id, record->value);
+        case Register::Type::NUM:
+            constant_pool->SetNum(id, bit_cast<double>(record.value));
             break;
-        } case Register::Type::STR: {
-            auto *record = reinterpret_cast<StrRecord *>(constpool_file + pos);
-            pos += sizeof(*record) + record->size + 1;
-            ASSERT(record->data[record->size] == '\0');
-            constant_pool->SetStr(record->id, reinterpret_cast<uint64_t>(record->data));
+        case Register::Type::STR:
+            if (record.value >= strings_size) {
+                std::cerr << "Invalid string offset of constant pool element " << id << "\n";
+                return 1;
+            }
+            constant_pool->SetStr(id, reinterpret_cast<uint64_t>(string_table + record.value));
             break;
-        } case Register::Type::OBJ: {
-            auto *record = reinterpret_cast<ObjRecord *>(constpool_file + pos);
-            auto *mapping = constant_pool->GetMappingForObjAt(record->id);
-            pos += sizeof(*record);
-            for (size_t i = 0; i < record->data_fields_n_; i++) {
-                const char *c_str = reinterpret_cast<const char *>(constpool_file + pos);
-                if (mapping->find(c_str) != mapping->end()) {
-                    LOG_FATAL(INTERPRETER, "Object has overlapping fields names");
-                }
-                (*mapping)[c_str] = i;
-                pos += strlen(c_str);
-                pos++;
+        case Register::Type::OBJ: {
+            if (record.value + sizeof(ObjectLayoutRecord) > objects_size) {
+                std::cerr << "Invalid layout offset of constant pool element " << id << "\n";
+                return 1;
             }
-            for (size_t i = 0; i < record->methods_n_; i++) {
-                const char *c_str = reinterpret_cast<const char *>(constpool_file + pos);
-                if (mapping->find(c_str) != mapping->end()) {
-                    LOG_FATAL(INTERPRETER, "Object has overlapping fields names");
-                }
-                (*mapping)[c_str] = record->data_fields_n_ + i;
-                pos += strlen(c_str);
-                pos++;
+            auto *layout = reinterpret_cast<const ObjectLayoutRecord *>(objects_section + record.value);
+            size_t layout_size = sizeof(*layout) + (layout->n_fields + 2 * size_t(layout->n_methods)) * sizeof(uint32_t);
+            if (record.value + layout_size > objects_size) {
+                std::cerr << "Invalid layout of constant pool element " << id << "\n";
+                return 1;
             }
-            size_t *methods_bc_offs = allocator->ConstRegion().Alloc<size_t>(record->methods_n_ + 1);
-            methods_bc_offs[0] = record->methods_n_;
-            memcpy(methods_bc_offs + 1, constpool_file + pos, (record->methods_n_) * sizeof(size_t));
-            pos += record->methods_n_ * sizeof(size_t);
-            
-            constant_pool->SetObject(record->id, reinterpret_cast<uint64_t>(methods_bc_offs));
+            constant_pool->SetObjectRecord(id, layout);
             break;
-        } default:
-            std::cerr << "Unreachable executed: trying to load unsupported type\n";
-            std::exit(EXIT_FAILURE);
+        }
+        case Register::Type::ANY:
             break;
+        default:
+            std::cerr << "Unreachable executed: trying to load unsupported type\n";
+            return 1;
         }
     }
     return 0;
 }
 
+void ConstantPool::MaterializeObject(uint8_t constant_pool_id)
+{
+    const auto *layout = object_records_[constant_pool_id];
+    auto *mapping = &object_mappings_[constant_pool_id];
+    // Member names and method indices are covered by the checksum, so they aren't validated here:
+    size_t n_members = layout->n_fields + layout->n_methods;
+    for (size_t i = 0; i < n_members; i++) {
+        const char *c_str = string_table_ + layout->members[i];
+        if (mapping->find(c_str) != mapping->end()) {
+            LOG_FATAL(INTERPRETER, "Object has overlapping fields names");
+        }
+        (*mapping)[c_str] = i;
+    }
+    // The vector is prefixed with the number of methods:
+    size_t *methods_bc_offs = Allocator::ConstRegionT::Alloc<size_t>(layout->n_methods + 1);
+    methods_bc_offs[0] = layout->n_methods;
+    for (size_t i = 0; i < layout->n_methods; i++) {
+        methods_bc_offs[i + 1] = functions_->GetEntryPc((*functions_)[layout->members[n_members + i]]);
+    }
+
+    SetObject(constant_pool_id, reinterpret_cast<uint64_t>(methods_bc_offs));
+    object_records_[constant_pool_id] = nullptr;
+}
+
 }; // namespace k3s
\ No newline at end of file
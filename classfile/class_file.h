@@ -5,8 +5,12 @@
 #include "interpreter/types/coretypes.h"
 #include "allocator/allocator.h"
 #include "interpreter/bytecode_instruction.h"
+#include <algorithm>
 #include <cstdint>
 #include <array>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace k3s {
@@ -18,6 +22,102 @@ static constexpr const char *ENTRY_FUNC_NAME = "main";
 
 class AsmEncoder;
 extern AsmEncoder ENCODER;
+class FunctionTable;
+class Module;
+
+/// Class file format, version 3.
+/// File : Header SectionEntry[n_sections] Section*
+/// Sections are aligned to `SECTION_ALIGNMENT`, their order isn't fixed. Each kind may be present once:
+///   CODE          : BytecodeInstruction*
+///   STRINGS       : deduplicated null-terminated strings, they are referenced by offset in the section
+///   CONSTANT_POOL : PoolRecord per constant pool id
+///   FUNCTIONS     : FunctionRecord* sorted by entry pc (both functions and methods)
+///   OBJECTS       : ObjectLayoutRecord*, they are referenced by offset in the section
+///   STACK_MAPS    : StackMapRecord* sorted by pc, optional (all registers are treated as live without it)
+///   IMPORTS       : ImportRecord*, optional
+///   EXPORTS       : ExportRecord* sorted by name, optional
+/// Unknown sections are skipped. The checksum covers everything after the header.
+/// Pcs in the file are relative to the start of its code section.
+static constexpr char CLASS_FILE_MAGIC[4] = {'K', '3', 'S', 'C'};
+static constexpr uint16_t CLASS_FILE_VERSION = 3U;
+static constexpr size_t SECTION_ALIGNMENT = 8U;
+// Entry point of modules without `main`, they may be imported only:
+static constexpr uint64_t NO_ENTRY_POINT = ~uint64_t(0);
+
+struct ClassFileHeader 
+{
+  char magic[4];
+  uint16_t version;
+  uint16_t n_sections;
+  uint64_t checksum;
+  uint64_t entry_point;         // Bytecode offset of main function or NO_ENTRY_POINT
+};
+
+enum class SectionKind : uint32_t {
+    CODE,
+    STRINGS,
+    CONSTANT_POOL,
+    FUNCTIONS,
+    OBJECTS,
+    STACK_MAPS,
+    IMPORTS,
+    EXPORTS,
+    COUNT,
+};
+
+struct SectionEntry
+{
+    SectionKind kind;
+    uint32_t reserved;
+    uint64_t offset;            // File offset in bytes
+    uint64_t size;              // Size in bytes
+};
+
+/// Value depends on type: bits of the number, offset of the string in the string table,
+/// index of the function in the function table, offset of the layout in the objects section
+/// or index of the import in the imports section.
+struct PoolRecord
+{
+    uint8_t type;               // Register::Type, ANY for unused ids or POOL_RECORD_IMPORT
+    uint8_t reserved[7];
+    uint64_t value;
+};
+
+// Type of pool records which are defined by another module:
+static constexpr uint8_t POOL_RECORD_IMPORT = 0xFFU;
+
+/// Function or object `symbol` exported by `module`, the module is loaded from `<module>.k3sm`.
+struct ImportRecord
+{
+    uint32_t module;            // Offset in the string table
+    uint32_t symbol;            // Offset in the string table
+};
+
+/// Functions and objects of the constant pool which may be imported by other modules.
+struct ExportRecord
+{
+    uint32_t name;              // Offset in the string table
+    uint32_t pool_id;
+};
+
+struct FunctionRecord
+{
+    uint32_t entry_pc;
+    uint32_t code_size;         // In instructions
+    uint32_t name;              // Offset in the string table
+    uint16_t n_regs;            // Registers used by the function (the accumulator isn't counted)
+    uint16_t n_args;
+};
+
+/// Followed by `n_fields + n_methods` member names (offsets in the string table),
+/// then by `n_methods` indices of methods in the function table.
+struct ObjectLayoutRecord
+{
+    uint32_t name;
+    uint32_t n_fields;
+    uint32_t n_methods;
+    uint32_t members[];
+};
 
 class ConstantPool {
 public:
@@ -55,22 +155,78 @@ public:
         data_[constant_pool_id].val_ = val;
     }
 
+    /// Tables of the loaded class file, which are referenced by object layouts and imports.
+    void SetClassFileTables(const char *string_table, const FunctionTable *functions, const ImportRecord *imports)
+    {
+        string_table_ = string_table;
+        functions_ = functions;
+        imports_ = imports;
+    }
+
+    /// Imports of a loaded class file are resolved on first use (see `ModuleTable::Link`).
+    void SetImport(uint8_t constant_pool_id, size_t import_idx)
+    {
+        data_[constant_pool_id].type_ = Type::ANY;
+        data_[constant_pool_id].val_ = 0;
+        import_records_[constant_pool_id] = &imports_[import_idx];
+    }
+
+    /// Returns the import which isn't resolved yet or nullptr.
+    const ImportRecord *GetImport(uint8_t constant_pool_id) const
+    {
+        return import_records_[constant_pool_id];
+    }
+
+    /// Resolves the import of an object of another module, its methods vector is shared.
+    void SetImportedObject(uint8_t constant_pool_id, const ConstUnorderedMap<std::string_view, size_t> &mapping,
+                           uint64_t methods)
+    {
+        object_mappings_[constant_pool_id].insert(mapping.begin(), mapping.end());
+        SetObject(constant_pool_id, methods);
+        import_records_[constant_pool_id] = nullptr;
+    }
+
+    /// Resolves the import of a function of another module, \p pc is the entry pc of the function.
+    void SetImportedFunction(uint8_t constant_pool_id, size_t pc)
+    {
+        SetFunction(constant_pool_id, pc);
+        import_records_[constant_pool_id] = nullptr;
+    }
+
+    const char *GetString(uint32_t offset) const
+    {
+        return string_table_ + offset;
+    }
+
+    /// Objects of a loaded class file are decoded on first use, \p record points to the layout in the file.
+    void SetObjectRecord(uint8_t constant_pool_id, const ObjectLayoutRecord *record)
+    {
+        data_[constant_pool_id].type_ = Type::OBJ;
+        data_[constant_pool_id].val_ = 0;
+        object_records_[constant_pool_id] = record;
+    }
+
     size_t GetFunctionBytecodeOffset(uint8_t constant_pool_id)
     {
         ASSERT(data_[constant_pool_id].type_ == Type::FUNC);
         return data_[constant_pool_id].val_;
     }
     
-    const auto &GetElement(uint8_t constant_pool_id)
+    const auto &GetElement(uint8_t constant_pool_id) const
     {
         return data_[constant_pool_id];
     }
+    // The element of the object is valid once its mapping is requested:
     auto *GetMappingForObjAt(uint8_t constant_pool_id)
     {
+        if (UNLIKELY(object_records_[constant_pool_id] != nullptr)) {
+            MaterializeObject(constant_pool_id);
+        }
         return &object_mappings_[constant_pool_id];
     }
     const auto *GetMappingForObjAt(uint8_t constant_pool_id) const
     {
+        ASSERT(object_records_[constant_pool_id] == nullptr);
         return &object_mappings_[constant_pool_id];
     }
 
@@ -79,74 +235,166 @@ public:
         return data_;
     }
 
+    /// Decodes every object which isn't decoded yet, e.g. before the pool is written to the code cache.
+    void MaterializeObjects()
+    {
+        for (size_t id = 0; id < CONSTANT_POOL_SIZE; id++) {
+            if (object_records_[id] != nullptr) {
+                MaterializeObject(id);
+            }
+        }
+    }
+
+private:
+    // Builds the mapping and the methods vector from the object layout:
+    void MaterializeObject(uint8_t constant_pool_id);
+
 private:
     std::array<Element, CONSTANT_POOL_SIZE> data_{};
     std::array<ConstUnorderedMap<std::string_view, size_t>, CONSTANT_POOL_SIZE> object_mappings_{};
+    // Layouts of objects which aren't decoded yet:
+    std::array<const ObjectLayoutRecord *, CONSTANT_POOL_SIZE> object_records_{};
+    // Imports which aren't resolved yet:
+    std::array<const ImportRecord *, CONSTANT_POOL_SIZE> import_records_{};
+    const char *string_table_ {};
+    const FunctionTable *functions_ {};
+    const ImportRecord *imports_ {};
 };
 
-struct ClassFileHeader 
+/// Registers which hold live values at a safepoint (an instruction which may trigger GC).
+/// Bits of `live_mask` are numbers of registers, the accumulator is `InstDataflow::ACC_BIT`.
+struct StackMapRecord
 {
-  uint64_t code_offset;     // File offset in bytes to start of bytecode instructions
-  uint64_t table_offset;    // File offset in bytes to start of constant pool
-  uint64_t entry_point;     // Bytecode offset of main function
+    uint32_t pc;
+    uint32_t live_mask;
+};
+
+/// Stack maps of a module, records are sorted by pc. Pcs of records are relative to `base_pc`.
+class StackMaps {
+public:
+    static constexpr uint32_t ALL_LIVE = ~uint32_t(0);
+
+    void Set(const StackMapRecord *records, size_t n_records, size_t base_pc)
+    {
+        records_ = records;
+        n_records_ = n_records;
+        base_pc_ = base_pc;
+    }
+
+    /// Returns the live mask of the safepoint at \p pc. Pcs without a record are treated conservatively.
+    uint32_t GetLiveMask(size_t pc) const
+    {
+        pc -= base_pc_;
+        auto *end = records_ + n_records_;
+        auto *record = std::lower_bound(records_, end, pc, [](const StackMapRecord &rec, size_t key) {
+            return rec.pc < key;
+        });
+        return ((record != end) && (record->pc == pc)) ? record->live_mask : ALL_LIVE;
+    }
+
+private:
+    const StackMapRecord *records_ {};
+    size_t n_records_ {};
+    size_t base_pc_ {};
+};
+
+/// Functions of a module, records are sorted by entry pc. Pcs of records are relative to `base_pc`.
+class FunctionTable {
+public:
+    void Set(const FunctionRecord *records, size_t n_records, const char *string_table, size_t base_pc)
+    {
+        records_ = records;
+        n_records_ = n_records;
+        string_table_ = string_table;
+        base_pc_ = base_pc;
+    }
+
+    size_t Size() const
+    {
+        return n_records_;
+    }
+
+    const FunctionRecord &operator[](size_t idx) const
+    {
+        ASSERT(idx < n_records_);
+        return records_[idx];
+    }
+
+    size_t GetEntryPc(const FunctionRecord &record) const
+    {
+        return base_pc_ + record.entry_pc;
+    }
+
+    /// Returns the function which contains \p pc or nullptr if \p pc is out of code.
+    const FunctionRecord *FindByPc(size_t pc) const
+    {
+        if (pc < base_pc_) {
+            return nullptr;
+        }
+        pc -= base_pc_;
+        auto *end = records_ + n_records_;
+        auto *next = std::upper_bound(records_, end, pc, [](size_t key, const FunctionRecord &rec) {
+            return key < rec.entry_pc;
+        });
+        if (next == records_) {
+            return nullptr;
+        }
+        auto *record = next - 1;
+        return (pc < size_t(record->entry_pc) + record->code_size) ? record : nullptr;
+    }
+
+    const char *GetName(const FunctionRecord &record) const
+    {
+        return string_table_ + record.name;
+    }
+
+private:
+    const FunctionRecord *records_ {};
+    size_t n_records_ {};
+    const char *string_table_ {};
+    size_t base_pc_ {};
 };
 
-/// Class representing classfile format. 
-/// File format grammar: 
-/// File : Header Code ConstPool
-/// Header : ClassFileHeader
-/// Code : BytecodeInstructions*
-/// ConstPool : (MetaRecord Record)*
-/// Record : NumRecord | FuncRecord
-/// Recrod structure desribed below
+/// Class representing classfile format (see `ClassFileHeader` for the layout).
+/// The loader maps the file read-only: the code section is executed and strings are used right from the mapping.
+/// Constant pool records are only indexed at load time, objects are decoded on first `ldai`.
 class ClassFile {
     Vector<char> file_buffer_;
-    size_t buf_pos_;
+    Vector<SectionEntry> sections_;
+    Vector<char> string_table_;
+    std::unordered_map<std::string, uint32_t> string_ids_;
 public:
-    struct MetaRecord {
-        Register::Type type;    // following record type
-    };
-    struct FuncRecord {
-        size_t bc_offset;
-        int8_t id;
-    };
-    struct NumRecord {
-        double value;
-        int8_t id;
-    };
-    struct StrRecord {
-        size_t size;
-        int8_t id;
-        alignas(8) char data[];
-    };
-    struct ObjRecord {
-        size_t data_fields_n_;
-        size_t methods_n_;
-        int8_t id;
-        alignas(8) char data[];
-    };
     /// Write classfile to \p fileptr
     void DumpClassFile(FILE *fileptr);
-    /// Load classfile from \p fileptr
-    static int LoadClassFile(const char *fn, ClassFileHeader **header,
-                            BytecodeInstruction **instr_buffer,
-                            ConstantPool *const_pool, Allocator *allocator);
+    /// Map classfile \p fn and check its magic and version only, returns nullptr if the file can't be used.
+    /// \p map_addr and \p map_size are as for `LoadClassFile`
+    static ClassFileHeader *MapClassFile(const char *fn, void *map_addr, size_t map_size, size_t *file_size);
+    /// Load classfile from \p fn into \p module, returns non-zero if the file is malformed.
+    /// Unless \p map_addr is null, the file is mapped over the reserved range [\p map_addr, \p map_addr + \p map_size)
+    /// Pcs of the module are counted from \p program, the code of the first module is used if it is null
+    static int LoadClassFile(const char *fn, void *map_addr, size_t map_size, const BytecodeInstruction *program,
+                             Module *module);
+    /// FNV-1a over 64-bit words (the tail is hashed bytewise)
+    static uint64_t ComputeChecksum(const char *data, size_t size);
 
 private:
-    /// Loads classfile to \p header header from \p fileptr
-    static ClassFileHeader *LoadHeader(char *fileptr);
-    /// Loads code section to \p instructions_buffer_ from \p fileptr
-    static BytecodeInstruction *LoadCodeSection(char *fileptr);
-    /// Loads constant pool to \p constant_pool from \p fileptr
-    static int LoadConstantPool(char *constpool_file, size_t bytes_count, ConstantPool *constant_pool, Allocator *allocator);
-    static size_t EstimateEncodingSize(const ConstantPool::Element &element);
-    void AllocateBuffer();
-    /// Interfaces foe writing classfile parts to file
-    void WriteHeader();
-    void WriteCodeSection();
-    void WriteConstantPool();
-    void WriteObj(const ConstantPool::Element &element, int8_t pool_id);
-    void write_buf(const char *src, size_t nbytes);
+    /// Returns the section of \p kind or nullptr if there is none
+    static const SectionEntry *FindSection(const ClassFileHeader *header, SectionKind kind);
+    /// Indexes records of the constant pool in \p pool_section
+    static int LoadConstantPool(const char *pool_section, size_t pool_size, const char *objects_section,
+                                size_t objects_size, const char *string_table, size_t strings_size,
+                                const FunctionTable &functions, size_t n_imports, ConstantPool *constant_pool);
+    /// Returns offset of \p str in the string table, strings are deduplicated
+    uint32_t AddString(const std::string &str);
+    /// Interfaces for writing classfile parts to file
+    void WriteSection(SectionKind kind, const char *data, size_t size);
+    Vector<char> BuildCodeSection();
+    Vector<char> BuildFunctionsSection();
+    Vector<char> BuildObjectsSection(Vector<uint32_t> *layout_offsets);
+    Vector<char> BuildConstantPool(const Vector<uint32_t> &layout_offsets);
+    Vector<char> BuildStackMaps();
+    Vector<char> BuildImports();
+    Vector<char> BuildExports();
 };
 
 } // namespace k3s
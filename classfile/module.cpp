@@ -0,0 +1,110 @@
+#include "classfile/module.h"
+#include "classfile/verifier.h"
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace k3s {
+
+bool Module::FindExport(const char *symbol, uint8_t *constant_pool_id) const
+{
+    auto *end = exports_ + n_exports_;
+    auto *record = std::lower_bound(exports_, end, symbol, [this](const ExportRecord &rec, const char *key) {
+        return std::strcmp(string_table_ + rec.name, key) < 0;
+    });
+    if ((record == end) || (std::strcmp(string_table_ + record->name, symbol) != 0)) {
+        return false;
+    }
+    *constant_pool_id = record->pool_id;
+    return true;
+}
+
+// Modules are never unloaded, so the class file range is filled in order:
+Module *ModuleTable::Load(const char *fn, const char *name)
+{
+    if (n_modules_ == MAX_MODULES) {
+        std::cerr << "Too many modules: " << fn << std::endl;
+        return nullptr;
+    }
+    auto *module = new (Allocator::ConstRegionT::Alloc<Module>(1)) Module();
+    const BytecodeInstruction *program = (n_modules_ != 0) ? modules_[0]->GetCode() : nullptr;
+    if (ClassFile::LoadClassFile(fn, reinterpret_cast<void *>(next_map_addr_), Allocator::ALLOC_END_ADDR - next_map_addr_,
+                                 program, module) != 0) {
+        return nullptr;
+    }
+    // The name of the main module comes from the command line:
+    size_t name_size = std::strlen(name) + 1;
+    char *name_copy = Allocator::ConstRegionT::Alloc<char>(name_size);
+    std::memcpy(name_copy, name, name_size);
+    module->SetName(name_copy);
+    auto *bound_insts = Allocator::ConstRegionT::Alloc<InstDecoder::BoundInst>(module->GetCodeSize());
+    Verifier(module, bound_insts).Run();
+    module->SetBoundInsts(bound_insts);
+    next_map_addr_ = AlignUp(next_map_addr_ + module->GetFileSize(), PAGE_SIZE);
+    modules_[n_modules_++] = module;
+    LOG_DEBUG(RUNTIME, "Module `" << name << "` is loaded from '" << fn << "' (pc " << module->GetBasePc() << ")");
+    return module;
+}
+
+Module *ModuleTable::Find(const char *name) const
+{
+    for (size_t i = 0; i < n_modules_; i++) {
+        if (std::strcmp(modules_[i]->GetName(), name) == 0) {
+            return modules_[i];
+        }
+    }
+    return nullptr;
+}
+
+Module *ModuleTable::FindByPc(size_t pc) const
+{
+    // Modules are sorted by base pc, as they are mapped at increasing addresses:
+    auto *begin = modules_.data();
+    auto *end = begin + n_modules_;
+    auto *next = std::upper_bound(begin, end, pc, [](size_t key, const Module *module) {
+        return key < module->GetBasePc();
+    });
+    if (next == begin) {
+        return nullptr;
+    }
+    auto *module = *(next - 1);
+    return module->ContainsPc(pc) ? module : nullptr;
+}
+
+void ModuleTable::Link(Module *module, uint8_t constant_pool_id, const char *module_path)
+{
+    auto *pool = module->GetConstantPool();
+    const auto *import = pool->GetImport(constant_pool_id);
+    ASSERT(import != nullptr);
+    const char *module_name = pool->GetString(import->module);
+    const char *symbol = pool->GetString(import->symbol);
+
+    auto *imported = Find(module_name);
+    if (imported == nullptr) {
+        auto path = std::string(module_path) + "/" + module_name + MODULE_FILE_EXTENSION;
+        imported = Load(path.c_str(), module_name);
+        if (imported == nullptr) {
+            LOG_FATAL(RUNTIME, "Can't load module `" << module_name << "` imported by `" << module->GetName() << "`");
+        }
+    }
+    uint8_t export_id = 0;
+    if (!imported->FindExport(symbol, &export_id)) {
+        LOG_FATAL(RUNTIME, "Module `" << module_name << "` doesn't export `" << symbol << "`");
+    }
+
+    auto *imported_pool = imported->GetConstantPool();
+    switch (imported_pool->GetElement(export_id).type_) {
+    case Register::Type::FUNC:
+        pool->SetImportedFunction(constant_pool_id, imported_pool->GetFunctionBytecodeOffset(export_id));
+        break;
+    case Register::Type::OBJ: {
+        const auto *mapping = imported_pool->GetMappingForObjAt(export_id);
+        pool->SetImportedObject(constant_pool_id, *mapping, imported_pool->GetElement(export_id).val_);
+        break;
+    }
+    default:
+        LOG_FATAL(RUNTIME, "Export `" << symbol << "` of module `" << module_name << "` isn't a function or an object");
+    }
+}
+
+}  // namespace k3s
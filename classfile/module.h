@@ -0,0 +1,181 @@
+#ifndef CLASSFILE_MODULE_H
+#define CLASSFILE_MODULE_H
+
+#include "classfile/class_file.h"
+#include "allocator/allocator.h"
+#include "interpreter/generated/inst_decoder.h"
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+namespace k3s {
+
+/**
+ * Loaded class file. Pcs of all modules are counted from the code of the main module: modules are mapped one
+ * after another into the class file range reserved by `Allocator`, so a pc identifies both the module and
+ * the instruction, and functions of different modules may call each other.
+ */
+class Module {
+public:
+    void SetClassFile(const ClassFileHeader *header, size_t file_size, const BytecodeInstruction *code,
+                      size_t code_size, size_t base_pc, const char *string_table)
+    {
+        header_ = header;
+        file_size_ = file_size;
+        code_ = code;
+        code_size_ = code_size;
+        base_pc_ = base_pc;
+        string_table_ = string_table;
+    }
+
+    void SetExports(const ExportRecord *exports, size_t n_exports)
+    {
+        exports_ = exports;
+        n_exports_ = n_exports;
+    }
+
+    void SetName(const char *name)
+    {
+        name_ = name;
+    }
+
+    const char *GetName() const
+    {
+        return name_;
+    }
+
+    const ClassFileHeader *GetHeader() const
+    {
+        return header_;
+    }
+
+    size_t GetFileSize() const
+    {
+        return file_size_;
+    }
+
+    const BytecodeInstruction *GetCode() const
+    {
+        return code_;
+    }
+
+    size_t GetCodeSize() const
+    {
+        return code_size_;
+    }
+
+    /// Instructions bound by `Verifier`, indexed by pcs relative to the module.
+    void SetBoundInsts(const InstDecoder::BoundInst *bound_insts)
+    {
+        bound_insts_ = bound_insts;
+    }
+
+    const InstDecoder::BoundInst *GetBoundInsts() const
+    {
+        return bound_insts_;
+    }
+
+    bool HasEntryPoint() const
+    {
+        return header_->entry_point != NO_ENTRY_POINT;
+    }
+
+    size_t GetEntryPc() const
+    {
+        ASSERT(HasEntryPoint());
+        return base_pc_ + header_->entry_point;
+    }
+
+    size_t GetBasePc() const
+    {
+        return base_pc_;
+    }
+
+    bool ContainsPc(size_t pc) const
+    {
+        return (pc >= base_pc_) && (pc - base_pc_ < code_size_);
+    }
+
+    ConstantPool *GetConstantPool()
+    {
+        return &constant_pool_;
+    }
+
+    StackMaps *GetStackMaps()
+    {
+        return &stack_maps_;
+    }
+
+    FunctionTable *GetFunctions()
+    {
+        return &functions_;
+    }
+
+    /// Returns false if the module doesn't export \p symbol.
+    bool FindExport(const char *symbol, uint8_t *constant_pool_id) const;
+
+private:
+    const char *name_ {};
+    const ClassFileHeader *header_ {};
+    size_t file_size_ {};
+    const BytecodeInstruction *code_ {};
+    size_t code_size_ {};
+    size_t base_pc_ {};
+    const char *string_table_ {};
+    const InstDecoder::BoundInst *bound_insts_ {};
+    const ExportRecord *exports_ {};
+    size_t n_exports_ {};
+    ConstantPool constant_pool_ {};
+    StackMaps stack_maps_ {};
+    FunctionTable functions_ {};
+};
+
+/**
+ * Modules of the program, the first one is the main module. A module is loaded when one of its symbols is used
+ * for the first time: imports of the constant pool are resolved by the first `ldai`, so code which is never
+ * reached doesn't load its dependencies.
+ */
+class ModuleTable {
+public:
+    static constexpr size_t MAX_MODULES = 256U;
+    static constexpr const char *MODULE_FILE_EXTENSION = ".k3sm";
+
+    /// Loads module \p name from \p fn, returns nullptr if the file is malformed or there is no space left.
+    Module *Load(const char *fn, const char *name);
+
+    /// Resolves the import at \p constant_pool_id of \p module, the imported module is loaded
+    /// from \p module_path unless it is loaded already.
+    void Link(Module *module, uint8_t constant_pool_id, const char *module_path);
+
+    Module *GetMain()
+    {
+        ASSERT(n_modules_ != 0);
+        return modules_[0];
+    }
+
+    /// Returns the module which contains \p pc or nullptr if \p pc is out of code.
+    Module *FindByPc(size_t pc) const;
+
+    uint32_t GetLiveMask(size_t pc) const
+    {
+        auto *module = FindByPc(pc);
+        return (module != nullptr) ? module->GetStackMaps()->GetLiveMask(pc) : StackMaps::ALL_LIVE;
+    }
+
+    size_t Size() const
+    {
+        return n_modules_;
+    }
+
+private:
+    Module *Find(const char *name) const;
+
+private:
+    std::array<Module *, MAX_MODULES> modules_ {};
+    size_t n_modules_ {};
+    uintptr_t next_map_addr_ {Allocator::CLASS_FILE_ADDR};
+};
+
+}  // namespace k3s
+
+#endif  // CLASSFILE_MODULE_H
@@ -0,0 +1,234 @@
+#include "classfile/verifier.h"
+#include "classfile/module.h"
+#include "common/macro.h"
+#include <algorithm>
+#include <deque>
+
+namespace k3s {
+
+namespace {
+
+// State index of far registers, which aren't tracked:
+constexpr size_t UNTRACKED_IDX = ~size_t(0);
+
+}  // namespace
+
+Verifier::Verifier(Module *module, InstDecoder::BoundInst *bound_insts)
+    : module_(module), code_(module->GetCode()), bound_insts_(bound_insts)
+{
+}
+
+void Verifier::Run()
+{
+    size_t n_insts = module_->GetCodeSize();
+    std::fill_n(bound_insts_, n_insts, InstDecoder::BoundInst {InstDecoder::UNBOUND, 0, 0});
+    auto *functions = module_->GetFunctions();
+    bool is_verified = true;
+    for (size_t i = 0; (i < functions->Size()) && is_verified; i++) {
+        const auto &record = (*functions)[i];
+        size_t begin = record.entry_pc;
+        size_t end = begin + record.code_size;
+        if ((begin >= end) || (end > n_insts) || !VerifyFunction(begin, end)) {
+            LOG_DEBUG(VERIFIER, "`" << functions->GetName(record) << "` leaves its code, the module is resolved at run time");
+            is_verified = false;
+        }
+    }
+    if (!is_verified) {
+        // Such a function may reach bound instructions of other functions with registers of unexpected types:
+        std::fill_n(bound_insts_, n_insts, InstDecoder::BoundInst {InstDecoder::UNBOUND, 0, 0});
+        n_bound_ = 0;
+    }
+    LOG_DEBUG(VERIFIER, "Module `" << module_->GetName() << "`: " << n_bound_ << " of " << n_insts
+              << " instructions are bound");
+}
+
+bool Verifier::VerifyFunction(size_t begin, size_t end)
+{
+    std::vector<State> states(end - begin);
+    std::vector<bool> is_reached(end - begin, false);
+    std::vector<bool> is_queued(end - begin, false);
+    // Registers of a new frame are null:
+    states[0].fill(GetTypeBit(Register::Type::ANY));
+    is_reached[0] = true;
+    std::deque<size_t> worklist {begin};
+
+    while (!worklist.empty()) {
+        size_t pc = worklist.front();
+        worklist.pop_front();
+        is_queued[pc - begin] = false;
+
+        const auto &inst = code_[pc];
+        State out {};
+        if (!Transfer(pc, InstTypes::Get(inst.GetOpcode()), states[pc - begin], &out)) {
+            continue;
+        }
+        auto flow = InstDataflow::Get(inst).flow;
+        size_t succs[2];
+        size_t n_succs = 0;
+        if ((flow == InstDataflow::Flow::NEXT) || (flow == InstDataflow::Flow::BRANCH)) {
+            succs[n_succs++] = pc + 1;
+        }
+        if ((flow == InstDataflow::Flow::JUMP) || (flow == InstDataflow::Flow::BRANCH)) {
+            succs[n_succs++] = pc + bit_cast<int8_t>(inst.GetOperands());
+        }
+        for (size_t i = 0; i < n_succs; i++) {
+            // Unsigned wrap around makes targets before the function large too:
+            if ((succs[i] < begin) || (succs[i] >= end)) {
+                return false;
+            }
+            size_t idx = succs[i] - begin;
+            bool changed = !is_reached[idx];
+            for (size_t reg = 0; reg < out.size(); reg++) {
+                TypeMask merged = is_reached[idx] ? (states[idx][reg] | out[reg]) : out[reg];
+                changed |= (merged != states[idx][reg]);
+                states[idx][reg] = merged;
+            }
+            is_reached[idx] = true;
+            if (changed && !is_queued[idx]) {
+                is_queued[idx] = true;
+                worklist.push_back(succs[i]);
+            }
+        }
+    }
+
+    for (size_t pc = begin; pc < end; pc++) {
+        if (!is_reached[pc - begin]) {
+            continue;
+        }
+        size_t overload = ResolveOverload(pc, InstTypes::Get(code_[pc].GetOpcode()), states[pc - begin]);
+        if (overload != NO_OVERLOAD) {
+            Bind(pc, overload);
+        }
+    }
+    return true;
+}
+
+bool Verifier::Transfer(size_t pc, const InstTypes &types, const State &in, State *out) const
+{
+    bool may_execute = false;
+    for (size_t i = 0; i < types.n_overloads; i++) {
+        const auto &overload = types.overloads[i];
+        bool must_match = false;
+        if (!MayMatch(pc, overload, in, &must_match)) {
+            continue;
+        }
+        auto state = in;
+        for (size_t j = 0; j < overload.n_outputs; j++) {
+            const auto &output = overload.outputs[j];
+            TypeMask types_mask = ALL_TYPES;
+            if (code_[pc].GetOpcode() == Opcode::LDAI) {
+                types_mask = GetConstantTypes(code_[pc].GetOperands());
+            } else if (output.type != Register::Type::ANY) {
+                types_mask = GetTypeBit(output.type);
+            } else if ((overload.n_inputs == 1) && (overload.inputs[0].type == Register::Type::ANY)) {
+                // `lda`, `sta` and `mov` copy the value with its type:
+                types_mask = GetOperandTypes(pc, overload.inputs[0].location, in);
+            }
+            size_t idx = GetStateIdx(pc, output.location);
+            if (idx != UNTRACKED_IDX) {
+                state[idx] = types_mask;
+            }
+        }
+        for (size_t reg = 0; reg < state.size(); reg++) {
+            (*out)[reg] |= state[reg];
+        }
+        may_execute = true;
+        // Later overloads are never selected:
+        if (must_match) {
+            break;
+        }
+    }
+    return may_execute;
+}
+
+size_t Verifier::ResolveOverload(size_t pc, const InstTypes &types, const State &state) const
+{
+    for (size_t i = 0; i < types.n_overloads; i++) {
+        bool must_match = false;
+        if (MayMatch(pc, types.overloads[i], state, &must_match)) {
+            return must_match ? i : NO_OVERLOAD;
+        }
+    }
+    // No overload matches, the decoder reports the error at run time:
+    return NO_OVERLOAD;
+}
+
+void Verifier::Bind(size_t pc, size_t overload)
+{
+    const auto &inst = code_[pc];
+    auto &bound = bound_insts_[pc];
+    bound.dispatch_idx = (static_cast<size_t>(inst.GetOpcode()) << InstDecoder::MAX_OPC_OVERLOAD_SIZE_BITS) | overload;
+    switch (InstDataflow::Get(inst).operands) {
+    case InstDataflow::Operands::NEAR_REGS:
+        bound.first_reg = inst.GetOperands() & InstDecoder::FIRST_NEAR_REG_MASK;
+        bound.second_operand = inst.GetOperands() >> InstDecoder::SECOND_NEAR_REG_SHIFT;
+        break;
+    case InstDataflow::Operands::NEAR_REG_IMM:
+        bound.first_reg = inst.GetOperands() & InstDecoder::FIRST_NEAR_REG_MASK;
+        bound.second_operand = bit_cast<uint8_t>(InstDecoder::GetSmallImm(inst.GetOperands()));
+        break;
+    case InstDataflow::Operands::FAR_REG:
+        bound.first_reg = inst.GetOperands();
+        break;
+    case InstDataflow::Operands::IMM:
+        bound.second_operand = inst.GetOperands();
+        break;
+    default:
+        break;
+    }
+    n_bound_++;
+}
+
+bool Verifier::MayMatch(size_t pc, const InstTypes::Overload &overload, const State &state, bool *must_match) const
+{
+    bool may_match = true;
+    *must_match = true;
+    for (size_t i = 0; i < overload.n_inputs; i++) {
+        const auto &input = overload.inputs[i];
+        TypeMask accepted = (input.type == Register::Type::ANY) ? ALL_TYPES : GetTypeBit(input.type);
+        TypeMask possible = GetOperandTypes(pc, input.location, state);
+        may_match &= (possible & accepted) != 0;
+        *must_match &= (possible & ~accepted) == 0;
+    }
+    return may_match;
+}
+
+Verifier::TypeMask Verifier::GetOperandTypes(size_t pc, uint8_t location, const State &state) const
+{
+    size_t idx = GetStateIdx(pc, location);
+    return (idx != UNTRACKED_IDX) ? state[idx] : ALL_TYPES;
+}
+
+// Imports are resolved to functions or objects, see `ModuleTable::Link`:
+Verifier::TypeMask Verifier::GetConstantTypes(uint8_t constant_pool_id) const
+{
+    const auto *pool = module_->GetConstantPool();
+    if (pool->GetImport(constant_pool_id) != nullptr) {
+        return GetTypeBit(Register::Type::FUNC) | GetTypeBit(Register::Type::OBJ);
+    }
+    auto type = pool->GetElement(constant_pool_id).type_;
+    return (type != Register::Type::ANY) ? GetTypeBit(type) : ALL_TYPES;
+}
+
+size_t Verifier::GetStateIdx(size_t pc, uint8_t location) const
+{
+    if (location == InstTypes::ACC) {
+        return ACC_IDX;
+    }
+    const auto &inst = code_[pc];
+    size_t reg = 0;
+    auto operands = InstDataflow::Get(inst).operands;
+    if (operands == InstDataflow::Operands::NEAR_REGS) {
+        reg = (location == 0) ? (inst.GetOperands() & InstDecoder::FIRST_NEAR_REG_MASK)
+                              : (inst.GetOperands() >> InstDecoder::SECOND_NEAR_REG_SHIFT);
+    } else if (operands == InstDataflow::Operands::NEAR_REG_IMM) {
+        ASSERT(location == 0);
+        reg = inst.GetOperands() & InstDecoder::FIRST_NEAR_REG_MASK;
+    } else {
+        ASSERT(location == 0);
+        reg = inst.GetOperands();
+    }
+    return (reg < InstDataflow::N_REGS) ? reg : UNTRACKED_IDX;
+}
+
+}  // namespace k3s
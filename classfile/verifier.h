@@ -0,0 +1,73 @@
+#ifndef CLASSFILE_VERIFIER_H
+#define CLASSFILE_VERIFIER_H
+
+#include "interpreter/generated/inst_dataflow.h"
+#include "interpreter/generated/inst_types.h"
+#include "interpreter/bytecode_instruction.h"
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace k3s {
+
+class Module;
+
+/**
+ * Load-time type inference. Types which the accumulator and near registers may hold are computed for each pc of
+ * a function by abstract interpretation over its control flow graph: a frame starts with null registers, overloads
+ * of isa.yaml give types of outputs (an `ANY` output is unknown, unless the overload just copies its single `ANY`
+ * input), `ldai` gives the type of the constant. An instruction gets a static overload when every possible type
+ * of its inputs resolves to it: the instruction is bound to the handler of the overload with its operands decoded,
+ * so the interpreter neither decodes it nor checks types. Polymorphic instructions and far registers are resolved
+ * at run time as before. So is the whole module if control flow of any function leaves it, though the assembler
+ * never emits such jumps.
+ */
+class Verifier {
+public:
+    /// Instructions are bound to \p bound_insts, indexed by pcs relative to the module.
+    Verifier(Module *module, InstDecoder::BoundInst *bound_insts);
+
+    void Run();
+
+    size_t GetBoundCount() const
+    {
+        return n_bound_;
+    }
+
+private:
+    using TypeMask = uint8_t;
+    static constexpr size_t NO_OVERLOAD = ~size_t(0);
+    // Possible types of near registers, then of the accumulator:
+    static constexpr size_t ACC_IDX = InstDataflow::N_REGS;
+    using State = std::array<TypeMask, ACC_IDX + 1>;
+
+    static constexpr TypeMask GetTypeBit(Register::Type type)
+    {
+        return TypeMask(1) << static_cast<size_t>(type);
+    }
+    // `ANY` is the last type:
+    static constexpr TypeMask ALL_TYPES = (TypeMask(1) << (static_cast<size_t>(Register::Type::ANY) + 1)) - 1;
+
+    bool VerifyFunction(size_t begin, size_t end);
+    // Returns false if no overload matches, i.e. the instruction always fails:
+    bool Transfer(size_t pc, const InstTypes &types, const State &in, State *out) const;
+    // Returns the overload which is selected for every possible type of inputs or `NO_OVERLOAD`:
+    size_t ResolveOverload(size_t pc, const InstTypes &types, const State &state) const;
+    void Bind(size_t pc, size_t overload);
+    bool MayMatch(size_t pc, const InstTypes::Overload &overload, const State &state, bool *must_match) const;
+    TypeMask GetOperandTypes(size_t pc, uint8_t location, const State &state) const;
+    TypeMask GetConstantTypes(uint8_t constant_pool_id) const;
+    // Returns the index of the operand at \p location in `State`:
+    size_t GetStateIdx(size_t pc, uint8_t location) const;
+
+private:
+    Module *module_;
+    const BytecodeInstruction *code_;
+    InstDecoder::BoundInst *bound_insts_;
+    size_t n_bound_ {};
+};
+
+}  // namespace k3s
+
+#endif  // CLASSFILE_VERIFIER_H
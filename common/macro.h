@@ -32,6 +32,9 @@
 #endif  // NDEBUG
 
 
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+
 #define BIT_CAST(type, var) \
 
 template <typename T1, typename T2>
@@ -42,5 +45,9 @@ T1 bit_cast(T2 val) {
     return temp;
 }
 
+constexpr size_t AlignUp(size_t val, size_t alignment)
+{
+    return (val + alignment - 1) / alignment * alignment;
+}
 
 #endif  // COMMON_MACRO_H
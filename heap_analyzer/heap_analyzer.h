@@ -0,0 +1,440 @@
+#ifndef HEAP_ANALYZER_HEAP_ANALYZER_H
+#define HEAP_ANALYZER_HEAP_ANALYZER_H
+
+#include "allocator/heap_snapshot.h"
+#include "allocator/object_header.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <iomanip>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace k3s {
+
+/**
+ * Object graph of a heap snapshot. Node 0 is a virtual root which references every root of the snapshot.
+ *
+ * Immediate dominators are computed by the Lengauer-Tarjan algorithm (with path compression) over the nodes
+ * reachable from the virtual root, the retained size of a node is the total size of its dominator subtree.
+ * Traversals are iterative, so long chains of objects don't overflow the stack.
+ */
+class HeapAnalyzer
+{
+public:
+    static constexpr uint32_t NONE = ~uint32_t(0);
+    static constexpr uint32_t ROOT = 0;
+
+    struct Node
+    {
+        uint64_t address {0};
+        ObjectHeader::Type type {};
+        uint32_t site_id {0};
+        uint64_t size {0};
+        uint64_t retained {0};
+        uint32_t idom {NONE};
+    };
+
+    // Returns false and describes the problem in `error` if the snapshot is malformed:
+    bool Load(std::istream &is, std::string *error)
+    {
+        heap_snapshot::Reader reader(is);
+        if (!reader.ReadMagic()) {
+            *error = "not a heap snapshot";
+            return false;
+        }
+        nodes_.emplace_back();
+        std::vector<uint64_t> root_addresses;
+        std::vector<uint64_t> ref_addresses;
+        std::vector<uint32_t> ref_counts {0};
+        heap_snapshot::Tag tag {};
+        uint64_t n_objects = 0;
+        uint64_t total_size = 0;
+        while (true) {
+            if (!reader.ReadTag(&tag)) {
+                *error = "unexpected end of the snapshot";
+                return false;
+            }
+            if (tag == heap_snapshot::Tag::END) {
+                if (!reader.ReadUint(&n_objects) || !reader.ReadUint(&total_size)) {
+                    *error = "truncated record";
+                    return false;
+                }
+                if (n_objects + 1 != nodes_.size()) {
+                    *error = "number of objects doesn't match";
+                    return false;
+                }
+                break;
+            }
+            bool is_ok = true;
+            if (tag == heap_snapshot::Tag::SITE) {
+                uint64_t site_id = 0;
+                uint64_t pc = 0;
+                is_ok = reader.ReadUint(&site_id) && reader.ReadUint(&pc);
+                site_pcs_[site_id] = pc;
+            } else if (tag == heap_snapshot::Tag::ROOT) {
+                uint64_t address = 0;
+                is_ok = reader.ReadUint(&address);
+                root_addresses.push_back(address);
+            } else {
+                auto &node = nodes_.emplace_back();
+                uint64_t type = 0;
+                uint64_t site_id = 0;
+                uint64_t n_refs = 0;
+                is_ok = reader.ReadUint(&node.address) && reader.ReadUint(&type) && reader.ReadUint(&site_id) &&
+                        reader.ReadUint(&node.size) && reader.ReadUint(&n_refs);
+                if (is_ok && ((type < static_cast<uint64_t>(ObjectHeader::Type::STRING)) ||
+                              (type > static_cast<uint64_t>(ObjectHeader::Type::OBJECT)))) {
+                    *error = "unexpected object type";
+                    return false;
+                }
+                node.type = static_cast<ObjectHeader::Type>(type);
+                node.site_id = site_id;
+                for (uint64_t i = 0; is_ok && (i < n_refs); i++) {
+                    is_ok = reader.ReadUint(&ref_addresses.emplace_back());
+                }
+                ref_counts.push_back(n_refs);
+                addresses_[node.address] = nodes_.size() - 1;
+            }
+            if (!is_ok) {
+                *error = "truncated record";
+                return false;
+            }
+        }
+
+        // Edges of the virtual root go first:
+        edges_begin_.push_back(0);
+        for (auto address : root_addresses) {
+            AddEdge(address);
+        }
+        edges_begin_.push_back(edges_.size());
+        size_t ref_idx = 0;
+        for (size_t node_idx = 1; node_idx < nodes_.size(); node_idx++) {
+            for (uint32_t i = 0; i < ref_counts[node_idx]; i++) {
+                AddEdge(ref_addresses[ref_idx++]);
+            }
+            edges_begin_.push_back(edges_.size());
+        }
+        return true;
+    }
+
+    void ComputeDominators()
+    {
+        NumberNodes();
+        std::vector<std::vector<uint32_t>> preds(order_.size());
+        for (uint32_t dfs_idx = 0; dfs_idx < order_.size(); dfs_idx++) {
+            VisitSuccessors(order_[dfs_idx], [&](uint32_t succ) {
+                preds[dfs_idx_[succ]].push_back(dfs_idx);
+            });
+        }
+
+        // All of the following arrays are indexed by DFS numbers:
+        size_t n_reachable = order_.size();
+        std::vector<uint32_t> semi(n_reachable);
+        std::vector<uint32_t> idom(n_reachable, NONE);
+        std::vector<uint32_t> ancestor(n_reachable, NONE);
+        std::vector<uint32_t> label(n_reachable);
+        std::vector<std::vector<uint32_t>> bucket(n_reachable);
+        for (uint32_t v = 0; v < n_reachable; v++) {
+            semi[v] = v;
+            label[v] = v;
+        }
+        std::vector<uint32_t> path;
+        auto eval = [&](uint32_t v) {
+            if (ancestor[v] == NONE) {
+                return v;
+            }
+            // Compresses the path to the root of the forest:
+            for (uint32_t u = v; ancestor[ancestor[u]] != NONE; u = ancestor[u]) {
+                path.push_back(u);
+            }
+            while (!path.empty()) {
+                uint32_t u = path.back();
+                path.pop_back();
+                uint32_t a = ancestor[u];
+                if (semi[label[a]] < semi[label[u]]) {
+                    label[u] = label[a];
+                }
+                ancestor[u] = ancestor[a];
+            }
+            return label[v];
+        };
+
+        for (uint32_t w = n_reachable - 1; w > 0; w--) {
+            for (auto v : preds[w]) {
+                uint32_t u = eval(v);
+                semi[w] = std::min(semi[w], semi[u]);
+            }
+            bucket[semi[w]].push_back(w);
+            uint32_t parent = parents_[w];
+            ancestor[w] = parent;
+            for (auto v : bucket[parent]) {
+                uint32_t u = eval(v);
+                idom[v] = (semi[u] < semi[v]) ? u : parent;
+            }
+            bucket[parent].clear();
+        }
+        for (uint32_t w = 1; w < n_reachable; w++) {
+            if (idom[w] != semi[w]) {
+                idom[w] = idom[idom[w]];
+            }
+        }
+
+        // Dominators precede the nodes they dominate in DFS order:
+        for (uint32_t w = 0; w < n_reachable; w++) {
+            nodes_[order_[w]].retained = nodes_[order_[w]].size;
+            nodes_[order_[w]].idom = (w == 0) ? NONE : order_[idom[w]];
+        }
+        for (uint32_t w = n_reachable - 1; w > 0; w--) {
+            nodes_[order_[idom[w]]].retained += nodes_[order_[w]].retained;
+        }
+    }
+
+    const std::vector<Node> &GetNodes() const
+    {
+        return nodes_;
+    }
+
+    void WriteReport(std::ostream &os, size_t top, size_t max_depth) const
+    {
+        uint64_t total_size = 0;
+        for (size_t i = 1; i < nodes_.size(); i++) {
+            total_size += nodes_[i].size;
+        }
+        uint64_t reachable_size = nodes_[ROOT].retained;
+        os << "Heap snapshot: " << nodes_.size() - 1 << " objects, " << total_size << " bytes\n";
+        os << "  reachable: " << order_.size() - 1 << " objects, " << reachable_size << " bytes\n";
+        os << "  unreachable: " << nodes_.size() - order_.size() << " objects, " << total_size - reachable_size << " bytes\n";
+        os << "  roots: " << edges_begin_[1] << ", unresolved references: " << n_unresolved_ << "\n";
+
+        os << "\nTop retainers by type:\n";
+        WriteGroups(os, top, [](const Node &node) {
+            return static_cast<uint64_t>(node.type);
+        }, [](const Node &node) {
+            return std::string(GetTypeName(node.type));
+        });
+
+        os << "\nTop retainers by allocation site:\n";
+        WriteGroups(os, top, [](const Node &node) {
+            return (uint64_t(node.site_id) << 8U) | static_cast<uint64_t>(node.type);
+        }, [this](const Node &node) {
+            return std::string(GetTypeName(node.type)) + " at " + GetSiteName(node.site_id);
+        });
+
+        os << "\nTop objects by retained size:\n";
+        std::vector<uint32_t> objects;
+        for (size_t dfs_idx = 1; dfs_idx < order_.size(); dfs_idx++) {
+            objects.push_back(order_[dfs_idx]);
+        }
+        size_t n_shown = std::min(top, objects.size());
+        std::partial_sort(objects.begin(), objects.begin() + n_shown, objects.end(), [this](uint32_t lhs, uint32_t rhs) {
+            return nodes_[lhs].retained > nodes_[rhs].retained;
+        });
+        os << std::setw(14) << "retained" << std::setw(14) << "shallow" << "  object\n";
+        for (size_t i = 0; i < n_shown; i++) {
+            const auto &node = nodes_[objects[i]];
+            os << std::setw(14) << node.retained << std::setw(14) << node.size << "  " << GetNodeName(node) << "\n";
+        }
+
+        os << "\nDominator tree (up to depth " << max_depth << ", nodes retaining at least 1% of the reachable heap):\n";
+        WriteDominatorTree(os, max_depth, reachable_size / 100);
+    }
+
+    static const char *GetTypeName(ObjectHeader::Type type)
+    {
+        switch (type) {
+        case ObjectHeader::Type::STRING:
+            return "String";
+        case ObjectHeader::Type::FUNCTION:
+            return "Function";
+        case ObjectHeader::Type::ARRAY:
+            return "Array";
+        case ObjectHeader::Type::OBJECT:
+            return "Object";
+        default:
+            return "Unknown";
+        }
+    }
+
+private:
+    void AddEdge(uint64_t address)
+    {
+        auto it = addresses_.find(address);
+        if (it == addresses_.end()) {
+            n_unresolved_++;
+            return;
+        }
+        edges_.push_back(it->second);
+    }
+
+    template <typename VisitorFn>
+    void VisitSuccessors(uint32_t node, VisitorFn visitor) const
+    {
+        for (size_t i = edges_begin_[node]; i < edges_begin_[node + 1]; i++) {
+            visitor(edges_[i]);
+        }
+    }
+
+    // Numbers nodes reachable from the root in DFS preorder and records parents of the DFS tree:
+    void NumberNodes()
+    {
+        dfs_idx_.assign(nodes_.size(), NONE);
+        order_.clear();
+        parents_.clear();
+        // Pairs of a node and the index of its next edge:
+        std::vector<std::pair<uint32_t, size_t>> stack;
+        dfs_idx_[ROOT] = 0;
+        order_.push_back(ROOT);
+        parents_.push_back(NONE);
+        stack.emplace_back(ROOT, edges_begin_[ROOT]);
+        while (!stack.empty()) {
+            auto &[node, edge_idx] = stack.back();
+            if (edge_idx == edges_begin_[node + 1]) {
+                stack.pop_back();
+                continue;
+            }
+            uint32_t succ = edges_[edge_idx++];
+            if (dfs_idx_[succ] != NONE) {
+                continue;
+            }
+            uint32_t parent_dfs_idx = dfs_idx_[node];
+            dfs_idx_[succ] = order_.size();
+            order_.push_back(succ);
+            parents_.push_back(parent_dfs_idx);
+            stack.emplace_back(succ, edges_begin_[succ]);
+        }
+    }
+
+    // Children of each node in the dominator tree, sorted by retained size:
+    std::vector<std::vector<uint32_t>> GetDominatorTree() const
+    {
+        std::vector<std::vector<uint32_t>> children(nodes_.size());
+        for (size_t dfs_idx = 1; dfs_idx < order_.size(); dfs_idx++) {
+            children[nodes_[order_[dfs_idx]].idom].push_back(order_[dfs_idx]);
+        }
+        for (auto &node_children : children) {
+            std::sort(node_children.begin(), node_children.end(), [this](uint32_t lhs, uint32_t rhs) {
+                return nodes_[lhs].retained > nodes_[rhs].retained;
+            });
+        }
+        return children;
+    }
+
+    /**
+     * Objects are grouped by `get_key(node)`. Retained size of a group counts only its members which aren't
+     * dominated by other members, so memory retained by nested members isn't counted twice.
+     */
+    template <typename GetKeyFn, typename GetNameFn>
+    void WriteGroups(std::ostream &os, size_t top, GetKeyFn get_key, GetNameFn get_name) const
+    {
+        struct Group
+        {
+            std::string name;
+            size_t count {0};
+            uint64_t shallow {0};
+            uint64_t retained {0};
+        };
+        std::unordered_map<uint64_t, Group> groups;
+        std::unordered_map<uint64_t, size_t> n_active;
+        auto children = GetDominatorTree();
+        // Pairs of a node and the index of its next child, the node is exited when all children are visited:
+        std::vector<std::pair<uint32_t, size_t>> stack;
+        stack.emplace_back(ROOT, 0);
+        while (!stack.empty()) {
+            auto &[node, child_idx] = stack.back();
+            if (child_idx == children[node].size()) {
+                if (node != ROOT) {
+                    n_active[get_key(nodes_[node])]--;
+                }
+                stack.pop_back();
+                continue;
+            }
+            uint32_t child = children[node][child_idx++];
+            const auto &child_node = nodes_[child];
+            auto key = get_key(child_node);
+            auto &group = groups[key];
+            if (group.count == 0) {
+                group.name = get_name(child_node);
+            }
+            group.count++;
+            group.shallow += child_node.size;
+            if (n_active[key]++ == 0) {
+                group.retained += child_node.retained;
+            }
+            stack.emplace_back(child, 0);
+        }
+
+        std::vector<const Group *> sorted;
+        for (const auto &[key, group] : groups) {
+            sorted.push_back(&group);
+        }
+        size_t n_shown = std::min(top, sorted.size());
+        std::partial_sort(sorted.begin(), sorted.begin() + n_shown, sorted.end(), [](const Group *lhs, const Group *rhs) {
+            return lhs->retained > rhs->retained;
+        });
+        os << std::setw(10) << "count" << std::setw(14) << "shallow" << std::setw(14) << "retained" << "  group\n";
+        for (size_t i = 0; i < n_shown; i++) {
+            os << std::setw(10) << sorted[i]->count << std::setw(14) << sorted[i]->shallow << std::setw(14)
+               << sorted[i]->retained << "  " << sorted[i]->name << "\n";
+        }
+    }
+
+    void WriteDominatorTree(std::ostream &os, size_t max_depth, uint64_t min_retained) const
+    {
+        auto children = GetDominatorTree();
+        std::vector<std::pair<uint32_t, size_t>> stack;
+        stack.emplace_back(ROOT, 0);
+        while (!stack.empty()) {
+            auto [node, depth] = stack.back();
+            stack.pop_back();
+            os << std::string(2 * (depth + 1), ' ') << ((node == ROOT) ? "<roots>" : GetNodeName(nodes_[node]))
+               << ": retained " << nodes_[node].retained << "\n";
+            if (depth == max_depth) {
+                continue;
+            }
+            // Children are sorted, so they are pushed in reverse order to be printed from the largest:
+            auto &node_children = children[node];
+            for (auto it = node_children.rbegin(); it != node_children.rend(); ++it) {
+                if (nodes_[*it].retained >= min_retained) {
+                    stack.emplace_back(*it, depth + 1);
+                }
+            }
+        }
+    }
+
+    std::string GetSiteName(uint32_t site_id) const
+    {
+        auto it = site_pcs_.find(site_id);
+        return (it != site_pcs_.end()) ? "pc " + std::to_string(it->second) : "unknown site";
+    }
+
+    std::string GetNodeName(const Node &node) const
+    {
+        std::ostringstream name;
+        name << GetTypeName(node.type) << " 0x" << std::hex << node.address << std::dec << " (" << GetSiteName(node.site_id) << ")";
+        return name.str();
+    }
+
+private:
+    std::vector<Node> nodes_;
+    std::unordered_map<uint64_t, uint32_t> addresses_;
+    std::unordered_map<uint64_t, uint64_t> site_pcs_;
+    // Successors of node `i` are edges_[edges_begin_[i]], ..., edges_[edges_begin_[i + 1] - 1]:
+    std::vector<size_t> edges_begin_;
+    std::vector<uint32_t> edges_;
+    size_t n_unresolved_ {0};
+
+    // Reachable nodes in DFS preorder, DFS numbers of nodes (NONE if unreachable) and parents in the DFS tree:
+    std::vector<uint32_t> order_;
+    std::vector<uint32_t> dfs_idx_;
+    std::vector<uint32_t> parents_;
+};
+
+}  // namespace k3s
+
+#endif  // HEAP_ANALYZER_HEAP_ANALYZER_H
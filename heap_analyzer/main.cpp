@@ -0,0 +1,59 @@
+#include "heap_analyzer.h"
+#include "common/macro.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+
+namespace {
+
+// Returns false if the option has another name:
+bool ParseNumber(std::string_view arg, std::string_view flag, size_t *value)
+{
+    if (arg.substr(0, flag.size()) != flag) {
+        return false;
+    }
+    char *end = nullptr;
+    std::string number(arg.substr(flag.size()));
+    *value = std::strtoull(number.c_str(), &end, 10);
+    if (number.empty() || (*end != '\0')) {
+        LOG_FATAL(HEAP_ANALYZER, "Invalid option: '" << arg << "'");
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+    size_t top = 20;
+    size_t max_depth = 4;
+    const char *snapshot_file = nullptr;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg(argv[i]);
+        if (ParseNumber(arg, "--top=", &top) || ParseNumber(arg, "--depth=", &max_depth)) {
+            continue;
+        }
+        if (snapshot_file != nullptr) {
+            LOG_FATAL(HEAP_ANALYZER, "Usage: heap_analyzer [--top=N] [--depth=N] snapshot");
+        }
+        snapshot_file = argv[i];
+    }
+    if (snapshot_file == nullptr) {
+        LOG_FATAL(HEAP_ANALYZER, "Usage: heap_analyzer [--top=N] [--depth=N] snapshot");
+    }
+
+    std::ifstream is(snapshot_file, std::ios::binary);
+    if (!is) {
+        LOG_FATAL(HEAP_ANALYZER, "Error reading file: '" << snapshot_file << "'");
+    }
+    k3s::HeapAnalyzer analyzer;
+    std::string error;
+    if (!analyzer.Load(is, &error)) {
+        LOG_FATAL(HEAP_ANALYZER, "Malformed snapshot '" << snapshot_file << "': " << error);
+    }
+    analyzer.ComputeDominators();
+    analyzer.WriteReport(std::cout, top, max_depth);
+    return 0;
+}
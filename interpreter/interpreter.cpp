@@ -11,10 +11,26 @@ std::ostream &operator<<(std::ostream &os, const BytecodeInstruction &inst)
     return *inst.Dump(&os);
 }
 
+// The old element is read by the write barrier, so indices are checked in release builds too:
+static size_t GetCheckedIndex(coretypes::Array *array, const Register &idx_reg)
+{
+    double idx = idx_reg.GetAsNum();
+    if (!((idx >= 0) && (idx < static_cast<double>(array->GetLength())))) {
+        LOG_FATAL(RUNTIME_ERROR, "Index " << idx << " is out of bounds of array of length " << array->GetLength());
+    }
+    return static_cast<size_t>(idx);
+}
+
+// Instructions which aren't bound at load time are resolved by types of their inputs:
+#define DECODE(inst)                                                                        \
+    (LIKELY(bound_insts_[pc_].dispatch_idx != InstDecoder::UNBOUND)                         \
+        ? decoder.DecodeBound(bound_insts_[pc_])                                            \
+        : decoder.DecodeAndResolve(inst, *this))
+
 #define FETCH_AND_DISPATCH() \
 {                                                                   \
     auto &inst = Fetch();                                           \
-    size_t dispatch_idx = decoder.DecodeAndResolve(inst, *this);    \
+    size_t dispatch_idx = DECODE(inst);                             \
     ASSERT(DISPATCH_TABLE[dispatch_idx] != nullptr);                \
     goto *DISPATCH_TABLE[dispatch_idx];                             \
 }
@@ -23,16 +39,61 @@ std::ostream &operator<<(std::ostream &os, const BytecodeInstruction &inst)
 {                                                                   \
     pc_++;                                                          \
     auto &inst = Fetch();                                           \
-    size_t dispatch_idx = decoder.DecodeAndResolve(inst, *this);    \
+    size_t dispatch_idx = DECODE(inst);                             \
     ASSERT(DISPATCH_TABLE[dispatch_idx] != nullptr);                \
     goto *DISPATCH_TABLE[dispatch_idx];                             \
 }
 
 int Interpreter::Invoke()
 {
-    InstDecoder decoder;
     auto *main_ptr = coretypes::Function::New(Runtime::GetAllocator()->ObjectsRegion(), pc_);
     Runtime::GetInterpreter()->GetStateStack()->emplace_back(-1, main_ptr);
+    UpdateModule();
+    return Run();
+}
+
+int Interpreter::Resume()
+{
+    ASSERT(!state_stack_.empty());
+    UpdateModule();
+    return Run();
+}
+
+void Interpreter::UpdateModule()
+{
+    if ((module_ == nullptr) || !module_->ContainsPc(pc_)) {
+        module_ = Runtime::GetModules()->FindByPc(pc_);
+        ASSERT(module_ != nullptr);
+        bound_insts_ = module_->GetBoundInsts() - module_->GetBasePc();
+    }
+}
+
+const Register &Interpreter::GetFarReg(size_t id) const
+{
+    // Far registers which are never written read as the default value:
+    static const Register UNSET_REG {};
+    size_t idx = state_stack_.back().far_regs_idx_;
+    return (idx != NO_FAR_REGS) ? far_regs_[idx + id - InstDataflow::N_REGS] : UNSET_REG;
+}
+
+Register &Interpreter::GetFarReg(size_t id)
+{
+    ASSERT(id < InstDataflow::MAX_REGS);
+    auto &state = state_stack_.back();
+    if (state.far_regs_idx_ == NO_FAR_REGS) {
+        // Registers are referenced while the frame runs, so the storage can't be moved:
+        if (far_regs_.capacity() - far_regs_.size() < N_FAR_REGS) {
+            LOG_FATAL(INTERPERTER, "Stack overflow: too many frames use far registers");
+        }
+        state.far_regs_idx_ = far_regs_.size();
+        far_regs_.resize(far_regs_.size() + N_FAR_REGS);
+    }
+    return far_regs_[state.far_regs_idx_ + id - InstDataflow::N_REGS];
+}
+
+int Interpreter::Run()
+{
+    InstDecoder decoder;
 
 #include "generated/dispatch_table.inl"
 
@@ -41,26 +102,40 @@ int Interpreter::Invoke()
 
     LDAI:
     {
-        const auto &elem = Runtime::GetConstantPool()->GetElement(decoder.GetImm());
+        auto *constant_pool = module_->GetConstantPool();
+        const auto &elem = constant_pool->GetElement(decoder.GetImm());
         switch (elem.type_) {
             case Type::FUNC: {
-                size_t bc_offs = Runtime::GetConstantPool()->GetFunctionBytecodeOffset(decoder.GetImm());
+                size_t bc_offs = constant_pool->GetFunctionBytecodeOffset(decoder.GetImm());
+                Runtime::GetGC()->BeginSiteAllocation(pc_);
                 auto *ptr = coretypes::Function::New(Runtime::GetAllocator()->ObjectsRegion(), bc_offs);
                 GetAcc().Set(ptr);
+                Runtime::GetGC()->EndSiteAllocation(GetAcc());
                 break;
             } case Type::NUM: {
                 GetAcc().Set(bit_cast<double>(elem.val_)); 
                 break;
             } case Type::STR: {
+                Runtime::GetGC()->BeginSiteAllocation(pc_);
                 auto *ptr = coretypes::String::New(Runtime::GetAllocator()->ObjectsRegion(), reinterpret_cast<const char *>(elem.val_));
                 GetAcc().Set(ptr); 
+                Runtime::GetGC()->EndSiteAllocation(GetAcc());
                 break;
             } case Type::OBJ: {
-                auto *ptr = coretypes::Object::New(Runtime::GetAllocator()->ObjectsRegion(), *Runtime::GetConstantPool()->GetMappingForObjAt(decoder.GetImm()), reinterpret_cast<size_t *>(elem.val_));
+                // The object is decoded on first use, so `elem` is valid only after its mapping is requested:
+                const auto *mapping = constant_pool->GetMappingForObjAt(decoder.GetImm());
+                Runtime::GetGC()->BeginSiteAllocation(pc_);
+                auto *ptr = coretypes::Object::New(Runtime::GetAllocator()->ObjectsRegion(), *mapping, reinterpret_cast<size_t *>(elem.val_));
                 GetAcc().Set(ptr); 
+                Runtime::GetGC()->EndSiteAllocation(GetAcc());
                 break;
             }
             default: {
+                // Imports are resolved on first use, then the instruction is executed again:
+                if (constant_pool->GetImport(decoder.GetImm()) != nullptr) {
+                    Runtime::LinkImport(module_, decoder.GetImm());
+                    FETCH_AND_DISPATCH();
+                }
                 LOG_FATAL(INTERPRETER, "Unknown constant pool element type for index (i = " << static_cast<int64_t>(decoder.GetImm()) << ")" );
             }
         }
@@ -143,7 +218,8 @@ int Interpreter::Invoke()
             // stack contains pc of the call instruction:
             pc_ = Runtime::GetInterpreter()->GetStateStack()->back().caller_pc_;
             pc_++;
-            Runtime::GetInterpreter()->GetStateStack()->pop_back();
+            Runtime::GetInterpreter()->PopFrame();
+            UpdateModule();
         }
         FETCH_AND_DISPATCH();
     }
@@ -167,12 +243,14 @@ int Interpreter::Invoke()
     SETARG0_aFUNC_rANY: {
         auto *func_obj = bit_cast<coretypes::Function *>(GetAcc().GetValue());
         size_t reg_id = decoder.GetFirstReg();
+        Runtime::GetGC()->WriteBarrier(GetAcc(), *func_obj->GetArg<0>(), GetReg(reg_id));
         func_obj->SetArg<0>(GetReg(reg_id));
         ADVANCE_FETCH_AND_DISPATCH();
     }
     SETARG1_aFUNC_rANY: {
         auto *func_obj = bit_cast<coretypes::Function *>(GetAcc().GetValue());
         size_t reg_id = decoder.GetFirstReg();
+        Runtime::GetGC()->WriteBarrier(GetAcc(), *func_obj->GetArg<1>(), GetReg(reg_id));
         func_obj->SetArg<1>(GetReg(reg_id));
         ADVANCE_FETCH_AND_DISPATCH();
     }
@@ -186,16 +264,28 @@ int Interpreter::Invoke()
 
     SETRET0_rANY: {
         size_t reg_id = decoder.GetFirstReg();
-        GetCallee()->SetRet<0>(GetReg(reg_id));
+        Runtime::GetGC()->WriteBarrier(Register(GetRetObj()), *GetRetObj()->GetRet<0>(), GetReg(reg_id));
+        GetRetObj()->SetRet<0>(GetReg(reg_id));
         ADVANCE_FETCH_AND_DISPATCH();
     }
 
     CALL_aFUNC: {
         // return to the caller frame;
         // stack contains pc of the call instruction:
-        auto *func_obj = GetAcc().GetAsFunction(); 
+        auto *func_obj = bit_cast<coretypes::Function *>(GetAcc().GetValue());
         Runtime::GetInterpreter()->GetStateStack()->emplace_back(pc_, func_obj);
         pc_ = func_obj->GetTargetPc();
+        UpdateModule();
+        FETCH_AND_DISPATCH();
+    }
+    TAILCALL_aFUNC: {
+        // The result is left unset if the callee doesn't set it, as after `call; getret0 rX; setret0 rX`:
+        Runtime::GetGC()->WriteBarrier(Register(GetRetObj()), *GetRetObj()->GetRet<0>(), Register());
+        GetRetObj()->SetRet<0>(Register());
+        auto *func_obj = bit_cast<coretypes::Function *>(GetAcc().GetValue());
+        Runtime::GetInterpreter()->ReuseFrame(func_obj);
+        pc_ = func_obj->GetTargetPc();
+        UpdateModule();
         FETCH_AND_DISPATCH();
     }
 
@@ -280,31 +370,81 @@ int Interpreter::Invoke()
         ADVANCE_FETCH_AND_DISPATCH();
     }
 
+    ADDR_rNUM_rNUM: {
+        auto &reg = GetReg(decoder.GetFirstReg());
+        reg.Set(reg.GetAsNum() + GetReg(decoder.GetSecondReg()).GetAsNum());
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
+    SUBR_rNUM_rNUM: {
+        auto &reg = GetReg(decoder.GetFirstReg());
+        reg.Set(reg.GetAsNum() - GetReg(decoder.GetSecondReg()).GetAsNum());
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
+    MULR_rNUM_rNUM: {
+        auto &reg = GetReg(decoder.GetFirstReg());
+        reg.Set(reg.GetAsNum() * GetReg(decoder.GetSecondReg()).GetAsNum());
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
+    DIVR_rNUM_rNUM: {
+        auto &reg = GetReg(decoder.GetFirstReg());
+        if (GetReg(decoder.GetSecondReg()).GetAsNum() == 0) {
+            LOG_FATAL(RUNTIME_ERROR, "Division by Zero");
+        } else {
+            reg.Set(reg.GetAsNum() / GetReg(decoder.GetSecondReg()).GetAsNum());
+        }
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
+    ADDI_rNUM: {
+        auto &reg = GetReg(decoder.GetFirstReg());
+        reg.Set(reg.GetAsNum() + decoder.GetImm());
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
+    INC_rNUM: {
+        auto &reg = GetReg(decoder.GetFirstReg());
+        reg.Set(reg.GetAsNum() + 1.);
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
+    DEC_rNUM: {
+        auto &reg = GetReg(decoder.GetFirstReg());
+        reg.Set(reg.GetAsNum() - 1.);
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
+
     NEWARR_rNUM: {
         size_t reg_id = decoder.GetFirstReg();
         size_t arr_sz = static_cast<size_t>(GetReg(reg_id).GetAsNum());
+        Runtime::GetGC()->BeginSiteAllocation(pc_);
         GetAcc().Set(coretypes::Array::New(Runtime::GetAllocator()->ObjectsRegion(), arr_sz));
+        Runtime::GetGC()->EndSiteAllocation(GetAcc());
         ADVANCE_FETCH_AND_DISPATCH();
     }
     SETELEM_aANY_rARR_rNUM: {
-        size_t idx = static_cast<size_t>(GetReg(decoder.GetSecondReg()).GetAsNum());
-        GetReg(decoder.GetFirstReg()).GetAsArray()->SetElem(idx, GetAcc());
+        auto *array = bit_cast<coretypes::Array *>(GetReg(decoder.GetFirstReg()).GetValue());
+        size_t idx = GetCheckedIndex(array, GetReg(decoder.GetSecondReg()));
+        Runtime::GetGC()->WriteBarrier(GetReg(decoder.GetFirstReg()), *array->GetElem(idx), GetAcc());
+        array->SetElem(idx, GetAcc());
         ADVANCE_FETCH_AND_DISPATCH();
     }
     SETELEM_aANY_rOBJ_rSTR: {
-        auto string = GetReg(decoder.GetSecondReg()).GetAsString();
-        GetReg(decoder.GetFirstReg()).GetAsObject()->SetElem(string->GetData(), GetAcc());
+        auto *string = bit_cast<coretypes::String *>(GetReg(decoder.GetSecondReg()).GetValue());
+        auto *object = bit_cast<coretypes::Object *>(GetReg(decoder.GetFirstReg()).GetValue());
+        auto *field = object->GetElem(string->GetData());
+        Runtime::GetGC()->WriteBarrier(GetReg(decoder.GetFirstReg()), *field, GetAcc());
+        field->Set(GetAcc());
         ADVANCE_FETCH_AND_DISPATCH();
     }
     GETELEM_rARR_rNUM: {
-        size_t idx = static_cast<size_t>(GetReg(decoder.GetSecondReg()).GetAsNum());
-        GetAcc().Set(*GetReg(decoder.GetFirstReg()).GetAsArray()->GetElem(idx));
+        auto *array = bit_cast<coretypes::Array *>(GetReg(decoder.GetFirstReg()).GetValue());
+        size_t idx = GetCheckedIndex(array, GetReg(decoder.GetSecondReg()));
+        GetAcc().Set(*array->GetElem(idx));
         ADVANCE_FETCH_AND_DISPATCH();
     }
     GETELEM_rOBJ_rSTR: {
-        auto string = GetReg(decoder.GetSecondReg()).GetAsString();
-        GetAcc().Set(*GetReg(decoder.GetFirstReg()).GetAsObject()->GetElem(string->GetData()));
+        auto *string = bit_cast<coretypes::String *>(GetReg(decoder.GetSecondReg()).GetValue());
+        auto *object = bit_cast<coretypes::Object *>(GetReg(decoder.GetFirstReg()).GetValue());
+        GetAcc().Set(*object->GetElem(string->GetData()));
         if (GetAcc().GetType() == Type::FUNC) {
+            Runtime::GetGC()->WriteBarrier(GetAcc(), *GetAcc().GetAsFunction()->GetThis(), GetReg(decoder.GetFirstReg()));
             GetAcc().GetAsFunction()->SetThis(GetReg(decoder.GetFirstReg()));
         }
         ADVANCE_FETCH_AND_DISPATCH();
@@ -317,6 +457,11 @@ int Interpreter::Invoke()
         GetAcc().Dump();
         ADVANCE_FETCH_AND_DISPATCH();
     }
+    CHECKPOINT: {
+        // Doesn't return if a runtime image is requested:
+        Runtime::OnCheckpoint();
+        ADVANCE_FETCH_AND_DISPATCH();
+    }
 }
 
 #undef FETCH_AND_DISPATCH
@@ -2,22 +2,31 @@
 #define INTERPRETER_INTERPRETER_H
 
 #include "bytecode_instruction.h"
+#include "generated/inst_dataflow.h"
 #include "register.h"
 #include "allocator/containers.h"
 #include "classfile/class_file.h"
 
 namespace k3s {
 
+class Module;
+
 class Interpreter {
 public:
+    // Registers r16..r255 are reachable by `opc_r8` instructions only, they are allocated on first access:
+    static constexpr size_t N_FAR_REGS = InstDataflow::MAX_REGS - InstDataflow::N_REGS;
+
     Interpreter()
     {
-        state_stack_.reserve(Allocator::StackRegionT::MAX_ALLOC_SIZE / sizeof(InterpreterState));
+        state_stack_.reserve((Allocator::StackRegionT::MAX_ALLOC_SIZE - Allocator::FAR_REGS_STACK_SIZE) / sizeof(InterpreterState));
+        far_regs_.reserve(Allocator::FAR_REGS_STACK_SIZE / sizeof(Register));
     }
     // Returns after execution of Opcode::RET with empty call stack
     int Invoke();
+    // Continues execution of the restored call stack (see `Runtime::Restore`)
+    int Resume();
 
-    void SetProgram(BytecodeInstruction *program)
+    void SetProgram(const BytecodeInstruction *program)
     {
         program_ = program;
     }
@@ -27,6 +36,18 @@ public:
         pc_ = pc;
     }
 
+    size_t GetPc() const
+    {
+        return pc_;
+    }
+
+    /// Returns pc of the instruction at which the frame is suspended (for caller frames, the call instruction):
+    size_t GetFramePc(size_t frame_idx) const
+    {
+        ASSERT(frame_idx < state_stack_.size());
+        return (frame_idx + 1 == state_stack_.size()) ? pc_ : state_stack_[frame_idx + 1].caller_pc_;
+    }
+
     const auto &Fetch() const
     {
         return program_[pc_];
@@ -40,14 +61,13 @@ public:
         static_assert(sizeof...(reg_types) == sizeof...(RegsIds));
 
         const auto &reg = GetReg(reg_id);
+        if ((reg_type != Type::ANY) && (reg.GetType() != reg_type)) {
+            return false;
+        }
         if constexpr (sizeof...(reg_types) != 0) {
-            if ((reg_type == Type::ANY) || (reg.GetType() == reg_type)){
-                return CheckRegsType<reg_types...>(regs_ids...);
-            }
-        } else {
-            return true;
+            return CheckRegsType<reg_types...>(regs_ids...);
         }
-        return false;
+        return true;
     }
 
     template <Type acc_type, Type... reg_types, typename... RegsIds>
@@ -67,13 +87,50 @@ public:
 
     const Register &GetReg(size_t id) const
     {
+        if (UNLIKELY(id >= InstDataflow::N_REGS)) {
+            return GetFarReg(id);
+        }
         return state_stack_.back().regs_[id];
     }
     Register &GetReg(size_t id)
     {
+        if (UNLIKELY(id >= InstDataflow::N_REGS)) {
+            return GetFarReg(id);
+        }
         return state_stack_.back().regs_[id];
     }
 
+    /// Returns `N_FAR_REGS` far registers of the frame or nullptr if it doesn't use them.
+    Register *GetFarRegs(size_t frame_idx)
+    {
+        size_t idx = state_stack_[frame_idx].far_regs_idx_;
+        return (idx != NO_FAR_REGS) ? &far_regs_[idx] : nullptr;
+    }
+
+    void PopFrame()
+    {
+        if (UNLIKELY(state_stack_.back().far_regs_idx_ != NO_FAR_REGS)) {
+            far_regs_.resize(state_stack_.back().far_regs_idx_);
+        }
+        state_stack_.pop_back();
+    }
+
+    /// Turns the current frame into a fresh frame of \p callee (`tailcall`), the caller and the function object
+    /// which receives the return value stay the same.
+    void ReuseFrame(coretypes::Function *callee)
+    {
+        auto &state = state_stack_.back();
+        if (UNLIKELY(state.far_regs_idx_ != NO_FAR_REGS)) {
+            far_regs_.resize(state.far_regs_idx_);
+            state.far_regs_idx_ = NO_FAR_REGS;
+        }
+        state.acc_.Reset();
+        for (auto &reg : state.regs_) {
+            reg.Reset();
+        }
+        state.callee_ = callee;
+    }
+
     const Register &GetAcc() const
     {
         return state_stack_.back().acc_;
@@ -86,6 +143,10 @@ public:
     {
         return state_stack_.back().callee_;
     }
+    coretypes::Function *GetRetObj()
+    {
+        return state_stack_.back().ret_obj_;
+    }
     auto *GetStateStack()
     {
         return &state_stack_;
@@ -98,19 +159,39 @@ private:
         {
             caller_pc_ = caller_pc;
             callee_ = callee_obj;
+            ret_obj_ = callee_obj;
         }
     public:
         Register acc_ {};
-        Register regs_[16U];
+        Register regs_[InstDataflow::N_REGS];
+        // Index of the far registers of the frame in `far_regs_`:
+        size_t far_regs_idx_ {NO_FAR_REGS};
         size_t caller_pc_ {};
         // This is used for implicit this inside functions:
         coretypes::Function *callee_ = nullptr;
+        // The caller reads the return value from this object: the callee or, after tail calls, the function
+        // which made the first of them:
+        coretypes::Function *ret_obj_ = nullptr;
     };
 
+private:
+    static constexpr size_t NO_FAR_REGS = ~size_t(0);
+
+    int Run();
+    const Register &GetFarReg(size_t id) const;
+    Register &GetFarReg(size_t id);
+    // Should be called when pc may be moved to another module:
+    void UpdateModule();
+
 private:
     size_t pc_ {};
     StackVector<InterpreterState> state_stack_;
-    BytecodeInstruction *program_ {};
+    StackVector<Register> far_regs_;
+    const BytecodeInstruction *program_ {};
+    // The module which contains `pc_`:
+    Module *module_ {};
+    // Bound instructions of `module_` (see `Verifier`), indexed by pc:
+    const InstDecoder::BoundInst *bound_insts_ {};
 };
 
 }  // namespace k3s 
@@ -13,7 +13,7 @@ class Array : public ObjectHeader
 public:
     using elem_t = Register;
 
-    Array(size_t size) : size_(size)
+    Array(size_t size) : ObjectHeader(Type::ARRAY, size)
     {
         for (size_t i = 0; i < size; i++) {
             GetElem(i)->Reset();
@@ -24,7 +24,7 @@ public:
         return &data_[idx]; 
     }
     void SetElem(size_t idx, const Register &val) {
-        ASSERT(idx < size_);
+        ASSERT(idx < GetLength());
         data_[idx] = val;
     }
 
@@ -33,23 +33,24 @@ public:
 
     auto GetSize() const
     {
-        return size_;
+        return GetLength();
     }
 
 private:
-    size_t size_;
     elem_t data_[];
 };
 
+static_assert(sizeof(Array) == ObjectHeader::HEADER_SIZE);
+
 
 template <uintptr_t START_PTR, size_t SIZE>
 inline coretypes::Array *Array::New(GCRegion<START_PTR, SIZE> region, size_t size)
 {
-    size_t allocated_size = sizeof(coretypes::Array) + sizeof(coretypes::Array::elem_t) * size;
-    void *storage = region.AllocBytes(allocated_size);
-    auto *ptr = new (storage) coretypes::Array(size);
-    ptr->SetAllocatedSize(allocated_size);
-    return ptr;
+    if (size > ObjectHeader::MAX_LENGTH) {
+        LOG_FATAL(INTERPRETER, "Array is too long");
+    }
+    void *storage = region.AllocBytesOrLarge(ComputeSize(Type::ARRAY, size));
+    return new (storage) coretypes::Array(size);
 }
 
 }
@@ -10,7 +10,7 @@ namespace k3s::coretypes {
 
 class Function : public ObjectHeader {
 public:
-    Function(size_t target_pc) : target_pc_(target_pc) {}
+    Function(size_t target_pc) : ObjectHeader(Type::FUNCTION, 0), target_pc_(target_pc) {}
 
     size_t GetTargetPc() const {
         return target_pc_;
@@ -64,14 +64,14 @@ private:
     Register outputs_[OUTPUTS_COUNT] {};
 };
 
+static_assert(sizeof(Register) == ObjectHeader::REGISTER_SIZE);
+static_assert(sizeof(Function) == ObjectHeader::FUNCTION_SIZE);
+
 template <uintptr_t START_PTR, size_t SIZE>
 inline coretypes::Function *Function::New(GCRegion<START_PTR, SIZE> reg, size_t bc_offs)
 {
-    size_t allocated_size = sizeof(coretypes::Function);
-    void *storage = reg.AllocBytes(allocated_size);
-    auto *ptr = new (storage) coretypes::Function(bc_offs);
-    ptr->SetAllocatedSize(allocated_size);
-    return ptr;
+    void *storage = reg.AllocBytes(ComputeSize(Type::FUNCTION, 0));
+    return new (storage) coretypes::Function(bc_offs);
 }
 
 }
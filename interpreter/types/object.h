@@ -15,7 +15,7 @@ public:
 
     template <uintptr_t START_PTR, size_t SIZE>
     Object( GCRegion<START_PTR, SIZE> region, const MappingT &map, size_t n_methods,
-            const size_t *bc_offsets) : map_(map)
+            const size_t *bc_offsets) : ObjectHeader(Type::OBJECT, map.size()), map_(map)
     {
         size_t total_members = map.size();
         ASSERT(total_members >= n_methods);
@@ -41,7 +41,7 @@ public:
     }
     size_t GetSize() const
     {
-        return map_.size();
+        return GetLength();
     }
 
     template <uintptr_t START_PTR, size_t SIZE>
@@ -62,19 +62,20 @@ private:
     Register fields_[]; 
 };
 
+static_assert(sizeof(Object) == ObjectHeader::OBJECT_BASE_SIZE);
+
 template <uintptr_t START_PTR, size_t SIZE>
 inline Object *Object::New( GCRegion<START_PTR, SIZE> region,
                             const coretypes::Object::MappingT &mapping,
                             const size_t *bc_offsets_vector)
 {
-    size_t obj_allocated_size = sizeof(coretypes::Object) + sizeof(Register) * mapping.size();
+    size_t obj_allocated_size = ComputeSize(Type::OBJECT, mapping.size());
     size_t methods_n = bc_offsets_vector[0];
-    size_t methods_allocated_size = sizeof(coretypes::Function) * methods_n;
+    size_t methods_allocated_size = ComputeSize(Type::FUNCTION, 0) * methods_n;
     region.PrepareForSequentAllocations(methods_allocated_size + obj_allocated_size);
 
     void *storage = region.AllocBytes(obj_allocated_size);
     auto *ptr = new (storage) coretypes::Object(region, mapping, methods_n, bc_offsets_vector + 1);
-    ptr->SetAllocatedSize(obj_allocated_size);
 
     region.EndSequentAllocations();
     return ptr;
@@ -74,14 +74,48 @@ class ISA
             end
             type_char = operand.slice!(0)
             if type_char == "r" then
-                args["types"].append "REG"
+                args["types"].append "REG_OPERAND"
             elsif type_char == "i" then
-                args["types"].append "IMM"
+                # 4-bit immediates are literals only, wider ones may also be names of constants and labels:
+                args["types"].append(operand == "4" ? "SMALL_IMM" : "IMM")
             end
             args["sizes"].append(operand)
         end
         args
     end
+    # Returns inputs and outputs of the overload as pairs of the location ("acc" or index of a register operand)
+    # and the type. Register operands are bound to inputs first and then to outputs, unless the index is given ("r0"):
+    def self.GetOverloadOperands(overload)
+        reg_idx = 0
+        operands = {}
+        ["in", "out"].each do |kind|
+            operands[kind] = overload[kind].map do |arg|
+                location, type = ParseOverloadArg(arg)
+                if location == "a" then
+                    ["acc", type]
+                elsif location.length > 1 then
+                    [location[1..-1].to_i, type]
+                else
+                    reg_idx += 1
+                    [reg_idx - 1, type]
+                end
+            end
+        end
+        operands
+    end
+    # Returns registers read and written by opcodes of the subgroup: "acc" or index of a register operand.
+    # Overloads may differ, so reads are merged and only writes common to all overloads are kept:
+    def self.GetDataflow(subgroup)
+        uses = []
+        defs = nil
+        subgroup["overloads"].each do |overload|
+            operands = GetOverloadOperands(overload)
+            uses += operands["in"].map { |operand| operand[0] }
+            overload_defs = operands["out"].map { |operand| operand[0] }
+            defs = defs.nil? ? overload_defs : defs & overload_defs
+        end
+        {"uses" => uses.uniq, "defs" => defs || []}
+    end
     def self.GetGrammarArgs(num)
         ["$1", "$2", "$3", "$4"].slice(0, num)
     end
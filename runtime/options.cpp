@@ -0,0 +1,125 @@
+#include "runtime/options.h"
+#include <cstdlib>
+#include <string_view>
+
+namespace k3s {
+
+namespace {
+
+// Flags which don't end with '=' take no value on the command line, they set the option to 1:
+struct OptionDesc
+{
+    std::string_view flag;
+    const char *env_var;
+    size_t RuntimeOptions::*scalar;
+    size_t HeapOptions::*heap_field;
+    bool is_size;
+    const char *RuntimeOptions::*path {nullptr};
+};
+
+constexpr OptionDesc OPTIONS[] = {
+    {"--gc-nursery-size=", "K3S_GC_NURSERY_SIZE", nullptr, &HeapOptions::nursery_size, true},
+    {"--gc-min-nursery-size=", "K3S_GC_MIN_NURSERY_SIZE", nullptr, &HeapOptions::min_nursery_size, true},
+    {"--gc-max-nursery-size=", "K3S_GC_MAX_NURSERY_SIZE", nullptr, &HeapOptions::max_nursery_size, true},
+    {"--gc-tenured-size=", "K3S_GC_TENURED_SIZE", nullptr, &HeapOptions::tenured_size, true},
+    {"--gc-max-heap-size=", "K3S_GC_MAX_HEAP_SIZE", nullptr, &HeapOptions::max_heap_size, true},
+    {"--gc-huge-pages", "K3S_GC_HUGE_PAGES", nullptr, &HeapOptions::huge_pages, false},
+    {"--gc-prefault", "K3S_GC_PREFAULT", nullptr, &HeapOptions::prefault, false},
+    {"--gc-release-evacuated", "K3S_GC_RELEASE_EVACUATED", nullptr, &HeapOptions::release_evacuated, false},
+    {"--gc-pause-budget-us=", "K3S_GC_PAUSE_BUDGET_US", &RuntimeOptions::gc_pause_budget_us, nullptr, false},
+    {"--gc-tenuring-threshold=", "K3S_GC_TENURING_THRESHOLD", &RuntimeOptions::gc_tenuring_threshold, nullptr, false},
+    {"--gc-log", "K3S_GC_LOG", &RuntimeOptions::gc_log, nullptr, false},
+    {"--gc-stats=", "K3S_GC_STATS", nullptr, nullptr, false, &RuntimeOptions::gc_stats_file},
+    {"--alloc-profile=", "K3S_ALLOC_PROFILE", nullptr, nullptr, false, &RuntimeOptions::alloc_profile_file},
+    {"--alloc-sample-interval=", "K3S_ALLOC_SAMPLE_INTERVAL", &RuntimeOptions::alloc_sample_interval, nullptr, true},
+    {"--alloc-profile-survival", "K3S_ALLOC_PROFILE_SURVIVAL", &RuntimeOptions::alloc_profile_survival, nullptr, false},
+    {"--heap-snapshot=", "K3S_HEAP_SNAPSHOT", nullptr, nullptr, false, &RuntimeOptions::heap_snapshot_file},
+    {"--heap-snapshot-at=", "K3S_HEAP_SNAPSHOT_AT", &RuntimeOptions::heap_snapshot_at, nullptr, true},
+    {"--write-image=", "K3S_WRITE_IMAGE", nullptr, nullptr, false, &RuntimeOptions::write_image_file},
+    {"--image=", "K3S_IMAGE", nullptr, nullptr, false, &RuntimeOptions::image_file},
+    {"--code-cache", "K3S_CODE_CACHE", &RuntimeOptions::code_cache, nullptr, false},
+    {"--module-path=", "K3S_MODULE_PATH", nullptr, nullptr, false, &RuntimeOptions::module_path},
+};
+
+bool ParseValue(const char *str, bool is_size, size_t *value)
+{
+    char *end = nullptr;
+    auto parsed = std::strtoull(str, &end, 10);
+    if (end == str) {
+        return false;
+    }
+    if (is_size) {
+        switch (*end) {
+        case 'G':
+            parsed *= 1024U;
+            [[fallthrough]];
+        case 'M':
+            parsed *= 1024U;
+            [[fallthrough]];
+        case 'K':
+            parsed *= 1024U;
+            end++;
+            break;
+        default:
+            break;
+        }
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+bool SetOption(RuntimeOptions *options, const OptionDesc &desc, const char *str)
+{
+    if (desc.path != nullptr) {
+        options->*desc.path = str;
+        return *str != '\0';
+    }
+    size_t *field = (desc.scalar != nullptr) ? &(options->*desc.scalar) : &(options->heap.*desc.heap_field);
+    return ParseValue(str, desc.is_size, field);
+}
+
+}  // namespace
+
+bool RuntimeOptions::Parse(int argc, char *argv[])
+{
+    for (const auto &desc : OPTIONS) {
+        const char *env_value = std::getenv(desc.env_var);
+        if ((env_value != nullptr) && !SetOption(this, desc, env_value)) {
+            std::cerr << "Invalid value of " << desc.env_var << ": " << env_value << std::endl;
+            return false;
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg(argv[i]);
+        bool is_option = false;
+        for (const auto &desc : OPTIONS) {
+            if (arg.substr(0, desc.flag.size()) != desc.flag) {
+                continue;
+            }
+            bool has_value = (desc.flag.back() == '=');
+            if (!has_value && (arg.size() != desc.flag.size())) {
+                continue;
+            }
+            is_option = true;
+            if (!SetOption(this, desc, has_value ? argv[i] + desc.flag.size() : "1")) {
+                std::cerr << "Invalid option: " << arg << std::endl;
+                return false;
+            }
+        }
+        if (is_option) {
+            continue;
+        }
+        if (class_file != nullptr) {
+            return false;
+        }
+        class_file = argv[i];
+    }
+    // The image already contains the program:
+    return (class_file != nullptr) != (image_file != nullptr);
+}
+
+}  // namespace k3s
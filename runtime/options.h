@@ -0,0 +1,69 @@
+#ifndef RUNTIME_OPTIONS_H
+#define RUNTIME_OPTIONS_H
+
+#include "allocator/gc.h"
+#include "allocator/heap_options.h"
+#include <cstddef>
+
+namespace k3s {
+
+/**
+ * Options are read from the environment (`K3S_*` variables) first, command line options override them:
+ *   --gc-nursery-size=SIZE         K3S_GC_NURSERY_SIZE
+ *   --gc-min-nursery-size=SIZE     K3S_GC_MIN_NURSERY_SIZE
+ *   --gc-max-nursery-size=SIZE     K3S_GC_MAX_NURSERY_SIZE
+ *   --gc-tenured-size=SIZE         K3S_GC_TENURED_SIZE
+ *   --gc-max-heap-size=SIZE        K3S_GC_MAX_HEAP_SIZE
+ *   --gc-huge-pages                K3S_GC_HUGE_PAGES=1
+ *   --gc-prefault                  K3S_GC_PREFAULT=1
+ *   --gc-release-evacuated         K3S_GC_RELEASE_EVACUATED=1
+ *   --gc-pause-budget-us=N         K3S_GC_PAUSE_BUDGET_US
+ *   --gc-tenuring-threshold=N      K3S_GC_TENURING_THRESHOLD
+ *   --gc-log                       K3S_GC_LOG=1
+ *   --gc-stats=FILE                K3S_GC_STATS
+ *   --alloc-profile=FILE           K3S_ALLOC_PROFILE
+ *   --alloc-sample-interval=SIZE   K3S_ALLOC_SAMPLE_INTERVAL
+ *   --alloc-profile-survival       K3S_ALLOC_PROFILE_SURVIVAL=1
+ *   --heap-snapshot=FILE           K3S_HEAP_SNAPSHOT
+ *   --heap-snapshot-at=SIZE        K3S_HEAP_SNAPSHOT_AT
+ *   --write-image=FILE             K3S_WRITE_IMAGE
+ *   --image=FILE                   K3S_IMAGE
+ *   --code-cache                   K3S_CODE_CACHE=1
+ *   --module-path=DIR              K3S_MODULE_PATH
+ * Sizes are in bytes and may have K, M or G suffix.
+ * Either a class file or a runtime image (`--image`) should be given.
+ */
+struct RuntimeOptions
+{
+    HeapOptions heap {};
+    size_t gc_pause_budget_us {GC::DEFAULT_PAUSE_BUDGET_US};
+    size_t gc_tenuring_threshold {GC::ADAPTIVE_TENURING_THRESHOLD};
+    // Print a line per GC pause to stderr:
+    size_t gc_log {0};
+    // JSON report of GC telemetry is written to this file at exit:
+    const char *gc_stats_file {nullptr};
+    // Allocations are sampled and the profile is written to this file at exit:
+    const char *alloc_profile_file {nullptr};
+    size_t alloc_sample_interval {AllocationProfiler::DEFAULT_SAMPLING_INTERVAL};
+    // Check whether sampled objects survive the next collection:
+    size_t alloc_profile_survival {0};
+    // Heap snapshots are written to `<heap_snapshot_file>.<N>` on SIGUSR1 and once `heap_snapshot_at` bytes are allocated:
+    const char *heap_snapshot_file {nullptr};
+    size_t heap_snapshot_at {0};
+    // The runtime image is written to this file at `checkpoint`, then the runtime exits:
+    const char *write_image_file {nullptr};
+    // The runtime is restored from this image instead of loading a class file:
+    const char *image_file {nullptr};
+    // Load the class file from `<class_file>.cache` if it is up to date, otherwise write it:
+    size_t code_cache {0};
+    // Imported modules are loaded from `<module_path>/<module>.k3sm`, the directory of the class file by default:
+    const char *module_path {nullptr};
+    const char *class_file {nullptr};
+
+    // Returns false if arguments are malformed:
+    bool Parse(int argc, char *argv[]);
+};
+
+}  // namespace k3s
+
+#endif  // RUNTIME_OPTIONS_H
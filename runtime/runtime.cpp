@@ -1,32 +1,210 @@
 #include "runtime/runtime.h"
+#include "runtime/options.h"
+#include "runtime/runtime_image.h"
 #include "allocator/allocator.h"
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <string_view>
 
 namespace k3s {
 
 Runtime *RUNTIME;
 
-void Runtime::Create()
+// The default module path, it isn't kept by runtime images:
+static std::string MODULE_DIR;
+
+extern "C" void OnHeapSnapshotSignal([[maybe_unused]] int signal)
+{
+    Runtime::GetGC()->RequestHeapSnapshot();
+}
+
+void Runtime::Create(const RuntimeOptions &options)
 {
     Allocator a;
-    a.Init();
+    a.Init(options.heap);
     RUNTIME = new (a.ConstRegion().Alloc<Runtime>(1)) Runtime();
+    ApplyOptions(options);
+}
+
+// Heap layout is taken from the image, the rest of options apply to the resumed run:
+void Runtime::Restore(const RuntimeOptions &options)
+{
+    Allocator::Map();
+    const char *error = nullptr;
+    RUNTIME = static_cast<Runtime *>(runtime_image::Map(options.image_file, 0, &error));
+    if (RUNTIME == nullptr) {
+        LOG_FATAL(RUNTIME, error << ": '" << options.image_file << "'");
+    }
+    ApplyOptions(options);
+}
+
+/**
+ * The code cache holds metadata regions right after loading: the main module with decoded objects, function
+ * and stack map tables and the interpreter set up at the entry point. The heap is empty then, so it is set up anew
+ * with the current options. Imports aren't resolved yet, so imported modules are loaded on their first use
+ * as without the cache.
+ */
+bool Runtime::LoadCodeCache(const RuntimeOptions &options)
+{
+    Allocator::Map();
+    size_t file_size = 0;
+    auto *header = ClassFile::MapClassFile(options.class_file, reinterpret_cast<void *>(Allocator::CLASS_FILE_ADDR),
+                                           Allocator::CLASS_FILE_RESERVED_SIZE, &file_size);
+    const char *error = nullptr;
+    void *runtime = nullptr;
+    if (header != nullptr) {
+        runtime = runtime_image::Map(GetCodeCachePath(options).c_str(), header->checksum, &error);
+    }
+    if (runtime == nullptr) {
+        LOG_INFO(RUNTIME, "Code cache isn't used: " << ((error != nullptr) ? error : "invalid class file"));
+        Allocator::Destroy();
+        return false;
+    }
+    RUNTIME = static_cast<Runtime *>(runtime);
+    Allocator::RuntimeRegionT::Init(options.heap);
+    GetGC()->ResetClock();
+    ApplyOptions(options);
+    return true;
+}
+
+// The cache is written to a temporary file first, so concurrent runs never see it partially written:
+void Runtime::WriteCodeCache(const RuntimeOptions &options)
+{
+    GetModules()->GetMain()->GetConstantPool()->MaterializeObjects();
+    auto path = GetCodeCachePath(options);
+    auto tmp_path = path + "." + std::to_string(getpid());
+    auto *header = GetModules()->GetMain()->GetHeader();
+    if (!runtime_image::Write(tmp_path.c_str(), GetInstance(), header->checksum, Allocator::HEAP_START_ADDR,
+                              Allocator::ALLOC_END_ADDR) ||
+        (std::rename(tmp_path.c_str(), path.c_str()) != 0)) {
+        LOG_INFO(RUNTIME, "Can't write code cache: '" << path << "'");
+        std::remove(tmp_path.c_str());
+    }
+}
+
+std::string Runtime::GetCodeCachePath(const RuntimeOptions &options)
+{
+    return std::string(options.class_file) + ".cache";
+}
+
+// The main module is named after its file, so it may be imported by the modules it loads:
+int Runtime::LoadClassFile(const char *fn)
+{
+    std::string_view name(fn);
+    name.remove_prefix(name.rfind('/') + 1);
+    name = name.substr(0, name.rfind('.'));
+    auto *module = GetModules()->Load(fn, std::string(name).c_str());
+    if (module == nullptr) {
+        return 1;
+    }
+    if (!module->HasEntryPoint()) {
+        std::cerr << "Class file has no `" << ENTRY_FUNC_NAME << "` function: " << fn << std::endl;
+        return 1;
+    }
+    GetInterpreter()->SetProgram(module->GetCode());
+    GetInterpreter()->SetPc(module->GetEntryPc());
+    return 0;
+}
+
+void Runtime::ApplyOptions(const RuntimeOptions &options)
+{
+    GetGC()->SetPauseBudget(options.gc_pause_budget_us);
+    GetGC()->SetTenuringThreshold(options.gc_tenuring_threshold);
+    GetGC()->GetTelemetry()->SetLogEnabled(options.gc_log != 0);
+    if (options.alloc_profile_file != nullptr) {
+        if (options.alloc_sample_interval == 0) {
+            LOG_FATAL(RUNTIME, "Allocation sampling interval should be positive");
+        }
+        GetGC()->GetAllocationProfiler()->Enable(options.alloc_sample_interval, options.alloc_profile_survival != 0);
+    } else if (GetGC()->GetAllocationProfiler()->IsEnabled()) {
+        // Sampling may be enabled by the run which wrote the image:
+        GetGC()->GetAllocationProfiler()->Enable(0, false);
+    }
+    // Paths point to the arguments of the process, so those kept by an image are replaced too:
+    GetGC()->EnableHeapSnapshots(options.heap_snapshot_file, options.heap_snapshot_at);
+    if (options.heap_snapshot_file != nullptr) {
+        std::signal(SIGUSR1, OnHeapSnapshotSignal);
+    }
+    GetInstance()->write_image_path_ = options.write_image_file;
+    if (options.module_path != nullptr) {
+        GetInstance()->module_path_ = options.module_path;
+        return;
+    }
+    // Imported modules are searched next to the main class file (or the image) by default:
+    std::string_view file((options.class_file != nullptr) ? options.class_file : options.image_file);
+    size_t slash = file.rfind('/');
+    MODULE_DIR = (slash == std::string_view::npos) ? std::string(".") : std::string(file.substr(0, slash));
+    GetInstance()->module_path_ = MODULE_DIR.c_str();
+}
+
+/**
+ * The heap is collected at the checkpoint (its stack map describes live registers), then the image is written
+ * with pc of the next instruction, so the restored runtime continues right after the checkpoint.
+ */
+void Runtime::OnCheckpoint()
+{
+    const char *path = GetInstance()->write_image_path_;
+    if (path == nullptr) {
+        return;
+    }
+    GetGC()->PrepareRuntimeImage();
+    GetInterpreter()->SetPc(GetInterpreter()->GetPc() + 1);
+    if (!runtime_image::Write(path, GetInstance(), 0)) {
+        LOG_FATAL(RUNTIME, "Can't write runtime image: '" << path << "'");
+    }
+    std::exit(0);
+}
+
+void Runtime::Finalize(const RuntimeOptions &options)
+{
+    if (options.gc_stats_file != nullptr) {
+        std::ofstream stats(options.gc_stats_file);
+        if (!stats) {
+            LOG_FATAL(RUNTIME, "Can't open file: '" << options.gc_stats_file << "'");
+        }
+        GetGC()->WriteTelemetryJson(stats);
+    }
+    if (options.alloc_profile_file != nullptr) {
+        std::ofstream profile(options.alloc_profile_file);
+        if (!profile) {
+            LOG_FATAL(RUNTIME, "Can't open file: '" << options.alloc_profile_file << "'");
+        }
+        GetGC()->GetAllocationProfiler()->WriteReport(profile);
+    }
 }
 
 }  // namespace k3s
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
+    k3s::RuntimeOptions options;
+    if (!options.Parse(argc, argv)) {
         return 1;
     }
 
-    k3s::Runtime::Create();
-    
-    if (k3s::Runtime::LoadClassFile(argv[1]) != 0) {
-        LOG_FATAL(INTERPRETER, "Loading failed");
+    if (options.image_file != nullptr) {
+        k3s::Runtime::Restore(options);
+        k3s::Runtime::GetInterpreter()->Resume();
+        k3s::Runtime::Finalize(options);
+        return 0;
+    }
+
+    if ((options.code_cache == 0) || !k3s::Runtime::LoadCodeCache(options)) {
+        k3s::Runtime::Create(options);
+        if (k3s::Runtime::LoadClassFile(options.class_file) != 0) {
+            LOG_FATAL(INTERPRETER, "Loading failed");
+        }
+        if (options.code_cache != 0) {
+            k3s::Runtime::WriteCodeCache(options);
+        }
     }
 
     k3s::Runtime::GetInterpreter()->Invoke();
+    k3s::Runtime::Finalize(options);
 
     return 0;
 }
@@ -5,27 +5,35 @@
 #include "allocator/gc.h"
 #include "interpreter/interpreter.h"
 #include "classfile/class_file.h"
+#include "classfile/module.h"
+#include <string>
 
 namespace k3s {
 
 class Runtime;
+struct RuntimeOptions;
 
 extern Runtime *RUNTIME;
 
 class Runtime
 {
 public:
-    static void Create();
+    static void Create(const RuntimeOptions &options);
+    // Maps the runtime image instead of `Create` and `LoadClassFile`, execution continues with `Interpreter::Resume`:
+    static void Restore(const RuntimeOptions &options);
+    // Called by `checkpoint`, writes the runtime image and exits if it is requested:
+    static void OnCheckpoint();
+    // Maps the code cache of the class file instead of `Create` and `LoadClassFile`, returns false if it can't be used:
+    static bool LoadCodeCache(const RuntimeOptions &options);
+    // Should be called right after `LoadClassFile`, failures are ignored as the cache is optional:
+    static void WriteCodeCache(const RuntimeOptions &options);
+    // Should be called when the program is finished:
+    static void Finalize(const RuntimeOptions &options);
     static Runtime *GetInstance()
     {
         return RUNTIME;
     }
 
-    static auto *GetConstantPool()
-    {
-        return &GetInstance()->constant_pool_;
-    }
-
     static auto *GetInterpreter()
     {
         return &GetInstance()->interpreter_;
@@ -41,26 +49,32 @@ public:
         return &GetInstance()->gc_;
     }
 
-    static int LoadClassFile(const char *fn)
+    static auto *GetModules()
     {
-        ClassFileHeader *header;
-        BytecodeInstruction *instructions_buffer;
+        return &GetInstance()->modules_;
+    }
 
-        int err_code = ClassFile::LoadClassFile(fn, &header, 
-                                            &instructions_buffer, GetConstantPool(), GetAllocator());
-        if (err_code != 0) {
-            return err_code;
-        }
-        GetInterpreter()->SetPc(header->entry_point);
-        GetInterpreter()->SetProgram(instructions_buffer);
-        return 0;
+    // Loads the main module, others are loaded by `LinkImport`:
+    static int LoadClassFile(const char *fn);
+
+    // Resolves the import of \p module on its first use:
+    static void LinkImport(Module *module, uint8_t constant_pool_id)
+    {
+        GetModules()->Link(module, constant_pool_id, GetInstance()->module_path_);
     }
 
+private:
+    // Options which aren't kept by the runtime image, as they refer to the process:
+    static void ApplyOptions(const RuntimeOptions &options);
+    static std::string GetCodeCachePath(const RuntimeOptions &options);
+
 private:
     Allocator allocator_ {};
     GC gc_{};
     Interpreter interpreter_ {};
-    ConstantPool constant_pool_ {};
+    ModuleTable modules_ {};
+    const char *write_image_path_ {nullptr};
+    const char *module_path_ {nullptr};
 };
 
 }  // namespace k3s
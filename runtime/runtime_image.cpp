@@ -0,0 +1,245 @@
+#include "runtime/runtime_image.h"
+#include "allocator/allocator.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace k3s::runtime_image {
+
+namespace {
+
+// Flags of /proc/self/pagemap entries, pages without them were never touched and read as zeros:
+constexpr uint64_t PAGEMAP_PRESENT = uint64_t(1) << 63U;
+constexpr uint64_t PAGEMAP_SWAPPED = uint64_t(1) << 62U;
+
+struct Mapping
+{
+    Range range;
+    // Pages of file mappings (the class file) are always stored:
+    bool is_file;
+};
+
+bool GetExeIdentity(uint64_t *size, uint64_t *mtime)
+{
+    struct stat exe_stat {};
+    if (stat("/proc/self/exe", &exe_stat) != 0) {
+        return false;
+    }
+    *size = exe_stat.st_size;
+    *mtime = exe_stat.st_mtim.tv_sec * 1000000000ULL + exe_stat.st_mtim.tv_nsec;
+    return true;
+}
+
+// Readable mappings within [ALLOC_START_ADDR, ALLOC_END_ADDR) except [skip_start, skip_end),
+// reserved ranges are mapped by `Allocator::Map`:
+std::vector<Mapping> ReadMappings(uintptr_t skip_start, uintptr_t skip_end)
+{
+    std::vector<Mapping> mappings;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        unsigned long start = 0;
+        unsigned long end = 0;
+        char perms[5] {};
+        unsigned long long offset = 0;
+        unsigned int dev_major = 0;
+        unsigned int dev_minor = 0;
+        unsigned long inode = 0;
+        if (std::sscanf(line.c_str(), "%lx-%lx %4s %llx %x:%x %lu", &start, &end, perms, &offset, &dev_major,
+                        &dev_minor, &inode) != 7) {
+            continue;
+        }
+        if (perms[0] != 'r') {
+            continue;
+        }
+        uint32_t prot = PROT_READ | ((perms[1] == 'w') ? PROT_WRITE : 0);
+        // Adjacent anonymous mappings are merged by the kernel, so the skipped range may split a mapping:
+        std::pair<unsigned long, unsigned long> parts[] = {{start, std::min<unsigned long>(end, skip_start)},
+                                                           {std::max<unsigned long>(start, skip_end), end}};
+        for (auto [part_start, part_end] : parts) {
+            part_start = std::max<unsigned long>(part_start, Allocator::ALLOC_START_ADDR);
+            part_end = std::min<unsigned long>(part_end, Allocator::ALLOC_END_ADDR);
+            if (part_start < part_end) {
+                mappings.push_back({{part_start, part_end - part_start, prot, 0}, inode != 0});
+            }
+        }
+    }
+    return mappings;
+}
+
+bool IsZeroPage(uintptr_t addr)
+{
+    const auto *words = reinterpret_cast<const uint64_t *>(addr);
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends runs of pages of \p mapping which should be stored. Without pagemap every page is checked:
+void CollectRuns(const Mapping &mapping, int pagemap_fd, std::vector<Run> *runs)
+{
+    size_t n_pages = mapping.range.size / PAGE_SIZE;
+    std::vector<uint64_t> entries;
+    if (!mapping.is_file && (pagemap_fd != -1)) {
+        entries.resize(n_pages);
+        size_t entries_size = n_pages * sizeof(uint64_t);
+        off_t entries_offset = mapping.range.addr / PAGE_SIZE * sizeof(uint64_t);
+        if (pread(pagemap_fd, entries.data(), entries_size, entries_offset) != static_cast<ssize_t>(entries_size)) {
+            entries.clear();
+        }
+    }
+    Run *last = nullptr;
+    for (size_t i = 0; i < n_pages; i++) {
+        uintptr_t addr = mapping.range.addr + i * PAGE_SIZE;
+        bool is_stored = mapping.is_file;
+        if (!is_stored) {
+            bool is_touched = entries.empty() || ((entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) != 0);
+            is_stored = is_touched && !IsZeroPage(addr);
+        }
+        if (!is_stored) {
+            last = nullptr;
+            continue;
+        }
+        if (last != nullptr) {
+            last->size += PAGE_SIZE;
+            continue;
+        }
+        runs->push_back({addr, PAGE_SIZE, 0, mapping.range.prot, 0});
+        last = &runs->back();
+    }
+}
+
+bool IsWithinRegions(uint64_t addr, uint64_t size)
+{
+    return (addr % PAGE_SIZE == 0) && (size % PAGE_SIZE == 0) && (addr >= Allocator::ALLOC_START_ADDR) &&
+           (addr <= Allocator::ALLOC_END_ADDR) && (size <= Allocator::ALLOC_END_ADDR - addr);
+}
+
+}  // namespace
+
+bool Write(const char *path, const void *runtime, uint64_t key, uintptr_t skip_start, uintptr_t skip_end)
+{
+    Header header {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    if (!GetExeIdentity(&header.exe_size, &header.exe_mtime)) {
+        return false;
+    }
+    header.key = key;
+    auto mappings = ReadMappings(skip_start, skip_end);
+    std::vector<Range> ranges;
+    std::vector<Run> runs;
+    int pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    for (const auto &mapping : mappings) {
+        ranges.push_back(mapping.range);
+        CollectRuns(mapping, pagemap_fd, &runs);
+    }
+    if (pagemap_fd != -1) {
+        close(pagemap_fd);
+    }
+    header.runtime_addr = reinterpret_cast<uintptr_t>(runtime);
+    header.n_ranges = ranges.size();
+    header.n_runs = runs.size();
+
+    size_t tables_size = sizeof(Header) + ranges.size() * sizeof(Range) + runs.size() * sizeof(Run);
+    size_t offset = AlignUp(tables_size, PAGE_SIZE);
+    for (auto &run : runs) {
+        run.offset = offset;
+        offset += run.size;
+    }
+
+    std::ofstream os(path, std::ios::binary);
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char *>(ranges.data()), ranges.size() * sizeof(Range));
+    os.write(reinterpret_cast<const char *>(runs.data()), runs.size() * sizeof(Run));
+    std::vector<char> padding(AlignUp(tables_size, PAGE_SIZE) - tables_size);
+    os.write(padding.data(), padding.size());
+    for (const auto &run : runs) {
+        os.write(reinterpret_cast<const char *>(run.addr), run.size);
+    }
+    os.flush();
+    return static_cast<bool>(os);
+}
+
+void *Map(const char *path, uint64_t key, const char **error)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        *error = "Can't open runtime image";
+        return nullptr;
+    }
+    auto fail = [fd, error](const char *reason) -> void * {
+        close(fd);
+        *error = reason;
+        return nullptr;
+    };
+
+    struct stat file_stat {};
+    Header header {};
+    if ((fstat(fd, &file_stat) != 0) || (pread(fd, &header, sizeof(header), 0) != sizeof(header)) ||
+        (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)) {
+        return fail("Not a runtime image");
+    }
+    uint64_t exe_size = 0;
+    uint64_t exe_mtime = 0;
+    if (!GetExeIdentity(&exe_size, &exe_mtime) || (exe_size != header.exe_size) || (exe_mtime != header.exe_mtime)) {
+        return fail("Runtime image is written by another executable");
+    }
+    if (header.key != key) {
+        return fail("Runtime image is written for another program");
+    }
+    std::vector<Range> ranges(header.n_ranges);
+    std::vector<Run> runs(header.n_runs);
+    auto ranges_size = static_cast<ssize_t>(ranges.size() * sizeof(Range));
+    auto runs_size = static_cast<ssize_t>(runs.size() * sizeof(Run));
+    if ((pread(fd, ranges.data(), ranges_size, sizeof(Header)) != ranges_size) ||
+        (pread(fd, runs.data(), runs_size, sizeof(Header) + ranges_size) != runs_size)) {
+        return fail("Invalid runtime image");
+    }
+    // The runtime is allocated in the const region:
+    if ((header.runtime_addr < Allocator::ALLOC_START_ADDR) ||
+        (header.runtime_addr >= Allocator::ALLOC_START_ADDR + Allocator::CONST_SIZE)) {
+        return fail("Invalid runtime image");
+    }
+    auto file_size = static_cast<uint64_t>(file_stat.st_size);
+    for (const auto &range : ranges) {
+        if (!IsWithinRegions(range.addr, range.size)) {
+            return fail("Invalid runtime image");
+        }
+    }
+    for (const auto &run : runs) {
+        if (!IsWithinRegions(run.addr, run.size) || (run.offset % PAGE_SIZE != 0) || (run.offset > file_size) ||
+            (run.size > file_size - run.offset)) {
+            return fail("Invalid runtime image");
+        }
+    }
+
+    // Zero pages stay anonymous, the rest are read from the file on demand:
+    for (const auto &range : ranges) {
+        void *addr = reinterpret_cast<void *>(range.addr);
+        if (mmap(addr, range.size, range.prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) != addr) {
+            return fail("Can't map runtime image");
+        }
+    }
+    for (const auto &run : runs) {
+        void *addr = reinterpret_cast<void *>(run.addr);
+        if (mmap(addr, run.size, run.prot, MAP_PRIVATE | MAP_FIXED, fd, run.offset) != addr) {
+            return fail("Can't map runtime image");
+        }
+    }
+    close(fd);
+    return reinterpret_cast<void *>(header.runtime_addr);
+}
+
+}  // namespace k3s::runtime_image
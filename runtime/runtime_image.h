@@ -0,0 +1,69 @@
+#ifndef RUNTIME_RUNTIME_IMAGE_H
+#define RUNTIME_RUNTIME_IMAGE_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace k3s {
+
+/**
+ * Runtime image is a copy of the memory of `Allocator` regions and of the class file mapping, taken at `checkpoint`.
+ * Every pointer of the runtime (including the interpreter state and the heap) is within
+ * [ALLOC_START_ADDR, ALLOC_END_ADDR), so the image is mapped back at the same addresses and execution continues
+ * after the checkpoint, e.g. to skip initialization of a program.
+ *
+ * The file starts with `Header`, followed by `n_ranges` of `Range` (accessible mappings with their protection)
+ * and `n_runs` of `Run` (pages of the ranges which aren't zero), then contents of the runs at page-aligned offsets.
+ * Runs are mapped privately from the file: pages are read on first access and copied on first write.
+ * An image is valid only for the binary which wrote it.
+ *
+ * The code cache (`--code-cache`) is an image of the metadata regions only, taken right after the class file is
+ * loaded. Its key is the checksum of the class file, which is mapped at the same address again.
+ */
+namespace runtime_image {
+
+static constexpr char MAGIC[8] = "K3SIMG2";
+
+struct Header
+{
+    char magic[sizeof(MAGIC)];
+    // Identity of the executable which wrote the image:
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    // Identity of the program for the code cache, zero for images written at a checkpoint:
+    uint64_t key;
+    uint64_t runtime_addr;
+    uint32_t n_ranges;
+    uint32_t n_runs;
+};
+
+struct Range
+{
+    uint64_t addr;
+    uint64_t size;
+    uint32_t prot;
+    uint32_t reserved;
+};
+
+struct Run
+{
+    uint64_t addr;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t prot;
+    uint32_t reserved;
+};
+
+/// Writes the image of the running process to \p path, returns false if the file can't be written.
+/// Memory in [\p skip_start, \p skip_end) isn't stored, it should be set up by the process which maps the image.
+bool Write(const char *path, const void *runtime, uint64_t key, uintptr_t skip_start = 0, uintptr_t skip_end = 0);
+
+/// Maps the image from \p path over the ranges reserved by `Allocator::Map` if it was written with \p key.
+/// Returns the address of the runtime or nullptr if the image can't be used, \p error describes the reason then.
+void *Map(const char *path, uint64_t key, const char **error);
+
+}  // namespace runtime_image
+
+}  // namespace k3s
+
+#endif  // RUNTIME_RUNTIME_IMAGE_H